@@ -8,6 +8,14 @@
 
 #define DEBUG_CHECKSET 0
 
+/*
+ * Cancellation point of the set operations, reporting the visited
+ * elements to 'cancel' every SET_CANCEL_INTERVAL elements.
+ */
+#define CANCEL_POINT(visited, cancel, arg)                     \
+    ((cancel) != NULL && ++(visited) == SET_CANCEL_INTERVAL && \
+     ((visited) = 0, (cancel)((arg), SET_CANCEL_INTERVAL)))
+
 struct treenode;
 typedef struct treenode treenode_t;
 
@@ -173,6 +181,11 @@ int set_size(set_t *set)
     return set->size;
 }
 
+size_t set_bytes(set_t *set)
+{
+    return sizeof(set_t) + set->size * sizeof(treenode_t);
+}
+
 static treenode_t *skew(treenode_t *root)
 {
     if (root->left->level == root->level)
@@ -303,11 +316,48 @@ static set_t *buildset(list_t *list, cmpfunc_t cmpfunc)
     return set;
 }
 
-set_t *set_union(set_t *a, set_t *b)
+/*
+ * Returns the first node whose element is at least 'elem', or the
+ * null node if there is none.
+ */
+static treenode_t *lowerbound(set_t *set, void *elem)
+{
+    treenode_t *n = set->root;
+    treenode_t *found = nullNode;
+
+    while (n != nullNode)
+    {
+        if (set->cmpfunc(n->elem, elem) >= 0)
+        {
+            found = n;
+            n = n->left;
+        }
+        else
+        {
+            n = n->right;
+        }
+    }
+    return found;
+}
+
+/*
+ * Finds the first node of the given range, and the node following
+ * its last node.  NULL bounds leave the range open.
+ */
+static void findrange(set_t *set, void *lo, void *hi,
+                      treenode_t **first, treenode_t **end)
+{
+    *first = (lo == NULL) ? set->first : lowerbound(set, lo);
+    *end = (hi == NULL) ? nullNode : lowerbound(set, hi);
+}
+
+set_t *set_union_range(set_t *a, set_t *b, void *lo, void *hi,
+                       set_cancelfunc_t cancel, void *arg)
 {
     int cmp;
+    long visited = 0;
     list_t *result;
-    treenode_t *na, *nb;
+    treenode_t *na, *nb, *enda, *endb;
 
     if (a->cmpfunc != b->cmpfunc)
     {
@@ -317,11 +367,13 @@ set_t *set_union(set_t *a, set_t *b)
 
     /* Merge the two sets into a sorted list */
     result = list_create(a->cmpfunc);
-    na = a->first;
-    nb = b->first;
+    findrange(a, lo, hi, &na, &enda);
+    findrange(b, lo, hi, &nb, &endb);
 
-    while (na != nullNode && nb != nullNode)
+    while (na != enda && nb != endb)
     {
+        if (CANCEL_POINT(visited, cancel, arg))
+            goto cancelled;
         cmp = a->cmpfunc(na->elem, nb->elem);
         if (cmp < 0)
         {
@@ -344,21 +396,38 @@ set_t *set_union(set_t *a, set_t *b)
         }
     }
     /* Plus what's left of the remaining set (either a or b) */
-    for (; na != nullNode; na = na->next)
+    for (; na != enda; na = na->next)
+    {
+        if (CANCEL_POINT(visited, cancel, arg))
+            goto cancelled;
         list_addlast(result, na->elem);
+    }
 
-    for (; nb != nullNode; nb = nb->next)
+    for (; nb != endb; nb = nb->next)
+    {
+        if (CANCEL_POINT(visited, cancel, arg))
+            goto cancelled;
         list_addlast(result, nb->elem);
+    }
+
+    if (cancel != NULL && visited > 0 && cancel(arg, visited))
+        goto cancelled;
 
     /* Convert the sorted list into a balanced tree */
     return buildset(result, a->cmpfunc);
+
+cancelled:
+    list_destroy(result);
+    return NULL;
 }
 
-set_t *set_intersection(set_t *a, set_t *b)
+set_t *set_intersection_range(set_t *a, set_t *b, void *lo, void *hi,
+                              set_cancelfunc_t cancel, void *arg)
 {
     int cmp;
+    long visited = 0;
     list_t *result;
-    treenode_t *na, *nb;
+    treenode_t *na, *nb, *enda, *endb;
 
     if (a->cmpfunc != b->cmpfunc)
     {
@@ -369,11 +438,13 @@ set_t *set_intersection(set_t *a, set_t *b)
     /* Merge the two sets into a sorted list,
        keeping common elements only */
     result = list_create(a->cmpfunc);
-    na = a->first;
-    nb = b->first;
+    findrange(a, lo, hi, &na, &enda);
+    findrange(b, lo, hi, &nb, &endb);
 
-    while (na != nullNode && nb != nullNode)
+    while (na != enda && nb != endb)
     {
+        if (CANCEL_POINT(visited, cancel, arg))
+            goto cancelled;
         cmp = a->cmpfunc(na->elem, nb->elem);
         if (cmp < 0)
         {
@@ -393,15 +464,24 @@ set_t *set_intersection(set_t *a, set_t *b)
             nb = nb->next;
         }
     }
+    if (cancel != NULL && visited > 0 && cancel(arg, visited))
+        goto cancelled;
+
     /* Convert the sorted list into a balanced tree */
     return buildset(result, a->cmpfunc);
+
+cancelled:
+    list_destroy(result);
+    return NULL;
 }
 
-set_t *set_difference(set_t *a, set_t *b)
+set_t *set_difference_range(set_t *a, set_t *b, void *lo, void *hi,
+                            set_cancelfunc_t cancel, void *arg)
 {
     int cmp;
+    long visited = 0;
     list_t *result;
-    treenode_t *na, *nb;
+    treenode_t *na, *nb, *enda, *endb;
 
     if (a->cmpfunc != b->cmpfunc)
     {
@@ -412,11 +492,13 @@ set_t *set_difference(set_t *a, set_t *b)
     /* Merge the two sets into a sorted list,
        keeping only elements that occur in a and not b */
     result = list_create(a->cmpfunc);
-    na = a->first;
-    nb = b->first;
+    findrange(a, lo, hi, &na, &enda);
+    findrange(b, lo, hi, &nb, &endb);
 
-    while (na != nullNode && nb != nullNode)
+    while (na != enda && nb != endb)
     {
+        if (CANCEL_POINT(visited, cancel, arg))
+            goto cancelled;
         cmp = a->cmpfunc(na->elem, nb->elem);
         if (cmp < 0)
         {
@@ -437,11 +519,52 @@ set_t *set_difference(set_t *a, set_t *b)
         }
     }
     /* Plus what's left of a */
-    for (; na != nullNode; na = na->next)
+    for (; na != enda; na = na->next)
+    {
+        if (CANCEL_POINT(visited, cancel, arg))
+            goto cancelled;
         list_addlast(result, na->elem);
+    }
+
+    if (cancel != NULL && visited > 0 && cancel(arg, visited))
+        goto cancelled;
 
     /* Convert the sorted list into a balanced tree */
     return buildset(result, a->cmpfunc);
+
+cancelled:
+    list_destroy(result);
+    return NULL;
+}
+
+set_t *set_union_cancel(set_t *a, set_t *b, set_cancelfunc_t cancel, void *arg)
+{
+    return set_union_range(a, b, NULL, NULL, cancel, arg);
+}
+
+set_t *set_intersection_cancel(set_t *a, set_t *b, set_cancelfunc_t cancel, void *arg)
+{
+    return set_intersection_range(a, b, NULL, NULL, cancel, arg);
+}
+
+set_t *set_difference_cancel(set_t *a, set_t *b, set_cancelfunc_t cancel, void *arg)
+{
+    return set_difference_range(a, b, NULL, NULL, cancel, arg);
+}
+
+set_t *set_union(set_t *a, set_t *b)
+{
+    return set_union_cancel(a, b, NULL, NULL);
+}
+
+set_t *set_intersection(set_t *a, set_t *b)
+{
+    return set_intersection_cancel(a, b, NULL, NULL);
+}
+
+set_t *set_difference(set_t *a, set_t *b)
+{
+    return set_difference_cancel(a, b, NULL, NULL);
 }
 
 set_t *set_copy(set_t *set)
@@ -457,6 +580,80 @@ set_t *set_copy(set_t *set)
     return buildset(list, set->cmpfunc);
 }
 
+/*
+ * Stores the elements of the top 'depth' levels of the given tree in
+ * 'pivots' in sorted order, starting at index 'i'.  Returns the index
+ * following the last element stored.
+ */
+static int collectpivots(treenode_t *n, int depth, void **pivots, int i)
+{
+    if (n == nullNode || depth == 0)
+        return i;
+    i = collectpivots(n->left, depth - 1, pivots, i);
+    pivots[i++] = n->elem;
+    return collectpivots(n->right, depth - 1, pivots, i);
+}
+
+int set_pivots(set_t *set, void **pivots, int n)
+{
+    int depth = 0;
+
+    /* The top d levels of a full tree hold 2^d - 1 nodes */
+    while ((2 << depth) - 1 <= n)
+        depth++;
+    return collectpivots(set->root, depth, pivots, 0);
+}
+
+/*
+ * Rebuilds a balanced tree from the N first nodes of the given chain
+ * of nodes, linked in sorted order, and advances the chain past them.
+ * Returns the root of the tree.
+ */
+static treenode_t *relinktree(treenode_t **chain, int N)
+{
+    treenode_t *root, *left;
+
+    if (N == 0)
+        return nullNode;
+
+    left = relinktree(chain, N - N / 2 - 1);
+    root = *chain;
+    *chain = root->next;
+    root->left = left;
+    root->level = left->level + 1;
+    root->right = relinktree(chain, N / 2);
+    return root;
+}
+
+set_t *set_concat(set_t **sets, int n)
+{
+    set_t *set = set_create(sets[0]->cmpfunc);
+    treenode_t *last = nullNode, *chain;
+    int i;
+
+    /* Chain the lists of the sets, then rebalance over the whole chain */
+    for (i = 0; i < n; i++)
+    {
+        if (sets[i]->size > 0)
+        {
+            if (last == nullNode)
+                set->first = sets[i]->first;
+            else
+                last->next = sets[i]->first;
+            for (last = sets[i]->root; last->right != nullNode; last = last->right)
+                ;
+            set->size += sets[i]->size;
+        }
+        free(sets[i]);
+    }
+    chain = set->first;
+    set->root = relinktree(&chain, set->size);
+
+    if (DEBUG_CHECKSET)
+        checkset(set);
+    return set;
+}
+
 set_iter_t *set_createiter(set_t *set)
 {
     set_iter_t *iter;
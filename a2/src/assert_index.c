@@ -16,6 +16,7 @@
 #define WORD_LENGTH (10)
 #define NUM_ITEMS (500)
 #define NUM_DOCS (50)
+#define NUM_BATCH (2 * NUM_DOCS)
 
 typedef struct document
 {
@@ -25,23 +26,6 @@ typedef struct document
 
 static document_t docs[NUM_DOCS];
 
-/* Generates a random sequence of characters given a seed */
-char *generate_string(unsigned int *seed)
-{
-    int i;
-    int len;
-    char *s;
-
-    len = (rand_r(seed) % WORD_LENGTH) + 1;
-
-    /* Generate a random string of characters */
-    s = calloc(sizeof(char), len + 1);
-    for (i = 0; i < len; i++)
-        s[i] = 'a' + (rand_r(seed) % ('z' - 'a'));
-
-    return s;
-}
-
 /* Generates a list of words which acts a a document */
 void initialize_document(document_t *doc, unsigned int seed)
 {
@@ -54,7 +38,7 @@ void initialize_document(document_t *doc, unsigned int seed)
 
     for (i = 0; i < NUM_ITEMS; i++)
     {
-        word = generate_string(&seed);
+        word = generate_string(&seed, WORD_LENGTH);
 
         if (set_contains(doc->terms, word))
             free(word);
@@ -136,6 +120,637 @@ void validate_index(index_t *ind)
     list_destroy(query);
 }
 
+/* Validates that "more like this" queries exclude the document itself and are ranked */
+void validate_morelikethis(index_t *ind)
+{
+    int i;
+    double prev;
+    list_t *result;
+    char *errmsg;
+    query_result_t *res;
+
+    for (i = 0; i < NUM_DOCS; i++)
+    {
+        result = index_morelikethis(ind, docs[i].path, 5, &errmsg);
+        if (result == NULL)
+        {
+            fatal_error("Query resulted in the following error: %s", errmsg);
+        }
+        if (list_size(result) == 0 || list_size(result) > 5)
+        {
+            fatal_error("Unexpected number of similar documents: path=%s size=%d",
+                        docs[i].path, list_size(result));
+        }
+
+        prev = -1;
+        while (list_size(result) > 0)
+        {
+            res = list_popfirst(result);
+            if (strcmp(res->path, docs[i].path) == 0)
+            {
+                fatal_error("Document was returned as similar to itself: path=%s", docs[i].path);
+            }
+            if (prev >= 0 && res->score > prev)
+            {
+                fatal_error("Similar documents are not ranked: path=%s", docs[i].path);
+            }
+            prev = res->score;
+            free(res);
+        }
+        list_destroy(result);
+    }
+}
+
+/* Validates that snippets are reconstructed with the query term highlighted */
+void validate_snippets(index_t *ind)
+{
+    int i;
+    list_t *query;
+    char *term, *snippet, *highlighted;
+    set_iter_t *iter;
+
+    query = list_create(compare_strings);
+
+    for (i = 0; i < NUM_DOCS; i++)
+    {
+        iter = set_createiter(docs[i].terms);
+        term = (char *)set_next(iter);
+        set_destroyiter(iter);
+
+        list_addfirst(query, term);
+        snippet = index_snippet(ind, docs[i].path, query, "[", "]");
+        if (snippet == NULL)
+        {
+            fatal_error("No snippet for document: path=%s", docs[i].path);
+        }
+
+        highlighted = concatenate_strings(3, "[", term, "]");
+        if (strstr(snippet, highlighted) == NULL)
+        {
+            fatal_error("Snippet does not highlight term: term=%s path=%s snippet=%s",
+                        term, docs[i].path, snippet);
+        }
+        free(highlighted);
+        free(snippet);
+        list_popfirst(query);
+    }
+
+    list_destroy(query);
+}
+
+/* Checks that the top-k results of a query are the same with and without tiers */
+void assert_tiered_topk(index_t *ind, list_t *query, int k, int tiersize)
+{
+    int j;
+    list_t *full, *tiered;
+    char *errmsg;
+    query_result_t *a, *b;
+
+    index_buildtiers(ind, 0);
+    full = index_query_topk(ind, query, k, &errmsg);
+    index_buildtiers(ind, tiersize);
+    tiered = index_query_topk(ind, query, k, &errmsg);
+    if (full == NULL || tiered == NULL)
+    {
+        fatal_error("Query resulted in the following error: %s", errmsg);
+    }
+    if (list_size(full) != list_size(tiered))
+    {
+        fatal_error("Tiered query returned %d results, expected %d",
+                    list_size(tiered), list_size(full));
+    }
+    for (j = 0; list_size(full) > 0; j++)
+    {
+        a = list_popfirst(full);
+        b = list_popfirst(tiered);
+        if (a->score != b->score)
+        {
+            fatal_error("Tiered query result %d has score %f, expected %f",
+                        j, b->score, a->score);
+        }
+        free(a);
+        free(b);
+    }
+    list_destroy(full);
+    list_destroy(tiered);
+}
+
+/* Validates that top-k queries answered from the first tier match the full index */
+void validate_tiers(index_t *ind)
+{
+    int i, k, op;
+    char *ops[] = {"OR", "AND"};
+    list_t *query;
+    set_iter_t *iter;
+
+    query = list_create(compare_strings);
+
+    for (i = 0; i < NUM_DOCS; i++)
+    {
+        for (op = 0; op < 2; op++)
+        {
+            iter = set_createiter(docs[i].terms);
+            list_addlast(query, set_next(iter));
+            list_addlast(query, ops[op]);
+            list_addlast(query, set_next(iter));
+            set_destroyiter(iter);
+
+            for (k = 1; k <= 3; k++)
+                assert_tiered_topk(ind, query, k, 1);
+
+            while (list_size(query) > 0)
+                list_popfirst(query);
+        }
+    }
+
+    index_buildtiers(ind, 0);
+    list_destroy(query);
+}
+
+/* Adds a document of 100 words, 'a' and 'b' times the words "a" and "b" and the rest filler */
+void add_tier_document(index_t *ind, char *path, int a, int b)
+{
+    list_t *words = list_create(compare_strings);
+    int i;
+
+    for (i = 0; i < 100; i++)
+        list_addlast(words, strdup(i < a ? "a" : i < a + b ? "b" : "filler"));
+    index_addpath(ind, strdup(path), words);
+    list_destroy(words);
+}
+
+/*
+ * Checks a conjunctive top-k query whose top results are not all in
+ * the first tier: "D" is pruned from the tier of "b", yet has the
+ * second best score.
+ */
+void validate_tiers_conjunctive()
+{
+    index_t *ind = index_create();
+    list_t *query = list_create(compare_strings);
+
+    add_tier_document(ind, "D", 50, 42);
+    add_tier_document(ind, "X", 45, 50);
+    add_tier_document(ind, "Y", 40, 45);
+    add_tier_document(ind, "Z", 0, 43);
+    add_tier_document(ind, "W1", 1, 0);
+    add_tier_document(ind, "F", 0, 0);
+
+    list_addlast(query, "a");
+    list_addlast(query, "AND");
+    list_addlast(query, "b");
+    assert_tiered_topk(ind, query, 2, 3);
+
+    list_destroy(query);
+    index_destroy(ind);
+}
+
+void validate_explain(index_t *ind)
+{
+    int i;
+    list_t *query, *plain, *explained;
+    set_iter_t *iter;
+    char *errmsg, *explain;
+
+    query = list_create(compare_strings);
+
+    for (i = 0; i < NUM_DOCS; i++)
+    {
+        iter = set_createiter(docs[i].terms);
+        list_addlast(query, set_next(iter));
+        list_addlast(query, "AND");
+        list_addlast(query, set_next(iter));
+        set_destroyiter(iter);
+
+        plain = index_query(ind, query, &errmsg);
+        explained = index_query_explain(ind, query, 0, NULL, &errmsg, &explain);
+        if (plain == NULL || explained == NULL)
+        {
+            fatal_error("Query resulted in the following error: %s", errmsg);
+        }
+        if (list_size(plain) != list_size(explained))
+        {
+            fatal_error("Explained query returned %d results, expected %d",
+                        list_size(explained), list_size(plain));
+        }
+        if (strstr(explain, "AND in=") == NULL)
+        {
+            fatal_error("Explanation is missing the AND operator: %s", explain);
+        }
+        while (list_size(plain) > 0)
+            free(list_popfirst(plain));
+        while (list_size(explained) > 0)
+            free(list_popfirst(explained));
+        list_destroy(plain);
+        list_destroy(explained);
+        free(explain);
+
+        while (list_size(query) > 0)
+            list_popfirst(query);
+    }
+
+    list_destroy(query);
+}
+
+void validate_batch(index_t *ind)
+{
+    int i, threads;
+    list_t **queries, **results, *single;
+    set_iter_t *iter;
+    char *errmsg, **errmsgs;
+    query_result_t *a, *b;
+
+    queries = malloc(NUM_BATCH * sizeof(list_t *));
+    errmsgs = malloc(NUM_BATCH * sizeof(char *));
+
+    /* Every query occurs twice, so that the batch shares intermediate results */
+    for (i = 0; i < NUM_BATCH; i++)
+    {
+        queries[i] = list_create(compare_strings);
+        iter = set_createiter(docs[i % NUM_DOCS].terms);
+        list_addlast(queries[i], set_next(iter));
+        list_addlast(queries[i], "OR");
+        list_addlast(queries[i], set_next(iter));
+        set_destroyiter(iter);
+    }
+
+    for (threads = 1; threads <= 2; threads++)
+    {
+        results = index_query_batch(ind, queries, NUM_BATCH, 0, threads, errmsgs);
+        for (i = 0; i < NUM_BATCH; i++)
+        {
+            single = index_query(ind, queries[i], &errmsg);
+            if (single == NULL || results[i] == NULL)
+            {
+                fatal_error("Query resulted in the following error: %s",
+                            single == NULL ? errmsg : errmsgs[i]);
+            }
+            if (list_size(single) != list_size(results[i]))
+            {
+                fatal_error("Batch query returned %d results, expected %d",
+                            list_size(results[i]), list_size(single));
+            }
+            while (list_size(single) > 0)
+            {
+                a = list_popfirst(single);
+                b = list_popfirst(results[i]);
+                if (a->score != b->score)
+                {
+                    fatal_error("Batch query result has score %f, expected %f",
+                                b->score, a->score);
+                }
+                free(a);
+                free(b);
+            }
+            list_destroy(single);
+            list_destroy(results[i]);
+        }
+        free(results);
+    }
+
+    for (i = 0; i < NUM_BATCH; i++)
+        list_destroy(queries[i]);
+    free(queries);
+    free(errmsgs);
+}
+
+void validate_budget(index_t *ind)
+{
+    int i;
+    list_t *query, *full, *limited;
+    set_iter_t *iter;
+    char *errmsg, *explain;
+    index_budget_t unlimited = {0, 0, 0}, tight = {1, 0, 0};
+
+    query = list_create(compare_strings);
+
+    for (i = 0; i < NUM_DOCS; i++)
+    {
+        iter = set_createiter(docs[i].terms);
+        list_addlast(query, set_next(iter));
+        list_addlast(query, "OR");
+        list_addlast(query, set_next(iter));
+        set_destroyiter(iter);
+
+        full = index_query(ind, query, &errmsg);
+        limited = index_query_budget(ind, query, 0, &unlimited, &errmsg);
+        if (full == NULL || limited == NULL)
+        {
+            fatal_error("Query resulted in the following error: %s", errmsg);
+        }
+        if (list_size(full) != list_size(limited))
+        {
+            fatal_error("Query with a budget returned %d results, expected %d",
+                        list_size(limited), list_size(full));
+        }
+        while (list_size(full) > 0)
+            free(list_popfirst(full));
+        while (list_size(limited) > 0)
+            free(list_popfirst(limited));
+        list_destroy(full);
+        list_destroy(limited);
+
+        /* A union visits at least two postings */
+        limited = index_query_budget(ind, query, 0, &tight, &errmsg);
+        if (limited != NULL || strstr(errmsg, "postings") == NULL)
+        {
+            fatal_error("Query exceeding its budget was not cancelled");
+        }
+        free(errmsg);
+
+        /* Explained queries are held to the budget too */
+        limited = index_query_explain(ind, query, 0, &tight, &errmsg, &explain);
+        if (limited != NULL || strstr(errmsg, "postings") == NULL)
+        {
+            fatal_error("Explained query exceeding its budget was not cancelled");
+        }
+        free(errmsg);
+        free(explain);
+
+        while (list_size(query) > 0)
+            list_popfirst(query);
+    }
+
+    list_destroy(query);
+}
+
+/* Validates that the query returns the same results in parallel as on one thread */
+void compare_parallel(index_t *ind, list_t *query)
+{
+    int j;
+    list_t *sequential, *parallel;
+    char *errmsg;
+    query_result_t *a, *b;
+
+    index_setparallel(ind, 1, 0);
+    sequential = index_query(ind, query, &errmsg);
+    index_setparallel(ind, 4, 0);
+    parallel = index_query(ind, query, &errmsg);
+    if (sequential == NULL || parallel == NULL)
+    {
+        fatal_error("Query resulted in the following error: %s", errmsg);
+    }
+    if (list_size(sequential) != list_size(parallel))
+    {
+        fatal_error("Parallel query returned %d results, expected %d",
+                    list_size(parallel), list_size(sequential));
+    }
+    for (j = 0; list_size(sequential) > 0; j++)
+    {
+        a = list_popfirst(sequential);
+        b = list_popfirst(parallel);
+        if (a->score != b->score)
+        {
+            fatal_error("Parallel query result %d has score %f, expected %f",
+                        j, b->score, a->score);
+        }
+        free(a);
+        free(b);
+    }
+    list_destroy(sequential);
+    list_destroy(parallel);
+}
+
+void validate_parallel(index_t *ind)
+{
+    int i, j;
+    list_t *query;
+    set_iter_t *iter;
+    char *first, *second;
+    char *ops[] = {"OR", "AND", "ANDNOT"};
+
+    query = list_create(compare_strings);
+
+    for (i = 0; i < NUM_DOCS; i++)
+    {
+        /* ( a OR b OR c ) OR ( d AND a ) */
+        iter = set_createiter(docs[i].terms);
+        first = set_next(iter);
+        list_addlast(query, "(");
+        list_addlast(query, first);
+        list_addlast(query, "OR");
+        list_addlast(query, set_next(iter));
+        list_addlast(query, "OR");
+        list_addlast(query, set_next(iter));
+        list_addlast(query, ")");
+        list_addlast(query, "OR");
+        list_addlast(query, "(");
+        list_addlast(query, set_next(iter));
+        list_addlast(query, "AND");
+        list_addlast(query, first);
+        list_addlast(query, ")");
+        set_destroyiter(iter);
+
+        compare_parallel(ind, query);
+        while (list_size(query) > 0)
+            list_popfirst(query);
+
+        /* A single merge of two terms is split by document ranges */
+        iter = set_createiter(docs[i].terms);
+        first = set_next(iter);
+        second = set_next(iter);
+        set_destroyiter(iter);
+        for (j = 0; j < 3; j++)
+        {
+            list_addlast(query, first);
+            list_addlast(query, ops[j]);
+            list_addlast(query, second);
+            compare_parallel(ind, query);
+            while (list_size(query) > 0)
+                list_popfirst(query);
+        }
+    }
+
+    index_setparallel(ind, 1, 0);
+    list_destroy(query);
+}
+
+/* Validates that cached results equal the results of evaluating the query */
+void validate_resultcache(index_t *ind)
+{
+    int i, j;
+    list_t *query, *evaluated, *cached;
+    set_iter_t *iter;
+    char *errmsg;
+    query_result_t *a, *b;
+    index_stats_t stats;
+
+    query = list_create(compare_strings);
+    index_setresultcache(ind, NUM_DOCS);
+
+    for (i = 0; i < NUM_DOCS; i++)
+    {
+        /* a AND b, then ( a AND b ) which has the same normalized form */
+        iter = set_createiter(docs[i].terms);
+        list_addlast(query, set_next(iter));
+        list_addlast(query, "AND");
+        list_addlast(query, set_next(iter));
+        set_destroyiter(iter);
+
+        evaluated = index_query_topk(ind, query, 10, &errmsg);
+        list_addfirst(query, "(");
+        list_addlast(query, ")");
+        cached = index_query_topk(ind, query, 10, &errmsg);
+        if (evaluated == NULL || cached == NULL)
+            fatal_error("Query resulted in the following error: %s", errmsg);
+        if (list_size(evaluated) != list_size(cached))
+        {
+            fatal_error("Cached query returned %d results, expected %d",
+                        list_size(cached), list_size(evaluated));
+        }
+        for (j = 0; list_size(evaluated) > 0; j++)
+        {
+            a = list_popfirst(evaluated);
+            b = list_popfirst(cached);
+            if (a->score != b->score || strcmp(a->path, b->path) != 0)
+                fatal_error("Cached query result %d differs", j);
+            free(a);
+            free(b);
+        }
+        list_destroy(evaluated);
+        list_destroy(cached);
+
+        while (list_size(query) > 0)
+            list_popfirst(query);
+    }
+    list_destroy(query);
+
+    index_stats(ind, &stats);
+    if (stats.result_hits < NUM_DOCS)
+        fatal_error("Expected at least %d result cache hits, got %ld", NUM_DOCS, stats.result_hits);
+    index_setresultcache(ind, 0);
+}
+
+/* Validates that compressed postings decoded through the cache give the same results */
+void validate_compress(index_t *ind)
+{
+    int i, j;
+    list_t *query, *before[NUM_DOCS], *after;
+    set_iter_t *iter;
+    char *errmsg;
+    query_result_t *a, *b;
+    index_stats_t stats;
+
+    query = list_create(compare_strings);
+
+    for (i = 0; i < 2 * NUM_DOCS; i++)
+    {
+        /* a OR b, before compressing and then against the cache */
+        iter = set_createiter(docs[i % NUM_DOCS].terms);
+        list_addlast(query, set_next(iter));
+        list_addlast(query, "OR");
+        list_addlast(query, set_next(iter));
+        set_destroyiter(iter);
+
+        if (i < NUM_DOCS)
+        {
+            before[i] = index_query(ind, query, &errmsg);
+            if (before[i] == NULL)
+                fatal_error("Query resulted in the following error: %s", errmsg);
+        }
+        else
+        {
+            after = index_query(ind, query, &errmsg);
+            if (after == NULL)
+                fatal_error("Query resulted in the following error: %s", errmsg);
+            if (list_size(after) != list_size(before[i - NUM_DOCS]))
+            {
+                fatal_error("Compressed query returned %d results, expected %d",
+                            list_size(after), list_size(before[i - NUM_DOCS]));
+            }
+            for (j = 0; list_size(after) > 0; j++)
+            {
+                a = list_popfirst(before[i - NUM_DOCS]);
+                b = list_popfirst(after);
+                if (a->score != b->score || strcmp(a->path, b->path) != 0)
+                {
+                    fatal_error("Compressed query result %d is %s (%f), expected %s (%f)",
+                                j, b->path, b->score, a->path, a->score);
+                }
+                free(a);
+                free(b);
+            }
+            list_destroy(before[i - NUM_DOCS]);
+            list_destroy(after);
+        }
+
+        while (list_size(query) > 0)
+            list_popfirst(query);
+
+        if (i == NUM_DOCS - 1)
+            index_compress(ind, NUM_DOCS);
+    }
+    list_destroy(query);
+
+    index_stats(ind, &stats);
+    if (stats.cache_misses == 0 || stats.cache_evictions == 0)
+    {
+        fatal_error("Expected cache misses and evictions, got %ld and %ld",
+                    stats.cache_misses, stats.cache_evictions);
+    }
+    if (stats.cache_postings > stats.cache_capacity)
+    {
+        fatal_error("Cache holds %ld postings, more than its capacity of %ld",
+                    stats.cache_postings, stats.cache_capacity);
+    }
+
+    /* Every term must still find its documents */
+    validate_index(ind);
+}
+
+/* Validates that an alias is returned along with the document it duplicates */
+void validate_alias(index_t *ind)
+{
+    int found = 0;
+    list_t *query, *result;
+    set_iter_t *iter;
+    char *errmsg, *snippet, path[32];
+    query_result_t *res, *orig = NULL, *alias = NULL;
+
+    if (index_addalias(ind, strdup("copy_of_document_0.txt"), docs[0].path) != 1)
+        fatal_error("Alias of an indexed document was not added");
+    if (index_addalias(ind, strdup("copy_of_nothing.txt"), "no_such_document.txt") != 0)
+        fatal_error("Alias of a document that is not indexed was added");
+
+    query = list_create(compare_strings);
+    iter = set_createiter(docs[0].terms);
+    list_addlast(query, set_next(iter));
+    set_destroyiter(iter);
+
+    result = index_query(ind, query, &errmsg);
+    if (result == NULL)
+        fatal_error("Query resulted in the following error: %s", errmsg);
+    while (list_size(result) > 0)
+    {
+        res = list_popfirst(result);
+        if (strcmp(res->path, docs[0].path) == 0)
+            orig = res;
+        else if (strcmp(res->path, "copy_of_document_0.txt") == 0)
+            alias = res;
+        else
+            free(res);
+        found++;
+    }
+    list_destroy(result);
+    list_destroy(query);
+
+    if (orig == NULL || alias == NULL)
+        fatal_error("Document or its alias was not returned (%d results)", found);
+    if (orig->score != alias->score)
+        fatal_error("Alias has score %f, expected %f", alias->score, orig->score);
+    free(orig);
+    free(alias);
+
+    /* The alias shares the stored text of the document */
+    query = list_create(compare_strings);
+    strcpy(path, "copy_of_document_0.txt");
+    snippet = index_snippet(ind, path, query, "<", ">");
+    if (snippet == NULL)
+        fatal_error("No snippet for the alias");
+    free(snippet);
+    list_destroy(query);
+}
+
 int main(int argc, char **argv)
 {
     int i;
@@ -143,8 +758,9 @@ int main(int argc, char **argv)
     list_t *words;
     set_iter_t *iter;
 
-    /* Create index */
+    /* Create index, sized for half of the documents so that it also grows past the hint */
     ind = index_create();
+    index_reserve(ind, NUM_DOCS / 2, NUM_DOCS * NUM_ITEMS / 2);
 
     /* Generate random documents */
     for (i = 0; i < NUM_DOCS; i++)
@@ -168,6 +784,47 @@ int main(int argc, char **argv)
     validate_index(ind);
     printf("Success!\n");
 
+    printf("Running a series of more like this queries to validate the forward index...\n");
+    validate_morelikethis(ind);
+    printf("Success!\n");
+
+    printf("Running a series of snippet lookups to validate the document store...\n");
+    validate_snippets(ind);
+    printf("Success!\n");
+
+    printf("Running a series of top-k queries to validate the pruned tier...\n");
+    validate_tiers(ind);
+    validate_tiers_conjunctive();
+    printf("Success!\n");
+
+    printf("Running explain test...\n");
+    validate_explain(ind);
+    printf("Success!\n");
+
+    printf("Running a batch of queries...\n");
+    validate_batch(ind);
+    printf("Success!\n");
+
+    printf("Running a series of queries with a budget...\n");
+    validate_budget(ind);
+    printf("Success!\n");
+
+    printf("Running a series of queries in parallel...\n");
+    validate_parallel(ind);
+    printf("Success!\n");
+
+    printf("Running a series of queries against the result cache...\n");
+    validate_resultcache(ind);
+    printf("Success!\n");
+
+    printf("Running a series of queries against compressed postings...\n");
+    validate_compress(ind);
+    printf("Success!\n");
+
+    printf("Running a query returning an alias of a document...\n");
+    validate_alias(ind);
+    printf("Success!\n");
+
     index_destroy(ind);
 
     /* Cleanup */
@@ -0,0 +1,228 @@
+/*
+ * String hash benchmark.
+ *
+ * Tokenizes the files under a directory like the indexer does, and
+ * compares hash_string() with the byte-at-a-time djb2 hash it replaced:
+ * the time to hash every token, and how evenly the distinct words
+ * spread over a table of as many buckets as the hashmap has when it
+ * holds them, with the bucket taken from the low bits of the hash.
+ * For a uniform hash, a lookup of a word meets 1 + (n - 1) / buckets
+ * words in its bucket on average, and a fraction e^(-n / buckets) of
+ * the buckets is empty.  Results are written as JSON.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "list.h"
+#include "map.h"
+#include "perf.h"
+
+#define DEFAULT_ROUNDS (10)
+
+/* The string hash used before hash_string() */
+static unsigned long hash_djb2(void *str)
+{
+    unsigned char *p = str;
+    unsigned long hash = 5381;
+    int c;
+
+    while ((c = *p++) != 0)
+        hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
+    return hash;
+}
+
+static struct
+{
+    char *name;
+    hashfunc_t hash;
+} hashes[] = {{"djb2", hash_djb2}, {"hash_string", hash_string}};
+#define NUM_HASHES (sizeof(hashes) / sizeof(hashes[0]))
+
+static int compare_ulongs(const void *a, const void *b)
+{
+    unsigned long u1 = *(unsigned long *)a;
+    unsigned long u2 = *(unsigned long *)b;
+    return (u1 > u2) - (u1 < u2);
+}
+
+/* Reads the tokens of all files under the given directory */
+static char **read_tokens(char *root_dir, int *n)
+{
+    char *relpath, *fullpath, **tokens;
+    list_t *files, *words;
+    list_iter_t *iter;
+    int i;
+
+    files = find_files(root_dir);
+    words = list_create(compare_strings);
+    iter = list_createiter(files);
+    while (list_hasnext(iter))
+    {
+        relpath = list_next(iter);
+        fullpath = concatenate_strings(2, root_dir, relpath);
+        tokenize_file(fullpath, words);
+        free(fullpath);
+    }
+    list_destroyiter(iter);
+    while (list_size(files) > 0)
+        free(list_popfirst(files));
+    list_destroy(files);
+
+    *n = list_size(words);
+    tokens = malloc((*n ? *n : 1) * sizeof(char *));
+    if (tokens == NULL)
+        fatal_error("out of memory");
+    for (i = 0; i < *n; i++)
+        tokens[i] = list_popfirst(words);
+    list_destroy(words);
+    return tokens;
+}
+
+static void usage(char *prog)
+{
+    fprintf(stderr, "Usage: %s [-r rounds] [-o file] <root-dir>\n", prog);
+    fprintf(stderr, "  -r rounds  times every token is hashed (default %d)\n", DEFAULT_ROUNDS);
+    fprintf(stderr, "  -o file    write results to file instead of stdout\n");
+}
+
+int main(int argc, char **argv)
+{
+    int i, r, h, opt, n, numwords = 0, numbuckets, maxchain, empty, collisions;
+    int rounds = DEFAULT_ROUNDS;
+    unsigned long sink = 0, *values;
+    double start, elapsed, distinct, probes, bytes = 0, wordbytes = 0;
+    char **tokens, **words;
+    int *chains;
+    map_t *vocabulary;
+    FILE *out = stdout;
+
+    while ((opt = getopt(argc, argv, "r:o:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'r':
+            rounds = atoi(optarg);
+            break;
+        case 'o':
+            out = fopen(optarg, "w");
+            if (out == NULL)
+                fatal_error("Unable to open '%s'", optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc - 1 || rounds < 1)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    if (!is_valid_directory(argv[optind]))
+        return 1;
+
+    tokens = read_tokens(argv[optind], &n);
+    if (n == 0)
+        fatal_error("No words in '%s'", argv[optind]);
+
+    /* The distinct words, as held by the term dictionary */
+    vocabulary = map_create(compare_strings, hash_string);
+    words = malloc(n * sizeof(char *));
+    if (words == NULL)
+        fatal_error("out of memory");
+    for (i = 0; i < n; i++)
+    {
+        bytes += strlen(tokens[i]);
+        if (map_tryget(vocabulary, tokens[i]) == NULL)
+        {
+            map_put(vocabulary, tokens[i], tokens[i]);
+            words[numwords++] = tokens[i];
+            wordbytes += strlen(tokens[i]);
+        }
+    }
+
+    /* The hashmap grows when it holds as many words as buckets */
+    for (numbuckets = 8; numbuckets <= numwords; numbuckets *= 2)
+        ;
+    chains = malloc(numbuckets * sizeof(int));
+    values = malloc(numwords * sizeof(unsigned long));
+    if (chains == NULL || values == NULL)
+        fatal_error("out of memory");
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"corpus\": {\"tokens\": %d, \"words\": %d, \"mean_token_length\": %.2f, "
+                 "\"mean_word_length\": %.2f, \"buckets\": %d},\n",
+            n, numwords, bytes / n, wordbytes / numwords, numbuckets);
+    fprintf(out, "  \"ideal\": {\"mean_chain\": %.3f, \"empty\": %.4f},\n",
+            1 + (numwords - 1) / (double)numbuckets, exp(-numwords / (double)numbuckets));
+    fprintf(out, "  \"hashes\": [\n");
+    for (h = 0; h < (int)NUM_HASHES; h++)
+    {
+        start = perf_now();
+        for (r = 0; r < rounds; r++)
+            for (i = 0; i < n; i++)
+                sink += hashes[h].hash(tokens[i]);
+        elapsed = perf_now() - start;
+
+        /* The distinct words, which are longer on average than the tokens */
+        start = perf_now();
+        for (r = 0; r < rounds * (n / numwords); r++)
+            for (i = 0; i < numwords; i++)
+                sink += hashes[h].hash(words[i]);
+        distinct = perf_now() - start;
+
+        memset(chains, 0, numbuckets * sizeof(int));
+        for (i = 0; i < numwords; i++)
+        {
+            values[i] = hashes[h].hash(words[i]);
+            chains[values[i] & (numbuckets - 1)]++;
+        }
+        probes = 0;
+        maxchain = empty = 0;
+        for (i = 0; i < numbuckets; i++)
+        {
+            /* Each of the words of a chain meets all of them */
+            probes += (double)chains[i] * chains[i];
+            if (chains[i] > maxchain)
+                maxchain = chains[i];
+            empty += chains[i] == 0;
+        }
+
+        /* Words with the same full hash are compared with cmpfunc on every lookup */
+        qsort(values, numwords, sizeof(unsigned long), compare_ulongs);
+        collisions = 0;
+        for (i = 1; i < numwords; i++)
+            collisions += values[i] == values[i - 1];
+
+        fprintf(out, "    {\"hash\": \"%s\", \"ns_per_token\": %.2f, \"mb_per_s\": %.1f, \"ns_per_word\": %.2f, "
+                     "\"mean_chain\": %.3f, \"max_chain\": %d, \"empty\": %.4f, \"collisions\": %d}%s\n",
+                hashes[h].name, elapsed * 1e9 / ((double)rounds * n), bytes * rounds / elapsed / 1e6,
+                distinct * 1e9 / ((double)rounds * (n / numwords) * numwords),
+                probes / numwords, maxchain, (double)empty / numbuckets, collisions,
+                h + 1 < (int)NUM_HASHES ? "," : "");
+    }
+    fprintf(out, "  ]\n");
+    fprintf(out, "}\n");
+
+    if (out != stdout)
+        fclose(out);
+
+    /* Keeps the hashing loops from being optimized away */
+    if (sink == 42)
+        fprintf(stderr, "\n");
+
+    map_destroy(vocabulary, NULL, NULL);
+    for (i = 0; i < n; i++)
+        free(tokens[i]);
+    free(tokens);
+    free(words);
+    free(values);
+    free(chains);
+
+    return 0;
+}
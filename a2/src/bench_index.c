@@ -0,0 +1,464 @@
+/*
+ * Index build and query benchmark.
+ *
+ * Generates a synthetic corpus whose word frequencies follow a Zipf
+ * distribution, indexes it, and runs a series of term, AND, OR, ANDNOT
+ * and nested queries against the index, one by one and as a batch.
+ * Results are written as JSON.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "common.h"
+#include "index.h"
+#include "list.h"
+#include "set.h"
+
+#define WORD_LENGTH (10)
+
+#define DEFAULT_DOCS (2000)
+#define DEFAULT_WORDS (300)
+#define DEFAULT_VOCABULARY (50000)
+#define DEFAULT_QUERIES (1000)
+#define DEFAULT_SKEW (1.0)
+#define DEFAULT_THREADS (4)
+
+/* Mean number of times each distinct query occurs in the batch benchmark */
+#define BATCH_REPEAT (4)
+
+enum query_type
+{
+    QUERY_TERM,
+    QUERY_AND,
+    QUERY_OR,
+    QUERY_ANDNOT,
+    QUERY_NESTED,
+    NUM_QUERY_TYPES
+};
+
+static const char *query_names[NUM_QUERY_TYPES] = {"term", "and", "or", "andnot", "nested"};
+
+typedef struct corpus
+{
+    char **vocabulary;
+    double *cdf;        /* Cumulative Zipf probabilities of the vocabulary */
+    char *seen;         /* Nonzero for words that occur in some document */
+    int size;
+} corpus_t;
+
+/*
+ * Generates a vocabulary of distinct words, where word i has probability
+ * proportional to 1/(i+1)^skew.  Repeated words are drawn again, so that
+ * no two ranks share a word.
+ */
+static void initialize_corpus(corpus_t *corpus, int size, double skew, unsigned int *seed)
+{
+    int i;
+    double sum = 0;
+    char *word;
+    set_t *words = set_create(compare_strings);
+
+    corpus->size = size;
+    corpus->vocabulary = malloc(size * sizeof(char *));
+    corpus->cdf = malloc(size * sizeof(double));
+    corpus->seen = calloc(size, 1);
+    if (!corpus->vocabulary || !corpus->cdf || !corpus->seen)
+        fatal_error("out of memory");
+
+    for (i = 0; i < size; i++)
+    {
+        word = generate_string(seed, WORD_LENGTH);
+        while (set_contains(words, word))
+        {
+            free(word);
+            word = generate_string(seed, WORD_LENGTH);
+        }
+        set_add(words, word);
+        corpus->vocabulary[i] = word;
+        sum += 1.0 / pow(i + 1, skew);
+        corpus->cdf[i] = sum;
+    }
+    for (i = 0; i < size; i++)
+        corpus->cdf[i] /= sum;
+    set_destroy(words);
+}
+
+static void corpus_destroy(corpus_t *corpus)
+{
+    int i;
+
+    for (i = 0; i < corpus->size; i++)
+        free(corpus->vocabulary[i]);
+    free(corpus->vocabulary);
+    free(corpus->cdf);
+    free(corpus->seen);
+}
+
+/* Draws a word index from the Zipf distribution of the corpus */
+static int sample_word(corpus_t *corpus, unsigned int *seed)
+{
+    double p = (double)rand_r(seed) / RAND_MAX;
+    int lo = 0, hi = corpus->size - 1;
+
+    while (lo < hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+        if (corpus->cdf[mid] < p)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* Draws a word that occurs in some document, so that queries never miss the index */
+static char *sample_query_word(corpus_t *corpus, unsigned int *seed)
+{
+    int w;
+
+    do
+        w = sample_word(corpus, seed);
+    while (!corpus->seen[w]);
+
+    return corpus->vocabulary[w];
+}
+
+/* Generates a document of around 'num_words' words, counting its size in bytes */
+static list_t *generate_document(corpus_t *corpus, int num_words, unsigned int *seed, long *bytes)
+{
+    int i, w, n;
+    list_t *words;
+
+    words = list_create(compare_strings);
+    n = num_words / 2 + rand_r(seed) % (num_words + 1);
+    for (i = 0; i < n; i++)
+    {
+        w = sample_word(corpus, seed);
+        corpus->seen[w] = 1;
+        list_addlast(words, strdup(corpus->vocabulary[w]));
+        *bytes += strlen(corpus->vocabulary[w]) + 1;
+    }
+    return words;
+}
+
+/* Builds a query of the given type out of Zipf distributed words */
+static list_t *generate_query(corpus_t *corpus, enum query_type type, unsigned int *seed)
+{
+    list_t *query = list_create(compare_strings);
+
+    switch (type)
+    {
+    case QUERY_TERM:
+        list_addlast(query, sample_query_word(corpus, seed));
+        break;
+    case QUERY_AND:
+    case QUERY_OR:
+    case QUERY_ANDNOT:
+        list_addlast(query, sample_query_word(corpus, seed));
+        list_addlast(query, type == QUERY_AND ? "AND" : type == QUERY_OR ? "OR" : "ANDNOT");
+        list_addlast(query, sample_query_word(corpus, seed));
+        break;
+    case QUERY_NESTED:
+        /* ( a OR b ) AND ( c OR d ) ANDNOT e */
+        list_addlast(query, "(");
+        list_addlast(query, sample_query_word(corpus, seed));
+        list_addlast(query, "OR");
+        list_addlast(query, sample_query_word(corpus, seed));
+        list_addlast(query, ")");
+        list_addlast(query, "AND");
+        list_addlast(query, "(");
+        list_addlast(query, sample_query_word(corpus, seed));
+        list_addlast(query, "OR");
+        list_addlast(query, sample_query_word(corpus, seed));
+        list_addlast(query, ")");
+        list_addlast(query, "ANDNOT");
+        list_addlast(query, sample_query_word(corpus, seed));
+        break;
+    default:
+        break;
+    }
+    return query;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double d1 = *(double *)a;
+    double d2 = *(double *)b;
+    return (d1 > d2) - (d1 < d2);
+}
+
+/* Returns the given percentile of 'n' sorted samples */
+static double percentile(double *sorted, int n, double p)
+{
+    int i = (int)(p / 100.0 * (n - 1) + 0.5);
+    return sorted[i];
+}
+
+/* Runs 'num_queries' queries of the given type, and writes their latency statistics */
+static void bench_queries(FILE *out, index_t *ind, corpus_t *corpus, enum query_type type,
+                          int num_queries, unsigned int *seed)
+{
+    int i, errors = 0;
+    long results = 0;
+    double start, total = 0, *latencies;
+    char *errmsg;
+    list_t *query, *result;
+
+    latencies = malloc(num_queries * sizeof(double));
+    if (!latencies)
+        fatal_error("out of memory");
+
+    for (i = 0; i < num_queries; i++)
+    {
+        query = generate_query(corpus, type, seed);
+
+        start = now();
+        result = index_query(ind, query, &errmsg);
+        latencies[i] = now() - start;
+        total += latencies[i];
+
+        if (result == NULL)
+        {
+            /* Queries with no matches, such as ANDNOT of a word with itself, are reported as errors */
+            errors++;
+            free(errmsg);
+        }
+        else
+        {
+            results += list_size(result);
+            while (list_size(result) > 0)
+                free(list_popfirst(result));
+            list_destroy(result);
+        }
+        list_destroy(query);
+    }
+
+    qsort(latencies, num_queries, sizeof(double), compare_doubles);
+    fprintf(out, "    \"%s\": {\"queries\": %d, \"errors\": %d, \"mean_results\": %.1f, "
+                 "\"qps\": %.1f, \"mean_us\": %.2f, \"p50_us\": %.2f, \"p90_us\": %.2f, "
+                 "\"p99_us\": %.2f, \"max_us\": %.2f}",
+            query_names[type], num_queries, errors, (double)results / num_queries,
+            num_queries / total, total / num_queries * 1e6,
+            percentile(latencies, num_queries, 50) * 1e6,
+            percentile(latencies, num_queries, 90) * 1e6,
+            percentile(latencies, num_queries, 99) * 1e6,
+            latencies[num_queries - 1] * 1e6);
+
+    free(latencies);
+}
+
+/* Frees the results of a query */
+static long free_results(list_t *result)
+{
+    long n = list_size(result);
+
+    while (list_size(result) > 0)
+        free(list_popfirst(result));
+    list_destroy(result);
+    return n;
+}
+
+/*
+ * Runs 'num_queries' queries of mixed types one by one, and then as a
+ * batch with one and with 'threads' threads, and writes their throughput.
+ * Like real traffic, the queries repeat: they are drawn from a pool of
+ * distinct queries whose popularity follows a Zipf distribution.
+ */
+static void bench_batch(FILE *out, index_t *ind, corpus_t *corpus, int num_queries,
+                        int threads, unsigned int *seed)
+{
+    int i, t, pass, num_distinct = num_queries / BATCH_REPEAT + 1;
+    long results[3] = {0, 0, 0};
+    double start, elapsed[3], sum = 0, p, *cdf;
+    char *errmsg, **errmsgs;
+    list_t **pool, **queries, **batch, *result;
+
+    pool = malloc(num_distinct * sizeof(list_t *));
+    cdf = malloc(num_distinct * sizeof(double));
+    queries = malloc(num_queries * sizeof(list_t *));
+    errmsgs = malloc(num_queries * sizeof(char *));
+    if (!pool || !cdf || !queries || !errmsgs)
+        fatal_error("out of memory");
+
+    for (i = 0; i < num_distinct; i++)
+    {
+        pool[i] = generate_query(corpus, i % NUM_QUERY_TYPES, seed);
+        sum += 1.0 / (i + 1);
+        cdf[i] = sum;
+    }
+    for (i = 0; i < num_queries; i++)
+    {
+        p = (double)rand_r(seed) / RAND_MAX * sum;
+        for (t = 0; t < num_distinct - 1 && cdf[t] < p; t++)
+            ;
+        queries[i] = pool[t];
+    }
+
+    start = now();
+    for (i = 0; i < num_queries; i++)
+    {
+        result = index_query(ind, queries[i], &errmsg);
+        if (result == NULL)
+            free(errmsg);
+        else
+            results[0] += free_results(result);
+    }
+    elapsed[0] = now() - start;
+
+    for (pass = 1; pass <= 2; pass++)
+    {
+        t = pass == 1 ? 1 : threads;
+        start = now();
+        batch = index_query_batch(ind, queries, num_queries, 0, t, errmsgs);
+        elapsed[pass] = now() - start;
+
+        for (i = 0; i < num_queries; i++)
+        {
+            if (batch[i] == NULL)
+                free(errmsgs[i]);
+            else
+                results[pass] += free_results(batch[i]);
+        }
+        free(batch);
+    }
+
+    fprintf(out, "    \"batch\": {\"queries\": %d, \"distinct\": %d, \"threads\": %d, \"results\": [%ld, %ld, %ld], "
+                 "\"loop_qps\": %.1f, \"batch_qps\": %.1f, \"parallel_qps\": %.1f}",
+            num_queries, num_distinct, threads, results[0], results[1], results[2],
+            num_queries / elapsed[0], num_queries / elapsed[1], num_queries / elapsed[2]);
+
+    for (i = 0; i < num_distinct; i++)
+        list_destroy(pool[i]);
+    free(pool);
+    free(cdf);
+    free(queries);
+    free(errmsgs);
+}
+
+static void usage(char *prog)
+{
+    fprintf(stderr, "Usage: %s [-d docs] [-w words] [-v vocabulary] [-z skew] [-q queries] [-p threads] [-r seed] [-o file]\n", prog);
+    fprintf(stderr, "  -d docs        number of documents (default %d)\n", DEFAULT_DOCS);
+    fprintf(stderr, "  -w words       mean number of words per document (default %d)\n", DEFAULT_WORDS);
+    fprintf(stderr, "  -v vocabulary  number of distinct words (default %d)\n", DEFAULT_VOCABULARY);
+    fprintf(stderr, "  -z skew        Zipf exponent of the word distribution (default %.1f)\n", DEFAULT_SKEW);
+    fprintf(stderr, "  -q queries     number of queries per query type (default %d)\n", DEFAULT_QUERIES);
+    fprintf(stderr, "  -p threads     number of threads for batch queries (default %d)\n", DEFAULT_THREADS);
+    fprintf(stderr, "  -r seed        random seed (default 1)\n");
+    fprintf(stderr, "  -o file        write results to file instead of stdout\n");
+}
+
+int main(int argc, char **argv)
+{
+    int i, opt, type;
+    int num_docs = DEFAULT_DOCS, num_words = DEFAULT_WORDS;
+    int vocabulary = DEFAULT_VOCABULARY, num_queries = DEFAULT_QUERIES;
+    int threads = DEFAULT_THREADS;
+    double skew = DEFAULT_SKEW, start, elapsed = 0;
+    unsigned int seed = 1, initial_seed;
+    long bytes = 0, words_total = 0;
+    char path[32];
+    FILE *out = stdout;
+    corpus_t corpus;
+    index_t *ind;
+    list_t *words;
+    struct rusage usage_after;
+
+    while ((opt = getopt(argc, argv, "d:w:v:z:q:p:r:o:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'd':
+            num_docs = atoi(optarg);
+            break;
+        case 'w':
+            num_words = atoi(optarg);
+            break;
+        case 'v':
+            vocabulary = atoi(optarg);
+            break;
+        case 'z':
+            skew = atof(optarg);
+            break;
+        case 'q':
+            num_queries = atoi(optarg);
+            break;
+        case 'p':
+            threads = atoi(optarg);
+            break;
+        case 'r':
+            seed = atoi(optarg);
+            break;
+        case 'o':
+            out = fopen(optarg, "w");
+            if (out == NULL)
+                fatal_error("Unable to open '%s'", optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (num_docs < 1 || num_words < 1 || vocabulary < 1 || num_queries < 1)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    initial_seed = seed;
+    initialize_corpus(&corpus, vocabulary, skew, &seed);
+
+    /* Generate and index the documents, timing index_addpath() only */
+    ind = index_create();
+    for (i = 0; i < num_docs; i++)
+    {
+        words = generate_document(&corpus, num_words, &seed, &bytes);
+        words_total += list_size(words);
+        sprintf(path, "document_%d.txt", i);
+
+        start = now();
+        index_addpath(ind, strdup(path), words);
+        elapsed += now() - start;
+
+        list_destroy(words);
+    }
+    getrusage(RUSAGE_SELF, &usage_after);
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"corpus\": {\"docs\": %d, \"words\": %ld, \"bytes\": %ld, \"vocabulary\": %d, \"skew\": %.2f, \"seed\": %u},\n",
+            num_docs, words_total, bytes, vocabulary, skew, initial_seed);
+    fprintf(out, "  \"indexing\": {\"seconds\": %.4f, \"docs_per_sec\": %.1f, \"mb_per_sec\": %.2f, \"peak_rss_kb\": %ld},\n",
+            elapsed, num_docs / elapsed, bytes / elapsed / (1024 * 1024), usage_after.ru_maxrss);
+    fprintf(out, "  \"queries\": {\n");
+    for (type = 0; type < NUM_QUERY_TYPES; type++)
+    {
+        bench_queries(out, ind, &corpus, type, num_queries, &seed);
+        fprintf(out, ",\n");
+    }
+    bench_batch(out, ind, &corpus, num_queries * NUM_QUERY_TYPES, threads, &seed);
+    fprintf(out, "\n");
+    fprintf(out, "  }\n");
+    fprintf(out, "}\n");
+
+    if (out != stdout)
+        fclose(out);
+
+    index_destroy(ind);
+    corpus_destroy(&corpus);
+
+    return 0;
+}
@@ -0,0 +1,257 @@
+/*
+ * Map benchmark.
+ *
+ * Runs the same workloads against whichever map implementation the
+ * program is linked with: inserting and looking up a large number of
+ * word keys, like the term dictionary of the index, and building many
+ * small maps of a few keys, like the header and argument maps of the
+ * HTTP server.  The large map is then iterated, and half of its keys
+ * are removed again.  The latency of individual inserts shows the cost of growing
+ * the map.  Results are written as JSON.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "map.h"
+#include "perf.h"
+
+#ifndef MAP_NAME
+#define MAP_NAME "map"
+#endif
+
+#define WORD_LENGTH (12)
+
+#define DEFAULT_KEYS (200000)
+#define DEFAULT_ROUNDS (5)
+#define DEFAULT_SMALL_MAPS (100000)
+
+/* Keys of a typical request, as parsed by the HTTP server */
+static char *header_keys[] = {"Host", "User-Agent", "Accept", "Accept-Language", "Accept-Encoding",
+                              "Connection", "Referer", "Cookie", "query", "explain"};
+#define NUM_HEADER_KEYS (sizeof(header_keys) / sizeof(header_keys[0]))
+
+/* Generates 'n' distinct random words */
+static char **generate_keys(int n, unsigned int *seed)
+{
+    char **keys = malloc(n * sizeof(char *));
+    char *word;
+    int i;
+
+    if (keys == NULL)
+        fatal_error("out of memory");
+
+    for (i = 0; i < n; i++)
+    {
+        /* A numeric suffix keeps the words distinct */
+        word = generate_string(seed, WORD_LENGTH);
+        keys[i] = malloc(strlen(word) + 12);
+        if (keys[i] == NULL)
+            fatal_error("out of memory");
+        sprintf(keys[i], "%s%d", word, i);
+        free(word);
+    }
+    return keys;
+}
+
+/* Shuffles the given keys, so that lookups do not follow insertion order */
+static void shuffle(char **keys, int n, unsigned int *seed)
+{
+    int i, j;
+    char *tmp;
+
+    for (i = n - 1; i > 0; i--)
+    {
+        j = rand_r(seed) % (i + 1);
+        tmp = keys[i];
+        keys[i] = keys[j];
+        keys[j] = tmp;
+    }
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double d1 = *(double *)a;
+    double d2 = *(double *)b;
+    return (d1 > d2) - (d1 < d2);
+}
+
+/* Returns the given percentile of 'n' sorted samples */
+static double percentile(double *sorted, int n, double p)
+{
+    int i = (int)(p / 100.0 * (n - 1) + 0.5);
+    return sorted[i];
+}
+
+static void usage(char *prog)
+{
+    fprintf(stderr, "Usage: %s [-n keys] [-r rounds] [-s small-maps] [-o file]\n", prog);
+    fprintf(stderr, "  -n keys        number of keys in the large map (default %d)\n", DEFAULT_KEYS);
+    fprintf(stderr, "  -r rounds      lookups of each key (default %d)\n", DEFAULT_ROUNDS);
+    fprintf(stderr, "  -s small-maps  number of small maps built (default %d)\n", DEFAULT_SMALL_MAPS);
+    fprintf(stderr, "  -o file        write results to file instead of stdout\n");
+}
+
+int main(int argc, char **argv)
+{
+    int i, r, opt, found = 0;
+    int n = DEFAULT_KEYS, rounds = DEFAULT_ROUNDS, small = DEFAULT_SMALL_MAPS;
+    unsigned int seed = 1;
+    double start, insert, hit, miss, update, iteration, removal, build, *latencies;
+    char **keys, **absent;
+    void *key, *value;
+    map_iter_t *iter;
+    map_stats_t layout;
+    size_t bytes;
+    map_t *map, *timed, *headers;
+    FILE *out = stdout;
+
+    while ((opt = getopt(argc, argv, "n:r:s:o:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            n = atoi(optarg);
+            break;
+        case 'r':
+            rounds = atoi(optarg);
+            break;
+        case 's':
+            small = atoi(optarg);
+            break;
+        case 'o':
+            out = fopen(optarg, "w");
+            if (out == NULL)
+                fatal_error("Unable to open '%s'", optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc || n < 1 || rounds < 1 || small < 1)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    latencies = malloc(n * sizeof(double));
+    if (latencies == NULL)
+        fatal_error("out of memory");
+
+    keys = generate_keys(n, &seed);
+    absent = generate_keys(n, &seed);
+    for (i = 0; i < n; i++)
+        absent[i][0] = 'Z'; /* Generated words are lowercase */
+
+    /* A large map of word keys, like the term dictionary */
+    map = map_create(compare_strings, hash_string);
+    start = perf_now();
+    for (i = 0; i < n; i++)
+        map_put(map, keys[i], keys[i]);
+    insert = perf_now() - start;
+    bytes = map_bytes(map);
+
+    /*
+     * Again, timing each insert to see the cost of growing the map.  Both
+     * maps are kept until the end, as freeing many small blocks makes the
+     * allocator spend a long time on its next large allocation.
+     */
+    timed = map_create(compare_strings, hash_string);
+    for (i = 0; i < n; i++)
+    {
+        start = perf_now();
+        map_put(timed, keys[i], keys[i]);
+        latencies[i] = perf_now() - start;
+    }
+    qsort(latencies, n, sizeof(double), compare_doubles);
+
+    shuffle(keys, n, &seed);
+    start = perf_now();
+    for (r = 0; r < rounds; r++)
+        for (i = 0; i < n; i++)
+            found += map_get(map, keys[i]) == keys[i];
+    hit = perf_now() - start;
+
+    start = perf_now();
+    for (r = 0; r < rounds; r++)
+        for (i = 0; i < n; i++)
+            found += map_haskey(map, absent[i]);
+    miss = perf_now() - start;
+
+    start = perf_now();
+    for (i = 0; i < n; i++)
+        map_put(map, keys[i], keys[i]);
+    update = perf_now() - start;
+
+    /* Every key once, mapping to itself */
+    start = perf_now();
+    iter = map_createiter(map);
+    while (map_hasnext(iter))
+    {
+        key = map_next(iter, &value);
+        found += key == value;
+    }
+    map_destroyiter(iter);
+    iteration = perf_now() - start;
+    found -= n;
+    map_stats(map, &layout);
+
+    start = perf_now();
+    for (i = 0; i < n; i += 2)
+        found -= map_remove(map, keys[i], NULL, NULL);
+    removal = perf_now() - start;
+    for (i = 0; i < n; i++)
+        found += (map_tryget(map, keys[i]) == keys[i]) == (i % 2);
+    found += (n + 1) / 2 - n; /* Every key counted once more, less the removed keys */
+
+    if (found != rounds * n || map_size(map) != n / 2 || map_size(timed) != n)
+        fatal_error("Map returned wrong results");
+
+    /* Many small maps, like the headers of HTTP requests */
+    start = perf_now();
+    for (r = 0; r < small; r++)
+    {
+        headers = map_create(compare_strings, hash_string);
+        for (i = 0; i < (int)NUM_HEADER_KEYS; i++)
+            map_put(headers, header_keys[i], header_keys[i]);
+        for (i = 0; i < (int)NUM_HEADER_KEYS; i += 2)
+            if (map_haskey(headers, header_keys[i]))
+                found += map_get(headers, header_keys[i]) == header_keys[i];
+        map_destroy(headers, NULL, NULL);
+    }
+    build = perf_now() - start;
+    map_destroy(map, NULL, NULL);
+    map_destroy(timed, NULL, NULL);
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"map\": {\"implementation\": \"%s\", \"keys\": %d, \"bytes\": %zu, \"bytes_per_key\": %.1f, "
+                 "\"capacity\": %d, \"load\": %.3f, \"mean_probe\": %.3f, \"max_probe\": %d},\n",
+            MAP_NAME, n, bytes, (double)bytes / n, layout.capacity, layout.load, layout.mean_probe,
+            layout.max_probe);
+    fprintf(out, "  \"ns_per_op\": {\"insert\": %.1f, \"lookup_hit\": %.1f, \"lookup_miss\": %.1f, "
+                 "\"update\": %.1f, \"iterate\": %.1f, \"remove\": %.1f, \"small_map\": %.1f},\n",
+            insert * 1e9 / n, hit * 1e9 / ((double)rounds * n), miss * 1e9 / ((double)rounds * n),
+            update * 1e9 / n, iteration * 1e9 / n, removal * 1e9 / ((n + 1) / 2), build * 1e9 / small);
+    fprintf(out, "  \"insert_latency_us\": {\"p50\": %.3f, \"p99\": %.3f, \"p999\": %.3f, \"max\": %.3f}\n",
+            percentile(latencies, n, 50) * 1e6, percentile(latencies, n, 99) * 1e6,
+            percentile(latencies, n, 99.9) * 1e6, latencies[n - 1] * 1e6);
+    fprintf(out, "}\n");
+
+    if (out != stdout)
+        fclose(out);
+
+    for (i = 0; i < n; i++)
+    {
+        free(keys[i]);
+        free(absent[i]);
+    }
+    free(keys);
+    free(absent);
+    free(latencies);
+
+    return 0;
+}
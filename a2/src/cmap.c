@@ -0,0 +1,280 @@
+#include "cmap.h"
+
+#include <stdlib.h>
+#include <pthread.h>
+
+/* Number of segments, a power of two; the segment is taken from the top bits */
+#define NUM_SEGMENTS 64
+#define SEGMENT_BITS 6
+
+#define INITIAL_BUCKETS 8
+
+/* Size of a cache line, so that segments used by different threads do not share one */
+#define CACHE_LINE 64
+
+typedef struct cmapentry
+{
+    unsigned long hash;
+    void *key;
+    void *value;
+    struct cmapentry *next;
+} cmapentry_t;
+
+/*
+ * A segment is a chained hash table of its own.  Like the hashmap, it
+ * doubles its buckets once it holds as many entries as buckets, and the
+ * bucket of a hash is its low bits.
+ */
+typedef struct segment
+{
+    pthread_rwlock_t lock;
+    cmapentry_t **buckets;
+    int numbuckets;
+    int size; /* Updated atomically, so cmap_size() may read it without the lock */
+} __attribute__((aligned(CACHE_LINE))) segment_t;
+
+struct cmap
+{
+    segment_t segments[NUM_SEGMENTS];
+    cmpfunc_t cmpfunc;
+    hashfunc_t hashfunc;
+};
+
+/*
+ * Returns the segment of the given hash.  The hash is mixed by a
+ * multiplication first, so that the segment does not depend on the same
+ * bits as the bucket within the segment.
+ */
+static segment_t *segmentof(cmap_t *map, unsigned long hash)
+{
+    return &map->segments[((uint64_t)hash * 0x9e3779b97f4a7c15ULL) >> (64 - SEGMENT_BITS)];
+}
+
+cmap_t *cmap_create(cmpfunc_t cmpfunc, hashfunc_t hashfunc)
+{
+    cmap_t *map;
+    int i;
+
+    if (posix_memalign((void **)&map, CACHE_LINE, sizeof(cmap_t)) != 0)
+        fatal_error("out of memory");
+
+    map->cmpfunc = cmpfunc;
+    map->hashfunc = hashfunc;
+    for (i = 0; i < NUM_SEGMENTS; i++)
+    {
+        pthread_rwlock_init(&map->segments[i].lock, NULL);
+        map->segments[i].numbuckets = INITIAL_BUCKETS;
+        map->segments[i].size = 0;
+        map->segments[i].buckets = calloc(INITIAL_BUCKETS, sizeof(cmapentry_t *));
+        if (map->segments[i].buckets == NULL)
+            fatal_error("out of memory");
+    }
+    return map;
+}
+
+void cmap_destroy(cmap_t *map, void (*destroy_key)(void *), void (*destroy_val)(void *))
+{
+    segment_t *seg;
+    cmapentry_t *e, *tmp;
+    int i, b;
+
+    for (i = 0; i < NUM_SEGMENTS; i++)
+    {
+        seg = &map->segments[i];
+        for (b = 0; b < seg->numbuckets; b++)
+        {
+            e = seg->buckets[b];
+            while (e != NULL)
+            {
+                tmp = e;
+                e = e->next;
+                if (destroy_key && tmp->key)
+                    destroy_key(tmp->key);
+                if (destroy_val && tmp->value)
+                    destroy_val(tmp->value);
+                free(tmp);
+            }
+        }
+        free(seg->buckets);
+        pthread_rwlock_destroy(&seg->lock);
+    }
+    free(map);
+}
+
+/*
+ * Returns the link to the entry of the given key in its segment, or
+ * the link at the end of its chain if the key is not in the segment.
+ * The segment must be locked.
+ */
+static cmapentry_t **findlink(cmap_t *map, segment_t *seg, void *key, unsigned long hash)
+{
+    cmapentry_t **link = &seg->buckets[hash & (seg->numbuckets - 1)];
+
+    while (*link != NULL && ((*link)->hash != hash || map->cmpfunc(key, (*link)->key) != 0))
+        link = &(*link)->next;
+    return link;
+}
+
+/*
+ * Doubles the buckets of the given segment, which must be write-locked.
+ * Entries are relinked, and keep their hash.
+ */
+static void growsegment(segment_t *seg)
+{
+    int b, numbuckets = seg->numbuckets * 2;
+    cmapentry_t **buckets, *e, *next;
+
+    buckets = calloc(numbuckets, sizeof(cmapentry_t *));
+    if (buckets == NULL)
+        fatal_error("out of memory");
+
+    for (b = 0; b < seg->numbuckets; b++)
+    {
+        for (e = seg->buckets[b]; e != NULL; e = next)
+        {
+            next = e->next;
+            e->next = buckets[e->hash & (numbuckets - 1)];
+            buckets[e->hash & (numbuckets - 1)] = e;
+        }
+    }
+    free(seg->buckets);
+    seg->buckets = buckets;
+    seg->numbuckets = numbuckets;
+}
+
+/*
+ * Inserts or finds the given key, returning the value it maps to
+ * afterwards.  An existing value is replaced if 'replace' is nonzero.
+ */
+static void *insert(cmap_t *map, void *key, void *value, int replace)
+{
+    unsigned long hash = map->hashfunc(key);
+    segment_t *seg = segmentof(map, hash);
+    cmapentry_t **link, *e;
+
+    pthread_rwlock_wrlock(&seg->lock);
+    link = findlink(map, seg, key, hash);
+    if (*link != NULL)
+    {
+        if (replace)
+            (*link)->value = value;
+        value = (*link)->value;
+    }
+    else
+    {
+        e = malloc(sizeof(cmapentry_t));
+        if (e == NULL)
+            fatal_error("out of memory");
+        e->hash = hash;
+        e->key = key;
+        e->value = value;
+        e->next = NULL;
+        *link = e;
+        if (__atomic_add_fetch(&seg->size, 1, __ATOMIC_RELAXED) >= seg->numbuckets)
+            growsegment(seg);
+    }
+    pthread_rwlock_unlock(&seg->lock);
+    return value;
+}
+
+void cmap_put(cmap_t *map, void *key, void *value)
+{
+    insert(map, key, value, 1);
+}
+
+void *cmap_get_or_insert(cmap_t *map, void *key, void *value)
+{
+    return insert(map, key, value, 0);
+}
+
+int cmap_remove(cmap_t *map, void *key, void (*destroy_key)(void *), void (*destroy_val)(void *))
+{
+    unsigned long hash = map->hashfunc(key);
+    segment_t *seg = segmentof(map, hash);
+    cmapentry_t **link, *e;
+
+    pthread_rwlock_wrlock(&seg->lock);
+    link = findlink(map, seg, key, hash);
+    e = *link;
+    if (e != NULL)
+    {
+        *link = e->next;
+        __atomic_sub_fetch(&seg->size, 1, __ATOMIC_RELAXED);
+    }
+    pthread_rwlock_unlock(&seg->lock);
+
+    if (e == NULL)
+        return 0;
+    if (destroy_key && e->key)
+        destroy_key(e->key);
+    if (destroy_val && e->value)
+        destroy_val(e->value);
+    free(e);
+    return 1;
+}
+
+/*
+ * Looks up the given key, assigning its value to 'value' if found.
+ * Returns 1 if the key is in the map, 0 otherwise.
+ */
+static int lookup(cmap_t *map, void *key, void **value)
+{
+    unsigned long hash = map->hashfunc(key);
+    segment_t *seg = segmentof(map, hash);
+    cmapentry_t *e;
+
+    pthread_rwlock_rdlock(&seg->lock);
+    e = *findlink(map, seg, key, hash);
+    if (e != NULL)
+        *value = e->value;
+    pthread_rwlock_unlock(&seg->lock);
+    return e != NULL;
+}
+
+int cmap_haskey(cmap_t *map, void *key)
+{
+    void *value;
+    return lookup(map, key, &value);
+}
+
+void *cmap_get(cmap_t *map, void *key)
+{
+    void *value = NULL;
+
+    if (!lookup(map, key, &value))
+        fatal_error("key not found in map");
+    return value;
+}
+
+void *cmap_tryget(cmap_t *map, void *key)
+{
+    void *value = NULL;
+
+    lookup(map, key, &value);
+    return value;
+}
+
+int cmap_size(cmap_t *map)
+{
+    int i, size = 0;
+
+    for (i = 0; i < NUM_SEGMENTS; i++)
+        size += __atomic_load_n(&map->segments[i].size, __ATOMIC_RELAXED);
+    return size;
+}
+
+size_t cmap_bytes(cmap_t *map)
+{
+    size_t bytes = sizeof(cmap_t);
+    segment_t *seg;
+    int i;
+
+    for (i = 0; i < NUM_SEGMENTS; i++)
+    {
+        seg = &map->segments[i];
+        pthread_rwlock_rdlock(&seg->lock);
+        bytes += seg->numbuckets * sizeof(cmapentry_t *) + seg->size * sizeof(cmapentry_t);
+        pthread_rwlock_unlock(&seg->lock);
+    }
+    return bytes;
+}
@@ -0,0 +1,82 @@
+#ifndef CMAP_H
+#define CMAP_H
+
+#include "common.h"
+
+/*
+ * The type of concurrent maps.  A concurrent map offers the operations
+ * of map_t, and may be used by any number of threads at once.
+ *
+ * The map is split into a fixed number of segments, each with its own
+ * lock and its own table of buckets, and a key belongs to the segment
+ * given by its hash.  Lookups in the same segment proceed in parallel,
+ * and inserts and removals only exclude the operations on their own
+ * segment, so threads working on different keys rarely wait for each
+ * other.  A segment grows on its own, while the others stay available.
+ */
+struct cmap;
+typedef struct cmap cmap_t;
+
+/*
+ * Creates a new, empty concurrent map whose keys are compared using the
+ * given comparison function, and hashed using the given hash function.
+ */
+cmap_t *cmap_create(cmpfunc_t cmpfunc, hashfunc_t hashfunc);
+
+/*
+ * Destroys the given map, destroying its keys and values like
+ * map_destroy().  No other thread may use the map at the same time.
+ */
+void cmap_destroy(cmap_t *map, void (*destroy_key)(void *), void (*destroy_val)(void *));
+
+/*
+ * Maps the given key to the given value.  This will overwrite any
+ * value that the key was previously mapped to.
+ */
+void cmap_put(cmap_t *map, void *key, void *value);
+
+/*
+ * Maps the given key to the given value, unless the key is already in
+ * the map.  Returns the value that the key maps to afterwards, which is
+ * 'value' exactly if the key was inserted.  Of several threads inserting
+ * the same key at once, one inserts it and the others get its value.
+ */
+void *cmap_get_or_insert(cmap_t *map, void *key, void *value);
+
+/*
+ * Removes the given key from the given map.  Returns 1 if the key was
+ * in the map, 0 otherwise.  The key and value stored in the map are
+ * destroyed using 'destroy_key' and 'destroy_val', if they are not NULL,
+ * which is only safe if no other thread may still be using them.
+ */
+int cmap_remove(cmap_t *map, void *key, void (*destroy_key)(void *), void (*destroy_val)(void *));
+
+/*
+ * Returns 1 if the given map contains the given key, 0 otherwise.
+ */
+int cmap_haskey(cmap_t *map, void *key);
+
+/*
+ * Returns the value that the given key maps to.
+ */
+void *cmap_get(cmap_t *map, void *key);
+
+/*
+ * Returns the value that the given key maps to, or NULL if the key is
+ * not in the map.
+ */
+void *cmap_tryget(cmap_t *map, void *key);
+
+/*
+ * Returns the number of keys in the given map.  While other threads
+ * modify the map, the count may be slightly out of date.
+ */
+int cmap_size(cmap_t *map);
+
+/*
+ * Returns the number of bytes allocated by the given map for its own
+ * structure, not counting the keys and values.
+ */
+size_t cmap_bytes(cmap_t *map);
+
+#endif
@@ -7,6 +7,7 @@
 
 #include "common.h"
 #include "list.h"
+#include "perf.h"
 
 #include <string.h>
 #include <strings.h>
@@ -37,6 +38,7 @@ void tokenize_file (const char *filename, list_t *list)
     FILE *fp;
     char *c, *word;
     char buf[101];
+    PERF_START (start);
 
     fp = fopen (filename, "r");
     if (!fp)
@@ -64,11 +66,48 @@ void tokenize_file (const char *filename, list_t *list)
         word = strdup (buf);
         if (!word)
             fatal_error ("out of memory");
+        PERF_COUNT (PERF_ALLOCATIONS, 1);
 
         list_addlast (list, word);
+
+        PERF_COUNT (PERF_TOKENS, 1);
     }
 
+    PERF_COUNT (PERF_FILES, 1);
+    PERF_COUNT (PERF_BYTES, ftell (fp));
     fclose (fp);
+    PERF_STOP (PERF_TOKENIZE, start);
+}
+
+int hash_file (const char *filename, uint64_t *hash, long *size)
+{
+    FILE *fp;
+    unsigned char buf[65536];
+    uint64_t h = 14695981039346656037ULL;
+    size_t n, i;
+    long total = 0;
+    PERF_START (start);
+
+    fp = fopen (filename, "rb");
+    if (!fp)
+        return 0;
+
+    /* 64-bit FNV-1a */
+    while ((n = fread (buf, 1, sizeof (buf), fp)) > 0)
+    {
+        for (i = 0; i < n; i++)
+        {
+            h ^= buf[i];
+            h *= 1099511628211ULL;
+        }
+        total += n;
+    }
+
+    fclose (fp);
+    *hash = h;
+    *size = total;
+    PERF_STOP (PERF_HASH, start);
+    return 1;
 }
 
 char * concatenate_strings (int num_strings, const char *first, ...)
@@ -110,6 +149,22 @@ char * concatenate_strings (int num_strings, const char *first, ...)
     return ret;
 }
 
+char *generate_string (unsigned int *seed, int maxlen)
+{
+    int i, len;
+    char *s;
+
+    len = (rand_r (seed) % maxlen) + 1;
+
+    s = calloc (len + 1, sizeof (char));
+    if (!s)
+        fatal_error ("out of memory");
+    for (i = 0; i < len; i++)
+        s[i] = 'a' + (rand_r (seed) % ('z' - 'a' + 1));
+
+    return s;
+}
+
 
 static int dir_filter (const struct dirent *entry)
 {
@@ -183,6 +238,7 @@ struct list * find_files (const char *root_dir)
 {
     char cwd[512];
     list_t *files = NULL;
+    PERF_START (start);
 
     /* Get path to current directory, and change it */
     if (getcwd(cwd, 512) == NULL)
@@ -198,6 +254,7 @@ struct list * find_files (const char *root_dir)
 end:
     /* Restore current directory */
     chdir (cwd);
+    PERF_STOP (PERF_FIND_FILES, start);
     return files;
 }
 
@@ -211,15 +268,81 @@ int compare_strings(void *a, void *b)
     return strcmp(a, b);
 }
 
+/* Constants of the string hash, odd and with well spread bits */
+#define HASH_SEED 0xa0761d6478bd642fULL
+#define HASH_K1 0xe7037ed1a0b428dbULL
+#define HASH_K2 0x8ebc6af09c88c6e3ULL
+
+/*
+ * Multiplies 'a' and 'b' into 128 bits, leaving the low half in 'a' and
+ * the high half in 'b'.  Macros rather than functions, as the hash is
+ * on the path of every map operation and the build does not inline.
+ */
+#define HASH_MUM(a, b)                          \
+    do                                          \
+    {                                           \
+        __uint128_t r_ = (__uint128_t)(a) * (b); \
+        (a) = (uint64_t)r_;                     \
+        (b) = (uint64_t)(r_ >> 64);             \
+    } while (0)
+
+/* Unaligned little-endian loads of 8 and 4 bytes */
+#define HASH_READ8(p) ({ uint64_t v_; memcpy(&v_, (p), 8); v_; })
+#define HASH_READ4(p) ({ uint32_t v_; memcpy(&v_, (p), 4); (uint64_t)v_; })
+
+/*
+ * Hashes the string 8 bytes at a time, in the manner of wyhash: each
+ * 16 bytes are folded into the state by a 64x64->128-bit multiply.
+ * Strings of up to 16 bytes, which are most words, are read with a few
+ * overlapping loads and need no loop.  No byte past the terminator is
+ * read.  All bits of the result are well mixed, so maps may take the
+ * low bits of the hash as the bucket.
+ */
 unsigned long hash_string(void *str)
 {
-    unsigned char *p = str;
-    unsigned long hash = 5381;
-    int c;
+    const unsigned char *p = str;
+    size_t len = strlen(str), i = len;
+    uint64_t seed = HASH_SEED, a, b;
+
+    if (len <= 16)
+    {
+        if (len >= 4)
+        {
+            a = (HASH_READ4(p) << 32) | HASH_READ4(p + ((len >> 3) << 2));
+            b = (HASH_READ4(p + len - 4) << 32) | HASH_READ4(p + len - 4 - ((len >> 3) << 2));
+        }
+        else if (len > 0)
+        {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+            b = 0;
+        }
+        else
+        {
+            a = b = 0;
+        }
+    }
+    else
+    {
+        while (i > 16)
+        {
+            a = HASH_READ8(p) ^ HASH_K1;
+            b = HASH_READ8(p + 8) ^ seed;
+            HASH_MUM(a, b);
+            seed = a ^ b;
+            p += 16;
+            i -= 16;
+        }
+        a = HASH_READ8(p + i - 16);
+        b = HASH_READ8(p + i - 8);
+    }
 
-    while ((c = *p++) != 0)
-        hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
-    return hash;
+    a ^= HASH_K1;
+    b ^= seed;
+    HASH_MUM(a, b);
+    a ^= HASH_K2 ^ len;
+    b ^= HASH_K1;
+    HASH_MUM(a, b);
+    return a ^ b;
 }
 
 int compare_pointers(void *a, void *b)
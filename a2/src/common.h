@@ -5,6 +5,7 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdint.h>
+#include <stddef.h>
 
 struct list;
 
@@ -37,6 +38,13 @@ void fatal_error(char *msg, ...);
 
 void tokenize_file(const char *filepath, struct list *list);
 
+/*
+ * Hashes the contents of the given file with a fast, non-cryptographic
+ * 64-bit hash, and assigns the hash and the size of the file to the
+ * given pointers.  Returns 0 if the file cannot be opened.
+ */
+int hash_file(const char *filepath, uint64_t *hash, long *size);
+
 /*
  * Recursively finds the names of all files under the given root directory.
  * Returns the file names as a list of strings.
@@ -55,7 +63,9 @@ int compare_int(void *a, void *b);
 int compare_strings(void *a, void *b);
 
 /*
- * Hashes a string.
+ * Hashes a string.  All bits of the hash are well distributed, so the
+ * low bits may be used directly as an index into a table whose size is
+ * a power of two.
  */
 unsigned long hash_string(void *s);
 
@@ -72,6 +82,13 @@ int compare_pointers(void *a, void *b);
 char *
 concatenate_strings (int num_strings, const char *first, ...);
 
+/*
+ * Generates a random word of 1 to 'maxlen' lowercase letters, drawing
+ * from the given seed with rand_r().  The word is allocated using malloc.
+ */
+char *
+generate_string (unsigned int *seed, int maxlen);
+
 /*
  * Checks if the given 'dirpath' is a valid directory.
  * 1 = valid
@@ -0,0 +1,113 @@
+#include "docstore.h"
+
+#include <stdlib.h>
+
+/*
+ * Documents are stored back to back in a single buffer.  Each term id
+ * is encoded as a variable length integer, 7 bits per byte, with the
+ * high bit set on all but the last byte.  Term ids are assigned in
+ * order of first occurrence, so frequent terms tend to have small ids
+ * and encode to one or two bytes.
+ */
+struct docstore
+{
+    unsigned char *data;
+    size_t size;
+    size_t capacity;
+    size_t *offsets; /* Start of each document in 'data' */
+    int *lengths;    /* Number of tokens in each document */
+    int numdocs;
+    int maxdocs;
+};
+
+docstore_t *docstore_create()
+{
+    docstore_t *store = calloc(1, sizeof(docstore_t));
+    if (store == NULL)
+        fatal_error("out of memory");
+
+    return store;
+}
+
+void docstore_destroy(docstore_t *store)
+{
+    free(store->data);
+    free(store->offsets);
+    free(store->lengths);
+    free(store);
+}
+
+static void reserve(docstore_t *store, size_t n)
+{
+    if (store->size + n <= store->capacity)
+        return;
+
+    while (store->size + n > store->capacity)
+        store->capacity = store->capacity ? store->capacity * 2 : 4096;
+    store->data = realloc(store->data, store->capacity);
+    if (store->data == NULL)
+        fatal_error("out of memory");
+}
+
+void docstore_add(docstore_t *store, int *termids, int n)
+{
+    int i;
+
+    if (store->numdocs == store->maxdocs)
+    {
+        store->maxdocs = store->maxdocs ? store->maxdocs * 2 : 64;
+        store->offsets = realloc(store->offsets, store->maxdocs * sizeof(size_t));
+        store->lengths = realloc(store->lengths, store->maxdocs * sizeof(int));
+        if (store->offsets == NULL || store->lengths == NULL)
+            fatal_error("out of memory");
+    }
+    store->offsets[store->numdocs] = store->size;
+    store->lengths[store->numdocs] = n;
+    store->numdocs++;
+
+    /* A 32-bit id needs at most 5 bytes */
+    reserve(store, (size_t)n * 5);
+    for (i = 0; i < n; i++)
+    {
+        unsigned int v = termids[i];
+        while (v >= 0x80)
+        {
+            store->data[store->size++] = (v & 0x7f) | 0x80;
+            v >>= 7;
+        }
+        store->data[store->size++] = v;
+    }
+}
+
+int docstore_length(docstore_t *store, int doc)
+{
+    return store->lengths[doc];
+}
+
+int docstore_read(docstore_t *store, int doc, int *termids, int max)
+{
+    int i, n = store->lengths[doc];
+    unsigned char *p = store->data + store->offsets[doc];
+
+    if (n > max)
+        n = max;
+
+    for (i = 0; i < n; i++)
+    {
+        unsigned int v = 0;
+        int shift = 0;
+        while (*p & 0x80)
+        {
+            v |= (unsigned int)(*p++ & 0x7f) << shift;
+            shift += 7;
+        }
+        v |= (unsigned int)*p++ << shift;
+        termids[i] = v;
+    }
+    return n;
+}
+
+size_t docstore_bytes(docstore_t *store)
+{
+    return store->size;
+}
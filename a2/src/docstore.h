@@ -0,0 +1,47 @@
+#ifndef DOCSTORE_H
+#define DOCSTORE_H
+
+#include "common.h"
+
+/*
+ * The type of document stores.  A document store keeps the token
+ * stream of every indexed document as a compressed sequence of term
+ * ids, so that document text can be reconstructed without reading the
+ * original files.
+ */
+struct docstore;
+typedef struct docstore docstore_t;
+
+/*
+ * Creates a new, empty document store.
+ */
+docstore_t *docstore_create();
+
+/*
+ * Destroys the given document store.
+ */
+void docstore_destroy(docstore_t *store);
+
+/*
+ * Appends a document consisting of the given 'n' term ids to the store.
+ * Documents are numbered in the order they are added, starting at 0.
+ */
+void docstore_add(docstore_t *store, int *termids, int n);
+
+/*
+ * Returns the number of tokens in the given document.
+ */
+int docstore_length(docstore_t *store, int doc);
+
+/*
+ * Decodes at most 'max' term ids of the given document into 'termids'.
+ * Returns the number of term ids decoded.
+ */
+int docstore_read(docstore_t *store, int doc, int *termids, int max);
+
+/*
+ * Returns the number of bytes used to store the compressed documents.
+ */
+size_t docstore_bytes(docstore_t *store);
+
+#endif
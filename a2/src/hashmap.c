@@ -9,8 +9,20 @@
 
 #include <stdlib.h>
 
+/*
+ * The table doubles once it holds as many entries as buckets.  Rather
+ * than moving every entry at once, the old and new bucket arrays
+ * coexist while the entries are migrated a few buckets at a time by
+ * each subsequent map_put(), so no single insert pays for more than
+ * 'REHASH_STEP' buckets.  Lookups search both arrays but never migrate,
+ * so that concurrent readers of a map that is not being modified never
+ * write to it.
+ */
+#define REHASH_STEP 4
+
 struct mapentry
 {
+    unsigned long hash; /* Full hash of the key, kept for resizing and lookups */
     void *key;
     void *value;
     struct mapentry *next;
@@ -18,26 +30,74 @@ struct mapentry
 
 typedef struct mapentry mapentry_t;
 
+/*
+ * Entries are allocated from slabs owned by the map, so that inserting
+ * a key takes the next entry of the current slab instead of calling
+ * malloc(), and destroying the map frees a few slabs instead of every
+ * entry.  Slabs start small, for the many maps of a few keys, and
+ * double in size up to 'SLAB_MAX' entries.  Removed entries are kept on
+ * a free list for reuse.
+ */
+#define SLAB_MIN 8
+#define SLAB_MAX 4096
+
+typedef struct slab
+{
+    struct slab *next;
+    int capacity;
+    mapentry_t entries[];
+} slab_t;
+
 struct map
 {
     cmpfunc_t cmpfunc;
     hashfunc_t hashfunc;
     int size;
     mapentry_t **buckets;
-    int numbuckets;
+    int numbuckets;          /* A power of two; a hash's bucket is its low bits */
+    mapentry_t **oldbuckets; /* Buckets being migrated, or NULL if not resizing */
+    int oldnumbuckets;
+    int migrated;            /* Old buckets migrated so far */
+    slab_t *slabs;           /* The slab entries are taken from first */
+    int slabused;            /* Entries taken from the first slab */
+    size_t slabbytes;
+    mapentry_t *freelist;    /* Removed entries, linked through 'next' */
 };
 
-static mapentry_t *newentry(void *key, void *value, mapentry_t *next)
+static mapentry_t *newentry(map_t *map, unsigned long hash, void *key, void *value, mapentry_t *next)
 {
     mapentry_t *e;
+    slab_t *slab;
+    int capacity;
 
-    e = malloc(sizeof(mapentry_t));
-    if (e == NULL)
+    if (map->freelist != NULL)
     {
-        fatal_error("out of memory");
-        goto end;
+        e = map->freelist;
+        map->freelist = e->next;
+    }
+    else
+    {
+        if (map->slabs == NULL || map->slabused == map->slabs->capacity)
+        {
+            capacity = map->slabs == NULL ? SLAB_MIN : map->slabs->capacity * 2;
+            if (capacity > SLAB_MAX)
+                capacity = SLAB_MAX;
+            slab = malloc(sizeof(slab_t) + capacity * sizeof(mapentry_t));
+            if (slab == NULL)
+            {
+                fatal_error("out of memory");
+                goto end;
+            }
+            slab->next = map->slabs;
+            slab->capacity = capacity;
+            map->slabs = slab;
+            map->slabused = 0;
+            map->slabbytes += sizeof(slab_t) + capacity * sizeof(mapentry_t);
+        }
+        e = &map->slabs->entries[map->slabused++];
     }
 
+    e->hash = hash;
     e->key = key;
     e->value = value;
     e->next = next;
@@ -46,7 +106,25 @@ end:
     return e;
 }
 
+/*
+ * Returns the number of buckets needed to hold 'capacity' keys without
+ * growing, since the map grows once it holds as many keys as buckets.
+ */
+static int bucketsfor(int capacity)
+{
+    int numbuckets = 8;
+
+    while (numbuckets <= capacity)
+        numbuckets *= 2;
+    return numbuckets;
+}
+
 map_t *map_create(cmpfunc_t cmpfunc, hashfunc_t hashfunc)
+{
+    return map_create_with_capacity(cmpfunc, hashfunc, 0);
+}
+
+map_t *map_create_with_capacity(cmpfunc_t cmpfunc, hashfunc_t hashfunc, int capacity)
 {
     map_t *map;
 
@@ -60,7 +138,14 @@ map_t *map_create(cmpfunc_t cmpfunc, hashfunc_t hashfunc)
     map->cmpfunc = cmpfunc;
     map->hashfunc = hashfunc;
     map->size = 0;
-    map->numbuckets = 8;
+    map->oldbuckets = NULL;
+    map->oldnumbuckets = 0;
+    map->migrated = 0;
+    map->slabs = NULL;
+    map->slabused = 0;
+    map->slabbytes = 0;
+    map->freelist = NULL;
+    map->numbuckets = bucketsfor(capacity);
     map->buckets = calloc(map->numbuckets, sizeof(mapentry_t *));
     if (map->buckets == NULL)
     {
@@ -81,7 +166,8 @@ static void freebuckets(int numbuckets, mapentry_t **buckets, void (*destroy_key
     int b;
     mapentry_t *e, *tmp;    
 
-    for (b = 0; b < numbuckets; b++)
+    /* The entries themselves are freed with their slabs */
+    for (b = 0; b < numbuckets && (destroy_key || destroy_val); b++)
     {
         e = buckets[b];
         while (e != NULL)
@@ -94,8 +180,6 @@ static void freebuckets(int numbuckets, mapentry_t **buckets, void (*destroy_key
 
             if (destroy_val && tmp->value)
                 destroy_val (tmp->value);
-
-            free(tmp);
         }
     }
     free(buckets);
@@ -103,93 +187,349 @@ static void freebuckets(int numbuckets, mapentry_t **buckets, void (*destroy_key
 
 void map_destroy(map_t *map, void (*destroy_key)(void *), void (*destroy_val)(void *))
 {
+    slab_t *slab;
+
     freebuckets(map->numbuckets, map->buckets, destroy_key, destroy_val);    
+    if (map->oldbuckets != NULL)
+        freebuckets(map->oldnumbuckets, map->oldbuckets, destroy_key, destroy_val);
+    while (map->slabs != NULL)
+    {
+        slab = map->slabs;
+        map->slabs = slab->next;
+        free(slab);
+    }
     free(map);
 }
 
+/*
+ * Moves the entries of up to 'REHASH_STEP' old buckets to the new
+ * buckets, and frees the old buckets once all are migrated.
+ */
+static void migrate(map_t *map)
+{
+    int n;
+    mapentry_t *e, *next;
+
+    for (n = 0; n < REHASH_STEP && map->migrated < map->oldnumbuckets; n++)
+    {
+        /* Entries are relinked, not reallocated */
+        e = map->oldbuckets[map->migrated];
+        map->oldbuckets[map->migrated++] = NULL;
+        while (e != NULL)
+        {
+            int b = e->hash & (map->numbuckets - 1);
+            next = e->next;
+            e->next = map->buckets[b];
+            map->buckets[b] = e;
+            e = next;
+        }
+    }
+
+    if (map->migrated == map->oldnumbuckets)
+    {
+        free(map->oldbuckets);
+        map->oldbuckets = NULL;
+        map->oldnumbuckets = 0;
+        map->migrated = 0;
+    }
+}
+
+/*
+ * Starts migrating the entries to a bucket array of twice the size.
+ */
 static void growmap(map_t *map)
 {
-    int b;
-    int oldnumbuckets = map->numbuckets;
-    mapentry_t **oldbuckets = map->buckets;
+    /* The previous resize is normally done long before the next */
+    while (map->oldbuckets != NULL)
+        migrate(map);
 
-    map->size = 0;
-    map->numbuckets = oldnumbuckets * 2;
+    map->oldbuckets = map->buckets;
+    map->oldnumbuckets = map->numbuckets;
+    map->migrated = 0;
+    map->numbuckets = map->oldnumbuckets * 2;
     map->buckets = calloc(map->numbuckets, sizeof(mapentry_t *));
     if (map->buckets == NULL)
         fatal_error("out of memory");
+}
+
+void map_reserve(map_t *map, int capacity)
+{
+    int b, numbuckets = bucketsfor(capacity);
+    mapentry_t **buckets, *e, *next;
+
+    if (numbuckets <= map->numbuckets)
+        return;
 
-    for (b = 0; b < oldnumbuckets; b++)
+    /* An explicit reserve moves all entries at once, finishing any resize */
+    while (map->oldbuckets != NULL)
+        migrate(map);
+    buckets = calloc(numbuckets, sizeof(mapentry_t *));
+    if (buckets == NULL)
+        fatal_error("out of memory");
+    for (b = 0; b < map->numbuckets; b++)
     {
-        mapentry_t *e = oldbuckets[b];
-        while (e != NULL)
+        for (e = map->buckets[b]; e != NULL; e = next)
         {
-            map_put(map, e->key, e->value);
-            e = e->next;
+            next = e->next;
+            e->next = buckets[e->hash & (numbuckets - 1)];
+            buckets[e->hash & (numbuckets - 1)] = e;
         }
     }
-    freebuckets(oldnumbuckets, oldbuckets, NULL, NULL);
-}   
+    free(map->buckets);
+    map->buckets = buckets;
+    map->numbuckets = numbuckets;
+}
 
-void map_put(map_t *map, void *key, void *value)
+/*
+ * Returns the entry of the given key in the given chain, or NULL.  The
+ * key is only compared with entries of the same hash.
+ */
+static mapentry_t *findinchain(map_t *map, mapentry_t *e, void *key, unsigned long hash)
 {
-    unsigned long hash = map->hashfunc(key);
-    int b = hash % map->numbuckets;
-    mapentry_t *e = map->buckets[b];
-
-    while (e != NULL && map->cmpfunc(key, e->key) != 0)
+    while (e != NULL && (e->hash != hash || map->cmpfunc(key, e->key) != 0))
     {
         e = e->next;
     }
+    return e;
+}
+
+/*
+ * Returns the entry of the given key, or NULL if the key is not in the
+ * map.  The key may still be in an old bucket that is not yet migrated.
+ */
+static mapentry_t *findentry(map_t *map, void *key, unsigned long hash)
+{
+    mapentry_t *e = findinchain(map, map->buckets[hash & (map->numbuckets - 1)], key, hash);
+    int b;
+
+    if (e == NULL && map->oldbuckets != NULL)
+    {
+        b = hash & (map->oldnumbuckets - 1);
+        if (b >= map->migrated)
+            e = findinchain(map, map->oldbuckets[b], key, hash);
+    }
+    return e;
+}
+
+void **map_get_or_insert(map_t *map, void *key)
+{
+    unsigned long hash = map->hashfunc(key);
+    mapentry_t *e;
+    int b;
+
+    if (map->oldbuckets != NULL)
+        migrate(map);
+
+    e = findentry(map, key, hash);
     if (e == NULL)
     {
-        map->buckets[b] = newentry(key, value, map->buckets[b]);
+        /* Growing moves the bucket arrays, but not the entries */
+        b = hash & (map->numbuckets - 1);
+        e = newentry(map, hash, key, NULL, map->buckets[b]);
+        map->buckets[b] = e;
         map->size++;
         if (map->size >= map->numbuckets)
             growmap(map);
     }
-    else
+    return &e->value;
+}
+
+void map_put(map_t *map, void *key, void *value)
+{
+    *map_get_or_insert(map, key) = value;
+}
+
+/*
+ * Unlinks and returns the entry of the given key from the given chain,
+ * or returns NULL if the key is not in the chain.
+ */
+static mapentry_t *unlinkentry(map_t *map, mapentry_t **link, void *key, unsigned long hash)
+{
+    mapentry_t *e;
+
+    while (*link != NULL && ((*link)->hash != hash || map->cmpfunc(key, (*link)->key) != 0))
+        link = &(*link)->next;
+    e = *link;
+    if (e != NULL)
+        *link = e->next;
+    return e;
+}
+
+int map_remove(map_t *map, void *key, void (*destroy_key)(void *), void (*destroy_val)(void *))
+{
+    unsigned long hash = map->hashfunc(key);
+    mapentry_t *e = unlinkentry(map, &map->buckets[hash & (map->numbuckets - 1)], key, hash);
+    int b;
+
+    if (e == NULL && map->oldbuckets != NULL)
     {
-        e->value = value;   
+        b = hash & (map->oldnumbuckets - 1);
+        if (b >= map->migrated)
+            e = unlinkentry(map, &map->oldbuckets[b], key, hash);
     }
+    if (e == NULL)
+        return 0;
+
+    if (destroy_key && e->key)
+        destroy_key(e->key);
+    if (destroy_val && e->value)
+        destroy_val(e->value);
+    e->next = map->freelist;
+    map->freelist = e;
+    map->size--;
+    return 1;
 }
 
 int map_haskey(map_t *map, void *key)
 {
-    unsigned long hash = map->hashfunc(key);
-    int b = hash % map->numbuckets;
-    mapentry_t *e = map->buckets[b];
+    return findentry(map, key, map->hashfunc(key)) != NULL;
+}
+
+int map_size(map_t *map)
+{
+    return map->size;
+}
 
-    while (e != NULL && map->cmpfunc(key, e->key) != 0)
+size_t map_bytes(map_t *map)
+{
+    return sizeof(map_t) + (map->numbuckets + map->oldnumbuckets) * sizeof(mapentry_t *) + map->slabbytes;
+}
+
+void *map_get(map_t *map, void *key)
+{
+    mapentry_t *e = findentry(map, key, map->hashfunc(key));
+
+    if (e == NULL)
     {
-        e = e->next;
+        fatal_error("key not found in map");
+        return NULL;
     }
-    if (e == NULL)
+    else {
+        return e->value;
+    }
+}
+
+void *map_tryget(map_t *map, void *key)
+{
+    mapentry_t *e = findentry(map, key, map->hashfunc(key));
+
+    return e != NULL ? e->value : NULL;
+}
+
+/* Returns the number of entries in the given chain */
+static int chainlength(mapentry_t *e)
+{
+    int n = 0;
+
+    for (; e != NULL; e = e->next)
+        n++;
+    return n;
+}
+
+void map_stats(map_t *map, map_stats_t *stats)
+{
+    int b, k, probes;
+    double total = 0;
+    mapentry_t *e;
+
+    stats->size = map->size;
+    stats->capacity = map->numbuckets;
+    stats->load = (double)map->size / map->numbuckets;
+    stats->max_probe = 0;
+    for (b = 0; b < map->numbuckets; b++)
     {
-        return 0;
+        /* The k-th key of a chain is found after k probes */
+        k = chainlength(map->buckets[b]);
+        total += k * (k + 1) / 2.0;
+        if (k > stats->max_probe)
+            stats->max_probe = k;
     }
-    else
+    for (b = map->migrated; map->oldbuckets != NULL && b < map->oldnumbuckets; b++)
     {
-        return 1;
+        /* Keys not yet migrated are found after searching their new bucket */
+        for (k = 1, e = map->oldbuckets[b]; e != NULL; k++, e = e->next)
+        {
+            probes = chainlength(map->buckets[e->hash & (map->numbuckets - 1)]) + k;
+            total += probes;
+            if (probes > stats->max_probe)
+                stats->max_probe = probes;
+        }
     }
+    stats->mean_probe = map->size > 0 ? total / map->size : 0;
+    stats->bytes = map_bytes(map);
 }
 
-void *map_get(map_t *map, void *key)
+struct map_iter
 {
-    unsigned long hash = map->hashfunc(key);
-    int b = hash % map->numbuckets;
-    mapentry_t *e = map->buckets[b];
+    map_t *map;
+    mapentry_t **buckets; /* The buckets being visited, new or old */
+    int numbuckets;
+    int bucket;           /* Next bucket to visit */
+    mapentry_t *next;     /* Next entry to return, or NULL at the end */
+};
 
-    while (e != NULL && map->cmpfunc(key, e->key) != 0)
+/* Moves the iterator to the next entry, if the current one is done */
+static void advance(map_iter_t *iter)
+{
+    map_t *map = iter->map;
+
+    while (iter->next == NULL)
     {
-        e = e->next;
+        if (iter->bucket < iter->numbuckets)
+        {
+            iter->next = iter->buckets[iter->bucket++];
+        }
+        else if (iter->buckets == map->buckets && map->oldbuckets != NULL)
+        {
+            /* Then the old buckets that are not yet migrated */
+            iter->buckets = map->oldbuckets;
+            iter->numbuckets = map->oldnumbuckets;
+            iter->bucket = map->migrated;
+        }
+        else
+        {
+            break;
+        }
     }
+}
+
+map_iter_t *map_createiter(map_t *map)
+{
+    map_iter_t *iter = malloc(sizeof(map_iter_t));
+
+    if (iter == NULL)
+        fatal_error("out of memory");
+    iter->map = map;
+    iter->buckets = map->buckets;
+    iter->numbuckets = map->numbuckets;
+    iter->bucket = 0;
+    iter->next = NULL;
+    advance(iter);
+    return iter;
+}
+
+void map_destroyiter(map_iter_t *iter)
+{
+    free(iter);
+}
+
+int map_hasnext(map_iter_t *iter)
+{
+    return iter->next != NULL;
+}
+
+void *map_next(map_iter_t *iter, void **value)
+{
+    mapentry_t *e = iter->next;
+
     if (e == NULL)
     {
-        fatal_error("key not found in map");
+        fatal_error("map iterator exhausted");
         return NULL;
     }
-    else {
-        return e->value;
-    }
+    if (value != NULL)
+        *value = e->value;
+    iter->next = e->next;
+    advance(iter);
+    return e->key;
 }
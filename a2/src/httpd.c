@@ -70,6 +70,7 @@ static int splitstring(char *s, int sep, char **left, char **right)
     return 1;
 }
 
+/* Returns the value of the given hex digit, or -1 if it is not one */
 static int hexdigit(char ch)
 {
     if (ch >= '0' && ch <= '9')
@@ -79,13 +80,17 @@ static int hexdigit(char ch)
     if (ch >= 'a' && ch <= 'f')
         return ch - 'a' + 10;
 
-    fatal_error("bad hex digit");
     return -1;
 }
 
+/*
+ * Returns the decoded form of the given URL component, or NULL if it
+ * contains a '%' that is not followed by two hex digits.
+ */
 static char *urldecode(char *s)
 {
     char *r, *p;
+    int hi, lo;
 
     r = p = newstring(strlen(s));
     for (;;)
@@ -99,9 +104,14 @@ static char *urldecode(char *s)
             *p++ = ' ';
             break;
         case '%':
-            *p = hexdigit(*s++) * 16;
-            *p++ += hexdigit(*s++);
-            // *p++;
+            /* A truncated escape stops at the terminating 0 */
+            if ((hi = hexdigit(s[0])) < 0 || (lo = hexdigit(s[1])) < 0)
+            {
+                free(r);
+                return NULL;
+            }
+            *p++ = hi * 16 + lo;
+            s += 2;
             break;
         default:
             *p++ = ch;
@@ -110,6 +120,31 @@ static char *urldecode(char *s)
     }
 }
 
+char *urlencode(char *s)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    char *r, *p;
+
+    r = p = newstring(strlen(s) * 3);
+    for (; *s; s++)
+    {
+        unsigned char ch = *s;
+
+        if (isalnum(ch) || strchr("-_.~/", ch))
+        {
+            *p++ = ch;
+        }
+        else
+        {
+            *p++ = '%';
+            *p++ = hex[ch >> 4];
+            *p++ = hex[ch & 15];
+        }
+    }
+    *p = 0;
+    return r;
+}
+
 char *html_escape(char *s)
 {
     char *r, *p;
@@ -150,6 +185,14 @@ void http_ok(FILE *f, const char *content_type)
     fprintf(f, "HTTP/1.0 200 OK\r\nContent-Type: %s\r\n\r\n", content_type);
 }
 
+/* Sends a HTTP Bad Request response, for a request that could not be decoded */
+static void http_badrequest(FILE *f)
+{
+    fprintf(f, "HTTP/1.0 400 Bad Request\r\nContent-Type: text/html\r\n\r\n");
+    fprintf(f, "<html><head><title>400 Bad Request</title></head>");
+    fprintf(f, "<body><p>The request could not be decoded.</p></body></html>");
+}
+
 void http_notfound(FILE *f, char *path)
 {
     fprintf(f, "HTTP/1.0 404 Not Found\r\nContent-Type: text/html\r\n\r\n");
@@ -170,6 +213,22 @@ struct http_header
     map_t *query_fields;
 };
 
+/*
+ * Maps 'key' to 'value' in the given fields, both owned by the map.  A
+ * repeated field keeps its first key and its last value.
+ */
+static void put_field(map_t *fields, char *key, char *value)
+{
+    void **slot = map_get_or_insert(fields, key);
+
+    if (*slot != NULL)
+    {
+        free(key);
+        free(*slot);
+    }
+    *slot = value;
+}
+
 static int http_parse_query(char *query, map_t *fields)
 {
     char *buf, *p, *tmp, *key, *value;
@@ -193,14 +252,21 @@ static int http_parse_query(char *query, map_t *fields)
             value = urldecode(tmp);
             free(tmp);
 
-            map_put(fields, key, value);
+            /* Fields with bad escapes are dropped */
+            if (key != NULL && value != NULL)
+                put_field(fields, key, value);
+            else
+            {
+                free(key);
+                free(value);
+            }
         }
         else
         {
             key = newstring(strlen(buf));
             strcpy(key, buf);
-            value = "";
-            map_put(fields, key, value);
+            value = newstring(0);
+            put_field(fields, key, value);
         }
 
         if (p)
@@ -322,7 +388,7 @@ static int http_parse_request_headers(FILE *fp, map_t *fields)
 
         /* Parse the name and value of the header field */
         if (splitstring(line, ':', &name, &value))
-            map_put(fields, name, value);
+            put_field(fields, name, value);
     }
 
     free(line);
@@ -333,7 +399,7 @@ static int http_parse_request_headers(FILE *fp, map_t *fields)
 static int http_parse_request(FILE *fp, struct http_header *hdr)
 {
     int len;
-    char *query;
+    char *query, *value;
 
     hdr->path = NULL;
     hdr->header_fields = NULL;
@@ -353,15 +419,23 @@ static int http_parse_request(FILE *fp, struct http_header *hdr)
     if (!hdr->query_fields)
         goto error;
 
+    /* Arguments may also be passed in the query string of the path */
+    if ((query = strchr(hdr->path, '?')))
+    {
+        *query++ = 0;
+        http_parse_query(query, hdr->query_fields);
+    }
+
     if (hdr->method == HTTP_POST)
     {
-        if (!map_haskey(hdr->header_fields, "Content-Length"))
+        value = map_tryget(hdr->header_fields, "Content-Length");
+        if (value == NULL)
         {
             fprintf(stderr, "No Content-Length in POST request\n");
             goto error;
         }
 
-        len = atoi(map_get(hdr->header_fields, "Content-Length"));
+        len = atoi(value);
         query = newstring(len + 1);
         fread(query, 1, len, fp);
 
@@ -446,7 +520,10 @@ static void *handle_request(void *arg)
     free(hdr.path);
 
     /* Invoke the request handler to write the response */
-    handler(path, hdr.header_fields, hdr.query_fields, outf);
+    if (path != NULL)
+        handler(path, hdr.header_fields, hdr.query_fields, outf);
+    else
+        http_badrequest(outf);
 
     free(path);
 
@@ -37,4 +37,11 @@ void http_notfound(FILE *f, char *path);
  */
 char *html_escape(char *s);
 
+/*
+ * Returns a string where every character other than letters, digits
+ * and - _ . ~ / has been replaced with its %XX escape, so that it may be
+ * used as a path or query string value in a URL.
+ */
+char *urlencode(char *s);
+
 #endif
@@ -1,31 +1,1935 @@
 #include "index.h"
+#include "docstore.h"
+#include "perf.h"
+#include "workpool.h"
+
+#include <pthread.h>
 
 #define ERROR_MSG "%s : %s(), at line: %d", __FILE__, __func__, __LINE__
 
-struct index
+/*
+ * Number of terms picked from the source document in a "more like this" query.
+ */
+#define MLT_TERMS 12
+
+/*
+ * Terms occurring in fewer documents than this are not picked, as they
+ * cannot match any document other than the source document.
+ */
+#define MLT_MINDF 2
+
+/*
+ * Snippets are picked as the window of 'SNIPPET_WORDS' consecutive words
+ * containing the most query terms, among the first 'SNIPPET_SCAN' words
+ * of a document.  At most 'SNIPPET_CACHE_SIZE' snippets are cached.
+ */
+#define SNIPPET_WORDS 24
+#define SNIPPET_SCAN 4096
+#define SNIPPET_CACHE_SIZE 4096
+
+/*
+ * Maximum number of ranges a merge is split into on the work pool.
+ */
+#define MERGE_RANGES 16
+
+/*
+ * Queries of a batch are evaluated in chunks of 'BATCH_CHUNK' queries,
+ * sharing term lookups and intermediate results within each chunk.
+ */
+#define BATCH_CHUNK 256
+
+typedef struct document document_t;
+typedef struct term term_t;
+
+/*
+ * Forward index entry; a term occurring in a document together with its
+ * term frequency in that document.
+ */
+typedef struct fwdentry
+{
+    int termid;
+    float tf;
+} fwdentry_t;
+
+struct document
+{
+    char *path;
+    int id;
+    int numterms;      /* Number of distinct terms in the document */
+    fwdentry_t *terms; /* Forward index, sorted by term id */
+    char **aliases;    /* Paths of identical documents, not indexed separately */
+    int numaliases;
+};
+
+struct term
+{
+    char *word;
+    int id;
+    int df;          /* Number of documents containing the term */
+    set_t *postings; /* Set of 'posting_t', ordered by document id, or NULL if not decoded */
+    unsigned char *block; /* Compressed postings, or NULL if 'postings' is always resident */
+    size_t blocksize;
+    int pins;        /* Queries using the decoded postings, which may not be evicted */
+    term_t *prev;    /* Neighbours in the posting cache, most recently used first */
+    term_t *next;
+    set_t *tier1;    /* Highest impact postings, or NULL if none were pruned */
+    double threshold; /* Highest tf among the pruned postings */
+    double maxtf;
+};
+
+/*
+ * Inverted index entry; a document containing a term, together with the
+ * term frequency of the term in that document.
+ */
+typedef struct posting
+{
+    document_t *doc;
+    double tf;
+} posting_t;
+
+struct index
+{
+    map_t *map;   /* Maps words to 'term_t' */
+    map_t *paths; /* Maps paths to 'document_t' */
+    term_t **terms;
+    int numterms;
+    int maxterms;
+    document_t **docs;
+    int numdocs;
+    int maxdocs;
+    docstore_t *store; /* Token streams of the documents */
+    map_t *snippets;   /* Maps document and query terms to a cached snippet */
+    int numsnippets;
+    map_t *results;    /* Maps result count and query form to cached results */
+    int maxresults;    /* Queries whose results are cached, or 0 if not caching */
+    long result_hits;
+    long result_misses;
+    pthread_mutex_t results_lock;
+    int tiersize;    /* Postings per term in the first tier, or 0 if not built */
+    long tier1_queries;
+    long tier2_queries;
+    workpool_t *pool;  /* Threads evaluating subtrees in parallel, or NULL */
+    long parallel_threshold; /* Postings of a subtree worth evaluating in parallel */
+    pthread_mutex_t cache_lock; /* Protects the posting cache and the decoded postings */
+    term_t *cache_head; /* Compressed terms with decoded postings, most recently used first */
+    term_t *cache_tail;
+    long cache_postings; /* Decoded postings in the cache */
+    long cache_capacity; /* Decoded postings kept once unpinned, or 0 if not compressed */
+    long cache_hits;
+    long cache_misses;
+    long cache_evictions;
+    double doc_count;
+};
+
+/*
+ * Operators of the query tree built by the parser.
+ */
+typedef enum qop
+{
+    QOP_TERM,
+    QOP_AND,
+    QOP_OR,
+    QOP_ANDNOT
+} qop_t;
+
+static const char *qop_names[] = {"TERM", "AND", "OR", "ANDNOT"};
+
+/*
+ * Set operation of each operator, cancellable when a query has a budget.
+ */
+static set_t *(*const qop_sets[])(set_t *, set_t *, set_cancelfunc_t, void *) = {
+    NULL, set_intersection_cancel, set_union_cancel, set_difference_cancel};
+
+/*
+ * Set operation of each operator over a range of elements, for merges
+ * split across the work pool.
+ */
+static set_t *(*const qop_ranges[])(set_t *, set_t *, void *, void *, set_cancelfunc_t, void *) = {
+    NULL, set_intersection_range, set_union_range, set_difference_range};
+
+typedef struct qnode qnode_t;
+
+struct qnode
+{
+    qop_t op;
+    char *word;     /* Query word of a QOP_TERM node */
+    term_t *term;   /* Term of a QOP_TERM node, or NULL if not indexed */
+    int negated;    /* Nonzero if on the right hand side of ANDNOT */
+    qnode_t *left;
+    qnode_t *right;
+    long cost;      /* Postings of the terms of the subtree */
+
+    /* Profile of the last evaluation, recorded in explain mode */
+    int size;       /* Number of documents produced, or -1 if none */
+    double time;    /* Wall time in seconds, including operands */
+    long nodes;     /* Set nodes allocated by the operator */
+};
+
+/*
+ * State shared by the queries of a batch chunk.  Term lookups and the
+ * results of operators are kept until the end of the chunk, so that
+ * queries with common subexpressions evaluate them once.
+ */
+typedef struct qshared
+{
+    map_t *terms;   /* Word -> term, or 'unknown_term' if not indexed */
+    map_t *sets;    /* Operator key -> result set */
+    map_t *results; /* Query key -> results of the query */
+    list_t *keys;   /* Keys and result sets to free at the end of the chunk */
+    list_t *temps;
+    list_t *pins;   /* Terms whose postings are used until the end of the chunk */
+    long tier1_queries;
+    long tier2_queries;
+} qshared_t;
+
+static term_t unknown_term;
+
+/*
+ * State of a single query, from parsing through evaluation.  Keeping it
+ * out of the index means that queries do not modify the index.
+ */
+typedef struct qctx
+{
+    index_t *index;
+    list_t *tokens;  /* Tokens not yet consumed by the parser */
+    char *current;   /* Current token of the parser */
+    char **errmsg;
+    int negated;     /* Nonzero while parsing the right hand side of ANDNOT */
+    int conjunctive; /* Nonzero if the query contains AND outside of ANDNOT */
+    int tier;        /* Tier the query is evaluated against */
+    int explain;     /* Nonzero to record a profile in the query tree */
+    int failed;      /* Nonzero if the query could not be parsed */
+    list_t *qterms;  /* Terms contributing to the score of the query */
+    list_t *temps;   /* Sets created while evaluating the query */
+    list_t *pins;    /* Terms whose decoded postings the query uses */
+    qshared_t *shared; /* State shared with other queries of a batch, or NULL */
+    const index_budget_t *budget; /* Limits on the work of the query, or NULL */
+    double deadline; /* Time at which the query runs out of time */
+    long postings;   /* Postings visited so far */
+    long nodes;      /* Set nodes allocated so far */
+    const char *exceeded; /* Name of the exceeded limit, or NULL */
+    pthread_mutex_t lock; /* Protects the above while subtrees run in parallel */
+} qctx_t;
+
+static term_t *lookup_term(qctx_t *ctx, char *word);
+static void destroy_results(list_t *results);
+static qnode_t *balance(qnode_t *node);
+static void next_token(qctx_t *ctx);
+static void parse_error(qctx_t *ctx, const char *fmt, const char *token);
+static qnode_t *parse_query(qctx_t *ctx);
+static qnode_t *parse_andterm(qctx_t *ctx);
+static qnode_t *parse_orterm(qctx_t *ctx);
+static qnode_t *parse_term(qctx_t *ctx);
+
+int compare_query_path(void *a, void *b)
+{
+    char *d1 = ((query_result_t *)a)->path;
+    char *d2 = ((query_result_t *)b)->path;
+    return compare_strings(d1, d2);
+}
+
+int compare_query(void *a, void *b)
+{
+    double d1 = ((query_result_t *)a)->score;
+    double d2 = ((query_result_t *)b)->score;
+    if (d1 > d2)
+        return -1;
+    if (d1 < d2)
+        return 1;
+    return 0;
+}
+
+static int compare_posting(void *a, void *b)
+{
+    return ((posting_t *)a)->doc->id - ((posting_t *)b)->doc->id;
+}
+
+static int compare_fwdentry(const void *a, const void *b)
+{
+    return ((fwdentry_t *)a)->termid - ((fwdentry_t *)b)->termid;
+}
+
+/*
+ * Returns the inverse document frequency of the given term.
+ */
+static double term_idf(index_t *index, term_t *term)
+{
+    return log(index->doc_count / (double)term->df);
+}
+
+/*
+ * Returns the frequency of the given term in the given document, using
+ * the forward index of the document.
+ */
+static double document_tf(document_t *doc, int termid)
+{
+    int lo = 0, hi = doc->numterms - 1;
+
+    while (lo <= hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+        if (doc->terms[mid].termid < termid)
+            lo = mid + 1;
+        else if (doc->terms[mid].termid > termid)
+            hi = mid - 1;
+        else
+            return doc->terms[mid].tf;
+    }
+    return 0;
+}
+
+static query_result_t *newresult(document_t *doc, double score)
+{
+    query_result_t *result = malloc(sizeof(query_result_t));
+    if (result == NULL)
+    {
+        fatal_error(ERROR_MSG);
+    }
+    result->path = doc->path;
+    result->score = score;
+    return result;
+}
+
+/*
+ * A word occurring at the given position of the document being indexed.
+ */
+typedef struct occurrence
+{
+    char *word;
+    int pos;
+} occurrence_t;
+
+/*
+ * Scratch space used by index_addpath() to aggregate the words of a
+ * document into distinct terms.  It is kept per thread and reused
+ * across documents, growing to fit the largest document seen.
+ */
+typedef struct termvec
+{
+    occurrence_t *occurrences;
+    int *tokens; /* Term ids of the document, in order of occurrence */
+    int capacity;
+} termvec_t;
+
+static __thread termvec_t termvec;
+
+static void termvec_reserve(termvec_t *vec, int n)
+{
+    if (n <= vec->capacity)
+        return;
+
+    while (vec->capacity < n)
+        vec->capacity = vec->capacity ? vec->capacity * 2 : 1024;
+    vec->occurrences = realloc(vec->occurrences, vec->capacity * sizeof(occurrence_t));
+    vec->tokens = realloc(vec->tokens, vec->capacity * sizeof(int));
+    if (vec->occurrences == NULL || vec->tokens == NULL)
+    {
+        fatal_error(ERROR_MSG);
+    }
+    PERF_COUNT(PERF_ALLOCATIONS, 2);
+}
+
+static int compare_occurrence(const void *a, const void *b)
+{
+    return strcmp(((occurrence_t *)a)->word, ((occurrence_t *)b)->word);
+}
+
+static document_t *newdocument(index_t *index, char *path)
+{
+    document_t *doc = calloc(1, sizeof(document_t));
+    if (doc == NULL)
+    {
+        fatal_error(ERROR_MSG);
+    }
+    PERF_COUNT(PERF_ALLOCATIONS, 1);
+    if (index->numdocs == index->maxdocs)
+    {
+        index->maxdocs = index->maxdocs ? index->maxdocs * 2 : 64;
+        index->docs = realloc(index->docs, index->maxdocs * sizeof(document_t *));
+        if (index->docs == NULL)
+        {
+            fatal_error(ERROR_MSG);
+        }
+        PERF_COUNT(PERF_ALLOCATIONS, 1);
+    }
+    doc->path = path;
+    doc->id = index->numdocs;
+    index->docs[index->numdocs++] = doc;
+    map_put(index->paths, doc->path, doc);
+    return doc;
+}
+
+static term_t *newterm(index_t *index, char *word)
+{
+    term_t *term = malloc(sizeof(term_t));
+    if (term == NULL)
+    {
+        fatal_error(ERROR_MSG);
+    }
+    PERF_COUNT(PERF_ALLOCATIONS, 1);
+    if (index->numterms == index->maxterms)
+    {
+        index->maxterms = index->maxterms ? index->maxterms * 2 : 1024;
+        index->terms = realloc(index->terms, index->maxterms * sizeof(term_t *));
+        if (index->terms == NULL)
+        {
+            fatal_error(ERROR_MSG);
+        }
+        PERF_COUNT(PERF_ALLOCATIONS, 1);
+    }
+    term->word = word;
+    term->id = index->numterms;
+    term->df = 0;
+    term->postings = set_create(compare_posting);
+    term->block = NULL;
+    term->blocksize = 0;
+    term->pins = 0;
+    term->prev = NULL;
+    term->next = NULL;
+    term->tier1 = NULL;
+    term->threshold = 0;
+    term->maxtf = 0;
+    index->terms[index->numterms++] = term;
+    return term;
+}
+
+static void free_postings(set_t *postings)
+{
+    set_iter_t *iter = set_createiter(postings);
+    while (set_hasnext(iter))
+        free(set_next(iter));
+    set_destroyiter(iter);
+    set_destroy(postings);
+}
+
+static void droptiers(index_t *index)
+{
+    for (int i = 0; i < index->numterms; i++)
+    {
+        if (NULL != index->terms[i]->tier1)
+            free_postings(index->terms[i]->tier1);
+        index->terms[i]->tier1 = NULL;
+        index->terms[i]->threshold = 0;
+    }
+    index->tiersize = 0;
+}
+
+/*
+ * Empties the result cache, whose results are outdated by new documents.
+ */
+static void clear_results(index_t *index)
+{
+    map_destroy(index->results, free, (void (*)(void *))destroy_results);
+    index->results = map_create(compare_strings, hash_string);
+}
+
+/*
+ * Compressed postings are stored as a sequence of (document id gap,
+ * occurrences) pairs, each encoded as a variable length integer, 7 bits
+ * per byte, with the high bit set on all but the last byte.  The term
+ * frequency is recomputed from the number of occurrences and the length
+ * of the document in the document store.
+ */
+static void put_varint(unsigned char **p, unsigned int v)
+{
+    while (v >= 0x80)
+    {
+        *(*p)++ = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    *(*p)++ = v;
+}
+
+static unsigned int get_varint(unsigned char **p)
+{
+    unsigned int v = 0;
+    int shift = 0;
+
+    while (**p & 0x80)
+    {
+        v |= (unsigned int)(*(*p)++ & 0x7f) << shift;
+        shift += 7;
+    }
+    v |= (unsigned int)*(*p)++ << shift;
+    return v;
+}
+
+/*
+ * Compresses the resident postings of the given term and frees them.
+ */
+static void encode_postings(index_t *index, term_t *term)
+{
+    // Each pair needs at most 5 bytes per integer.
+    unsigned char *block = malloc((size_t)term->df * 10 + 1), *p = block;
+    set_iter_t *iter = set_createiter(term->postings);
+    int last = 0;
+
+    if (NULL == block)
+    {
+        fatal_error(ERROR_MSG);
+    }
+    while (set_hasnext(iter))
+    {
+        posting_t *posting = set_next(iter);
+        int length = docstore_length(index->store, posting->doc->id);
+
+        put_varint(&p, posting->doc->id - last);
+        put_varint(&p, (unsigned int)(posting->tf * length + 0.5));
+        last = posting->doc->id;
+    }
+    set_destroyiter(iter);
+
+    term->blocksize = p - block;
+    term->block = realloc(block, term->blocksize + 1);
+    free_postings(term->postings);
+    term->postings = NULL;
+}
+
+/*
+ * Returns a new set holding the decoded postings of the given term.
+ */
+static set_t *decode_postings(index_t *index, term_t *term)
+{
+    set_t *retval = set_create(compare_posting);
+    unsigned char *p = term->block;
+    int id = 0;
+
+    for (int i = 0; i < term->df; i++)
+    {
+        posting_t *posting = malloc(sizeof(posting_t));
+        if (NULL == posting)
+        {
+            fatal_error(ERROR_MSG);
+        }
+        id += get_varint(&p);
+        posting->doc = index->docs[id];
+        posting->tf = (double)get_varint(&p) / docstore_length(index->store, id);
+        set_add(retval, posting);
+    }
+    return retval;
+}
+
+static void cache_unlink(index_t *index, term_t *term)
+{
+    if (NULL != term->prev)
+        term->prev->next = term->next;
+    else
+        index->cache_head = term->next;
+    if (NULL != term->next)
+        term->next->prev = term->prev;
+    else
+        index->cache_tail = term->prev;
+    term->prev = term->next = NULL;
+}
+
+static void cache_pushfront(index_t *index, term_t *term)
+{
+    term->next = index->cache_head;
+    if (NULL != index->cache_head)
+        index->cache_head->prev = term;
+    else
+        index->cache_tail = term;
+    index->cache_head = term;
+}
+
+/*
+ * Frees the least recently used decoded postings that are not in use
+ * until the cache is within its capacity.  Must hold 'cache_lock'.
+ */
+static void cache_evict(index_t *index)
+{
+    term_t *term = index->cache_tail, *prev;
+
+    while (NULL != term && index->cache_postings > index->cache_capacity)
+    {
+        prev = term->prev;
+        if (0 == term->pins)
+        {
+            cache_unlink(index, term);
+            free_postings(term->postings);
+            term->postings = NULL;
+            index->cache_postings -= term->df;
+            index->cache_evictions++;
+        }
+        term = prev;
+    }
+}
+
+/*
+ * Returns the postings of the given term, decoding them if the term is
+ * compressed and its postings are not cached.  The postings stay valid
+ * until released with release_postings().
+ */
+static set_t *acquire_postings(index_t *index, term_t *term)
+{
+    set_t *decoded = NULL, *retval;
+
+    if (NULL == term->block)
+        return term->postings;
+
+    pthread_mutex_lock(&index->cache_lock);
+    if (NULL == term->postings)
+    {
+        // Decode without holding the lock, so that other queries may
+        // use the cache meanwhile.
+        index->cache_misses++;
+        pthread_mutex_unlock(&index->cache_lock);
+        decoded = decode_postings(index, term);
+        pthread_mutex_lock(&index->cache_lock);
+    }
+    else
+    {
+        index->cache_hits++;
+    }
+
+    if (NULL != term->postings)
+    {
+        // Cached already, possibly decoded by another query meanwhile.
+        cache_unlink(index, term);
+    }
+    else
+    {
+        term->postings = decoded;
+        index->cache_postings += term->df;
+        decoded = NULL;
+    }
+    term->pins++;
+    cache_pushfront(index, term);
+    cache_evict(index);
+    retval = term->postings;
+    pthread_mutex_unlock(&index->cache_lock);
+
+    if (NULL != decoded)
+        free_postings(decoded);
+    return retval;
+}
+
+static void release_postings(index_t *index, term_t *term)
+{
+    if (NULL == term->block)
+        return;
+
+    pthread_mutex_lock(&index->cache_lock);
+    term->pins--;
+    cache_evict(index);
+    pthread_mutex_unlock(&index->cache_lock);
+}
+
+/*
+ * Makes the postings of the given term resident and uncompressed, so
+ * that documents may be added to them.
+ */
+static void expand_postings(index_t *index, term_t *term)
+{
+    if (NULL == term->postings)
+    {
+        term->postings = decode_postings(index, term);
+    }
+    else
+    {
+        cache_unlink(index, term);
+        index->cache_postings -= term->df;
+    }
+    free(term->block);
+    term->block = NULL;
+    term->blocksize = 0;
+}
+
+/*
+ * Creates a new, empty index.
+ */
+index_t *index_create()
+{
+    index_t *index = calloc(1, sizeof(index_t));
+    if (index == NULL)
+    {
+        fatal_error(ERROR_MSG);
+    }
+    index->map = map_create(compare_strings, hash_string);
+    index->paths = map_create(compare_strings, hash_string);
+    index->store = docstore_create();
+    index->snippets = map_create(compare_strings, hash_string);
+    index->results = map_create(compare_strings, hash_string);
+    pthread_mutex_init(&index->cache_lock, NULL);
+    pthread_mutex_init(&index->results_lock, NULL);
+    return index;
+}
+
+/*
+ * Destroys the given index.  Subsequently accessing the index will
+ * lead to undefined behavior.
+ */
+void index_destroy(index_t *index)
+{
+    int i;
+
+    droptiers(index);
+    for (i = 0; i < index->numterms; i++)
+    {
+        term_t *term = index->terms[i];
+        if (NULL != term->postings)
+            free_postings(term->postings);
+        free(term->block);
+        free(term->word);
+        free(term);
+    }
+    for (i = 0; i < index->numdocs; i++)
+    {
+        for (int j = 0; j < index->docs[i]->numaliases; j++)
+            free(index->docs[i]->aliases[j]);
+        free(index->docs[i]->aliases);
+        free(index->docs[i]->terms);
+        free(index->docs[i]->path);
+        free(index->docs[i]);
+    }
+    map_destroy(index->map, NULL, NULL);
+    map_destroy(index->paths, NULL, NULL);
+    map_destroy(index->snippets, free, free);
+    map_destroy(index->results, free, (void (*)(void *))destroy_results);
+    docstore_destroy(index->store);
+    if (NULL != index->pool)
+        workpool_destroy(index->pool);
+    pthread_mutex_destroy(&index->cache_lock);
+    pthread_mutex_destroy(&index->results_lock);
+    free(index->terms);
+    free(index->docs);
+    free(index);
+}
+
+/*
+ * Prepares the given index to hold about 'docs' documents with about
+ * 'terms' distinct words in all, so that its dictionary and document
+ * tables do not need to grow while they are added.  The numbers are
+ * only hints; the index grows as usual past them.
+ */
+void index_reserve(index_t *index, int docs, int terms)
+{
+    map_reserve(index->map, terms);
+    map_reserve(index->paths, docs);
+    if (terms > index->maxterms)
+    {
+        index->maxterms = terms;
+        index->terms = realloc(index->terms, index->maxterms * sizeof(term_t *));
+        if (index->terms == NULL)
+        {
+            fatal_error(ERROR_MSG);
+        }
+    }
+    if (docs > index->maxdocs)
+    {
+        index->maxdocs = docs;
+        index->docs = realloc(index->docs, index->maxdocs * sizeof(document_t *));
+        if (index->docs == NULL)
+        {
+            fatal_error(ERROR_MSG);
+        }
+    }
+}
+
+/*
+ * Adds the given path to the given index, and index the given
+ * list of words under that path.
+ * NOTE: It is the responsibility of index_addpath() to deallocate (free)
+ *       'path' and the contents of the 'words' list.
+ */
+void index_addpath(index_t *index, char *path, list_t *words)
+{
+    // Save the size of the 'words' list before popping content of it.
+    int document_word_count = list_size(words);
+    document_t *doc = newdocument(index, path);
+    termvec_t *vec = &termvec;
+    int i, j;
+    PERF_START(start);
+
+    // Tiers are built over the complete index, and are outdated by new documents.
+    if (index->tiersize > 0)
+        droptiers(index);
+    if (0 != map_size(index->results))
+        clear_results(index);
+
+    // Popping content of the 'word' list such that the function comply with given instructions of deallocating content of it.
+    termvec_reserve(vec, document_word_count);
+    for (i = 0; 0 != list_size(words); i++)
+        vec->occurrences[i] = (occurrence_t){.word = list_popfirst(words), .pos = i};
+
+    // Sort the occurrences so that each distinct word forms a run.
+    qsort(vec->occurrences, document_word_count, sizeof(occurrence_t), compare_occurrence);
+
+    // The document and its forward index.
+    doc->terms = malloc((document_word_count ? document_word_count : 1) * sizeof(fwdentry_t));
+    PERF_COUNT(PERF_ALLOCATIONS, 1);
+    PERF_STOP(PERF_AGGREGATE, start);
+
+    for (i = 0; i < document_word_count; i = j)
+    {
+        char *current_word = vec->occurrences[i].word;
+        term_t *term, **slot;
+        PERF_START(lookup);
+
+        // Find or create the term for 'current_word', once per distinct word, in a single lookup.
+        slot = (term_t **)map_get_or_insert(index->map, current_word);
+        if (NULL != *slot)
+        {
+            term = *slot;
+            free(current_word);
+
+            // Compressed postings are expanded again to add 'doc' to them.
+            if (NULL != term->block)
+                expand_postings(index, term);
+        }
+        else
+        {
+            // The map now holds 'current_word', which becomes the word of the term.
+            term = newterm(index, current_word);
+            *slot = term;
+
+            PERF_COUNT(PERF_TERMS, 1);
+        }
+
+        // Record the position of every occurrence of the word, and free the duplicates.
+        vec->tokens[vec->occurrences[i].pos] = term->id;
+        for (j = i + 1; j < document_word_count && 0 == strcmp(vec->occurrences[j].word, term->word); j++)
+        {
+            vec->tokens[vec->occurrences[j].pos] = term->id;
+            free(vec->occurrences[j].word);
+        }
+
+        PERF_STOP(PERF_DICTIONARY, lookup);
+        PERF_START(insert);
+
+        // Add 'doc' to 'postings' and calculate term frequency.
+        posting_t *posting = malloc(sizeof(posting_t));
+        PERF_COUNT(PERF_ALLOCATIONS, 1);
+        *posting = (posting_t){.doc = doc, .tf = (double)(j - i) / document_word_count};
+        set_add(term->postings, posting);
+        term->df++;
+
+        PERF_COUNT(PERF_NUM_POSTINGS, 1);
+        PERF_STOP(PERF_POSTINGS, insert);
+
+        // Record the term in the forward index of 'doc'.
+        doc->terms[doc->numterms++] = (fwdentry_t){.termid = term->id, .tf = posting->tf};
+    }
+
+    // Shrink the forward index to fit, and sort it by term id for lookups.
+    PERF_START(store);
+    doc->terms = realloc(doc->terms, (doc->numterms ? doc->numterms : 1) * sizeof(fwdentry_t));
+    PERF_COUNT(PERF_ALLOCATIONS, 1);
+    qsort(doc->terms, doc->numterms, sizeof(fwdentry_t), compare_fwdentry);
+
+    // Keep the token stream of 'doc' for snippet generation.
+    docstore_add(index->store, vec->tokens, document_word_count);
+    PERF_STOP(PERF_DOCSTORE, store);
+    index->doc_count++;
+}
+
+/*
+ * Records 'path' as a document identical to the indexed document at
+ * 'canonical', without indexing its words again.  Queries matching the
+ * canonical document also return 'path', with the same score, and
+ * snippets of 'path' are those of the canonical document.  Returns 0,
+ * and frees 'path', if 'canonical' is not indexed or 'path' already is.
+ * NOTE: Like index_addpath(), index_addalias() takes ownership of 'path'.
+ */
+int index_addalias(index_t *index, char *path, char *canonical)
+{
+    document_t *doc = map_tryget(index->paths, canonical);
+    void **slot;
+
+    if (NULL == doc)
+    {
+        free(path);
+        return 0;
+    }
+    slot = map_get_or_insert(index->paths, path);
+    if (NULL != *slot)
+    {
+        free(path);
+        return 0;
+    }
+    *slot = doc;
+    doc->aliases = realloc(doc->aliases, (doc->numaliases + 1) * sizeof(char *));
+    if (doc->aliases == NULL)
+    {
+        fatal_error(ERROR_MSG);
+    }
+    doc->aliases[doc->numaliases++] = path;
+
+    if (0 != map_size(index->results))
+        clear_results(index);
+    return 1;
+}
+
+static qnode_t *newqnode(qop_t op, qnode_t *left, qnode_t *right)
+{
+    qnode_t *node = calloc(1, sizeof(qnode_t));
+    if (node == NULL)
+    {
+        fatal_error(ERROR_MSG);
+    }
+    node->op = op;
+    node->left = left;
+    node->right = right;
+    if (NULL != left && NULL != right)
+        node->cost = left->cost + right->cost;
+    node->size = -1;
+    return node;
+}
+
+static void destroy_qnode(qnode_t *node)
+{
+    if (NULL == node)
+        return;
+    destroy_qnode(node->left);
+    destroy_qnode(node->right);
+    free(node);
+}
+
+/* Counts the operands of the chain of 'op' operators rooted at 'node' */
+static int chain_length(qnode_t *node, qop_t op)
+{
+    if (op != node->op)
+        return 1;
+    return chain_length(node->left, op) + chain_length(node->right, op);
+}
+
+/*
+ * Stores the operands of the chain of 'op' operators rooted at 'node'
+ * in 'operands', in query order, and the operators in 'ops'.
+ */
+static void chain_split(qnode_t *node, qop_t op, qnode_t **operands, int *numoperands,
+                        qnode_t **ops, int *numops)
+{
+    if (op != node->op)
+    {
+        operands[(*numoperands)++] = node;
+        return;
+    }
+    ops[(*numops)++] = node;
+    chain_split(node->left, op, operands, numoperands, ops, numops);
+    chain_split(node->right, op, operands, numoperands, ops, numops);
+}
+
+/* Joins operands[lo..hi) into a balanced tree, using the nodes in 'ops' */
+static qnode_t *chain_join(qnode_t **operands, int lo, int hi, qnode_t **ops, int *numops)
+{
+    qnode_t *node;
+    int mid = lo + (hi - lo) / 2;
+
+    if (1 == hi - lo)
+        return operands[lo];
+    node = ops[(*numops)++];
+    node->left = chain_join(operands, lo, mid, ops, numops);
+    node->right = chain_join(operands, mid, hi, ops, numops);
+    node->cost = node->left->cost + node->right->cost;
+    return node;
+}
+
+/*
+ * Rebalances the chains of AND and OR operators of the given tree.  The
+ * parser builds "a OR b OR c OR d" as a chain, a OR (b OR (c OR d)),
+ * whose merges must run one after the other.  As AND and OR are
+ * associative, the chain can be evaluated as (a OR b) OR (c OR d)
+ * instead, which merges fewer elements in total and whose operands are
+ * independent.  Operands keep their order, so the query terms do too.
+ */
+static qnode_t *balance(qnode_t *node)
+{
+    qnode_t **operands, **ops, *retval;
+    int i, n, numoperands = 0, numops = 0;
+
+    if (QOP_TERM == node->op)
+        return node;
+    if (QOP_ANDNOT == node->op)
+    {
+        node->left = balance(node->left);
+        node->right = balance(node->right);
+        node->cost = node->left->cost + node->right->cost;
+        return node;
+    }
+
+    n = chain_length(node, node->op);
+    operands = malloc(n * sizeof(qnode_t *));
+    ops = malloc((n - 1) * sizeof(qnode_t *));
+    if (NULL == operands || NULL == ops)
+    {
+        fatal_error(ERROR_MSG);
+    }
+    chain_split(node, node->op, operands, &numoperands, ops, &numops);
+    for (i = 0; i < numoperands; i++)
+        operands[i] = balance(operands[i]);
+
+    numops = 0;
+    retval = chain_join(operands, 0, numoperands, ops, &numops);
+    free(operands);
+    free(ops);
+    return retval;
+}
+
+/*
+ * Adds the terms of the given subtree that contribute to the score to
+ * the query terms, in the order they occur in the query.
+ */
+static void collect_qterms(qctx_t *ctx, qnode_t *node)
+{
+    if (QOP_TERM != node->op)
+    {
+        collect_qterms(ctx, node->left);
+        collect_qterms(ctx, node->right);
+    }
+    // Terms on the right hand side of ANDNOT do not contribute to the score.
+    else if (NULL != node->term && 0 == node->negated &&
+             0 == list_contains(ctx->qterms, node->term))
+    {
+        list_addlast(ctx->qterms, node->term);
+    }
+}
+
+/*
+ * Returns the canonical form of the given subtree, such as
+ * "AND(a,OR(b,!c))", where '!' marks negated terms.
+ */
+static char *qnode_form(qnode_t *node)
+{
+    char *left, *right, *retval;
+
+    if (QOP_TERM == node->op)
+        return concatenate_strings(2, node->negated ? "!" : "", node->word);
+
+    left = qnode_form(node->left);
+    right = qnode_form(node->right);
+    retval = concatenate_strings(6, qop_names[node->op], "(", left, ",", right, ")");
+    free(left);
+    free(right);
+    return retval;
+}
+
+/*
+ * Returns the key under which the result of the given subtree is shared
+ * within a batch.  Results differ between tiers, so the tier is part of
+ * the key.
+ */
+static char *qnode_key(qctx_t *ctx, qnode_t *node)
+{
+    char *form = qnode_form(node), *retval;
+
+    retval = concatenate_strings(2, 1 == ctx->tier ? "1:" : "2:", form);
+    free(form);
+    return retval;
+}
+
+/*
+ * Returns nonzero, and records the exceeded limit, if the query has
+ * exceeded its budget.
+ */
+static int check_budget(qctx_t *ctx)
+{
+    const index_budget_t *budget = ctx->budget;
+
+    if (NULL != ctx->exceeded)
+        return 1;
+    if (budget->postings > 0 && ctx->postings > budget->postings)
+        ctx->exceeded = "postings";
+    else if (budget->nodes > 0 && ctx->nodes > budget->nodes)
+        ctx->exceeded = "nodes";
+    else if (budget->seconds > 0 && perf_now() > ctx->deadline)
+        ctx->exceeded = "time";
+    return NULL != ctx->exceeded;
+}
+
+/*
+ * Cancellation function of the set operations of a query with a budget.
+ */
+static int budget_cancel(void *arg, long visited)
+{
+    qctx_t *ctx = arg;
+    int retval;
+
+    pthread_mutex_lock(&ctx->lock);
+    ctx->postings += visited;
+    retval = check_budget(ctx);
+    pthread_mutex_unlock(&ctx->lock);
+    return retval;
+}
+
+/*
+ * A subtree evaluated by the work pool.
+ */
+typedef struct subtree
+{
+    workpool_task_t task;
+    qctx_t *ctx;
+    qnode_t *node;
+    set_t *result;
+} subtree_t;
+
+static set_t *evaluate(qctx_t *ctx, qnode_t *node);
+
+static void evaluate_subtree(void *arg)
+{
+    subtree_t *subtree = arg;
+    subtree->result = evaluate(subtree->ctx, subtree->node);
+}
+
+/*
+ * A range of documents of a merge run by the work pool.
+ */
+typedef struct mergerange
+{
+    workpool_task_t task;
+    qctx_t *ctx;
+    qop_t op;
+    set_t *a;
+    set_t *b;
+    void *lo;       /* First posting of the range, or NULL */
+    void *hi;       /* Posting following the range, or NULL */
+    set_t *result;
+} mergerange_t;
+
+static void merge_range(void *arg)
+{
+    mergerange_t *range = arg;
+    qctx_t *ctx = range->ctx;
+
+    range->result = qop_ranges[range->op](range->a, range->b, range->lo, range->hi,
+                                          NULL != ctx->budget ? budget_cancel : NULL, ctx);
+}
+
+/*
+ * Merges the operands of the given operator on the work pool.  Postings
+ * are ordered by document id, so the merge is split into ranges of
+ * document ids, bounded by postings of the larger operand.  The ranges
+ * are merged in parallel, and their results joined in order.
+ */
+static set_t *merge_parallel(qctx_t *ctx, qop_t op, set_t *a, set_t *b)
+{
+    workpool_t *pool = ctx->index->pool;
+    mergerange_t ranges[MERGE_RANGES];
+    void *pivots[MERGE_RANGES - 1];
+    set_t *parts[MERGE_RANGES];
+    int i, n, cancelled = 0;
+
+    n = workpool_size(pool);
+    if (n > MERGE_RANGES)
+        n = MERGE_RANGES;
+    n = set_pivots(set_size(a) >= set_size(b) ? a : b, pivots, n - 1) + 1;
+
+    for (i = 0; i < n; i++)
+    {
+        ranges[i].ctx = ctx;
+        ranges[i].op = op;
+        ranges[i].a = a;
+        ranges[i].b = b;
+        ranges[i].lo = i > 0 ? pivots[i - 1] : NULL;
+        ranges[i].hi = i < n - 1 ? pivots[i] : NULL;
+    }
+    for (i = 1; i < n; i++)
+        workpool_submit(pool, &ranges[i].task, merge_range, &ranges[i]);
+    merge_range(&ranges[0]);
+    for (i = 1; i < n; i++)
+        workpool_wait(pool, &ranges[i].task);
+
+    for (i = 0; i < n; i++)
+    {
+        parts[i] = ranges[i].result;
+        if (NULL == parts[i])
+            cancelled = 1;
+    }
+    if (cancelled)
+    {
+        for (i = 0; i < n; i++)
+        {
+            if (NULL != parts[i])
+                set_destroy(parts[i]);
+        }
+        return NULL;
+    }
+    return set_concat(parts, n);
+}
+
+/*
+ * Evaluates the given query tree against the tier selected in 'ctx'.
+ * Sets created while evaluating, and the decoded postings used, are
+ * recorded in 'ctx' and must be released with release_temps() when no
+ * longer needed.  If the index has a work pool, the operands of
+ * operators with enough postings are evaluated in parallel, and large
+ * merges are split into ranges merged in parallel.
+ */
+static set_t *evaluate(qctx_t *ctx, qnode_t *node)
+{
+    set_t *retval = NULL, *term1, *term2;
+    double start = ctx->explain ? perf_now() : 0;
+    char *key = NULL;
+    workpool_t *pool = ctx->index->pool;
+    subtree_t left;
+
+    node->nodes = 0;
+    pthread_mutex_lock(&ctx->lock);
+    if (NULL != ctx->exceeded)
+    {
+        pthread_mutex_unlock(&ctx->lock);
+        return NULL;
+    }
+    if (QOP_TERM != node->op && NULL != ctx->shared)
+    {
+        // Another query of the batch may have evaluated this subtree already.
+        key = qnode_key(ctx, node);
+        retval = map_tryget(ctx->shared->sets, key);
+        if (NULL != retval)
+        {
+            pthread_mutex_unlock(&ctx->lock);
+            free(key);
+            return retval;
+        }
+    }
+    pthread_mutex_unlock(&ctx->lock);
+
+    if (QOP_TERM == node->op)
+    {
+        if (NULL != node->term)
+        {
+            // The first tier may only be used where dropping postings can only drop results.
+            if (1 == ctx->tier && 0 == node->negated && NULL != node->term->tier1)
+            {
+                retval = node->term->tier1;
+            }
+            else
+            {
+                // Compressed postings are decoded on first use, and kept
+                // until the results that may refer to them are released.
+                retval = acquire_postings(ctx->index, node->term);
+                pthread_mutex_lock(&ctx->lock);
+                list_addlast(NULL != ctx->shared ? ctx->shared->pins : ctx->pins, node->term);
+                pthread_mutex_unlock(&ctx->lock);
+            }
+        }
+    }
+    else
+    {
+        // Operands are independent until they are merged, so large ones
+        // may be evaluated in parallel.
+        if (NULL != pool && QOP_TERM != node->left->op && QOP_TERM != node->right->op &&
+            node->cost >= ctx->index->parallel_threshold)
+        {
+            left.ctx = ctx;
+            left.node = node->left;
+            workpool_submit(pool, &left.task, evaluate_subtree, &left);
+            term2 = evaluate(ctx, node->right);
+            workpool_wait(pool, &left.task);
+            term1 = left.result;
+        }
+        else
+        {
+            term1 = evaluate(ctx, node->left);
+            term2 = evaluate(ctx, node->right);
+        }
+
+        if (NULL != term1 && NULL != term2)
+        {
+            if (NULL != pool && set_size(term1) + set_size(term2) >= ctx->index->parallel_threshold)
+                retval = merge_parallel(ctx, node->op, term1, term2);
+            else
+                retval = qop_sets[node->op](term1, term2, NULL != ctx->budget ? budget_cancel : NULL, ctx);
+        }
+
+        pthread_mutex_lock(&ctx->lock);
+        if (NULL != retval)
+        {
+            if (NULL != key)
+            {
+                map_put(ctx->shared->sets, key, retval);
+                list_addlast(ctx->shared->keys, key);
+                list_addlast(ctx->shared->temps, retval);
+            }
+            else
+            {
+                list_addlast(ctx->temps, retval);
+            }
+
+            // Set operations build their result from one new node per element.
+            node->nodes = set_size(retval);
+            ctx->nodes += node->nodes;
+            if (NULL != ctx->budget && check_budget(ctx))
+                retval = NULL;
+        }
+        else
+        {
+            free(key);
+        }
+        pthread_mutex_unlock(&ctx->lock);
+    }
+
+    if (ctx->explain)
+    {
+        node->size = NULL != retval ? set_size(retval) : -1;
+        node->time = perf_now() - start;
+    }
+    return retval;
+}
+
+static void release_temps(qctx_t *ctx)
+{
+    while (0 != list_size(ctx->temps))
+        set_destroy(list_popfirst(ctx->temps));
+    while (0 != list_size(ctx->pins))
+        release_postings(ctx->index, list_popfirst(ctx->pins));
+}
+
+/*
+ * Writes the profiled query tree as an indented list of operators.
+ */
+static void explain_qnode(FILE *f, qnode_t *node, int depth)
+{
+    fprintf(f, "%*s%s", depth * 2, "", qop_names[node->op]);
+    if (QOP_TERM == node->op)
+        fprintf(f, " \"%s\"%s", node->word, NULL == node->term ? " (not indexed)" : "");
+    else
+        fprintf(f, " in=[%d, %d]", node->left->size, node->right->size);
+    fprintf(f, " out=%d time=%.3fms nodes=%ld\n", node->size, node->time * 1000, node->nodes);
+
+    if (QOP_TERM != node->op)
+    {
+        explain_qnode(f, node->left, depth + 1);
+        explain_qnode(f, node->right, depth + 1);
+    }
+}
+
+/*
+ * Scores each document in 'set' by the summed tf-idf of the query terms
+ * it contains, and returns the results ordered by descending score.
+ */
+static list_t *score_results(qctx_t *ctx, set_t *set)
+{
+    set_iter_t *set_iter = set_createiter(set);
+    list_t *retval = list_create(compare_query);
+    list_iter_t *list_iter;
+
+    while (1 == set_hasnext(set_iter))
+    {
+        document_t *doc = ((posting_t *)set_next(set_iter))->doc;
+        double score = 0;
+
+        list_iter = list_createiter(ctx->qterms);
+        while (list_hasnext(list_iter))
+        {
+            term_t *term = list_next(list_iter);
+            score += document_tf(doc, term->id) * term_idf(ctx->index, term);
+        }
+        list_destroyiter(list_iter);
+        list_addfirst(retval, newresult(doc, score));
+
+        // Identical documents match and score alike.
+        for (int i = 0; i < doc->numaliases; i++)
+        {
+            query_result_t *result = newresult(doc, score);
+            result->path = doc->aliases[i];
+            list_addfirst(retval, result);
+        }
+    }
+    set_destroyiter(set_iter);
+    list_sort(retval);
+    return retval;
+}
+
+static void destroy_results(list_t *results)
+{
+    while (0 != list_size(results))
+        free(list_popfirst(results));
+    list_destroy(results);
+}
+
+static void set_noresults(char **errmsg)
+{
+    char *ptr = malloc(sizeof(char) * 100);
+    sprintf(ptr, "The query yielded zero results.");
+    *errmsg = ptr;
+}
+
+/*
+ * Returns an upper bound on the score of any document matching the
+ * query that is missing from its first tier result, i.e. that has at
+ * least one of its query term postings pruned.
+ */
+static double tier_bound(qctx_t *ctx)
+{
+    double bound = 0, maxsum = 0, mingap = HUGE_VAL;
+    list_iter_t *list_iter = list_createiter(ctx->qterms);
+
+    while (list_hasnext(list_iter))
+    {
+        term_t *term = list_next(list_iter);
+        double idf = term_idf(ctx->index, term);
+
+        // Without AND, every query term posting of a missing document was pruned.
+        bound += term->threshold * idf;
+        maxsum += term->maxtf * idf;
+        if (NULL != term->tier1 && (term->maxtf - term->threshold) * idf < mingap)
+            mingap = (term->maxtf - term->threshold) * idf;
+    }
+    list_destroyiter(list_iter);
+
+    // With AND, only a single posting of a missing document needs to have been
+    // pruned, which costs it at least the smallest gap among the pruned terms.
+    // If no term was pruned, the second tier is used.
+    if (ctx->conjunctive)
+        bound = HUGE_VAL == mingap ? HUGE_VAL : maxsum - mingap;
+    return bound;
+}
+
+/*
+ * Evaluates the parsed query against the given tier and scores the
+ * results, writing the profiled query tree to 'explain' if not NULL.
+ */
+static list_t *run_tier(qctx_t *ctx, qnode_t *root, int tier, FILE *explain)
+{
+    list_t *retval = NULL;
+    set_t *set;
+
+    while (0 != list_size(ctx->qterms))
+        list_popfirst(ctx->qterms);
+    collect_qterms(ctx, root);
+    ctx->tier = tier;
+
+    set = evaluate(ctx, root);
+    if (NULL != set && NULL != ctx->budget)
+    {
+        // Scoring visits each result once per query term.
+        ctx->postings += (long)set_size(set) * list_size(ctx->qterms);
+        if (check_budget(ctx))
+            set = NULL;
+    }
+    if (NULL != set)
+        retval = score_results(ctx, set);
+    release_temps(ctx);
+
+    if (NULL != explain)
+    {
+        if (ctx->index->tiersize > 0)
+            fprintf(explain, "tier %d:\n", tier);
+        explain_qnode(explain, root, ctx->index->tiersize > 0 ? 1 : 0);
+    }
+    return retval;
+}
+
+/*
+ * Evaluates the parsed query, returning at most 'k' results, or all
+ * results if 'k' is 0.  Top-k queries are answered from the first tier
+ * when it is guaranteed to contain the top 'k' results.
+ */
+static list_t *run_query(qctx_t *ctx, qnode_t *root, int k, FILE *explain)
+{
+    index_t *index = ctx->index;
+    qshared_t *shared = ctx->shared;
+    list_t *retval = NULL;
+    list_iter_t *list_iter;
+
+    if (k > 0 && index->tiersize > 0)
+    {
+        retval = run_tier(ctx, root, 1, explain);
+        if (NULL != retval && list_size(retval) >= k)
+        {
+            // Find the k'th best score of the first tier.
+            list_iter = list_createiter(retval);
+            query_result_t *kth = NULL;
+            for (int i = 0; i < k; i++)
+                kth = list_next(list_iter);
+            list_destroyiter(list_iter);
+
+            if (kth->score < tier_bound(ctx))
+            {
+                destroy_results(retval);
+                retval = NULL;
+            }
+        }
+        else if (NULL != retval)
+        {
+            destroy_results(retval);
+            retval = NULL;
+        }
+
+        // Batches count tier use per chunk, as chunks may run in parallel.
+        long *tier1 = NULL != shared ? &shared->tier1_queries : &index->tier1_queries;
+        long *tier2 = NULL != shared ? &shared->tier2_queries : &index->tier2_queries;
+        if (NULL != retval)
+            (*tier1)++;
+        else
+            (*tier2)++;
+    }
+
+    if (NULL == retval)
+        retval = run_tier(ctx, root, 2, explain);
+
+    while (NULL != retval && k > 0 && list_size(retval) > k)
+        free(list_poplast(retval));
+    return retval;
+}
+
+static list_t *copy_results(list_t *results)
+{
+    list_t *retval = list_create(compare_query);
+    list_iter_t *list_iter = list_createiter(results);
+
+    while (list_hasnext(list_iter))
+    {
+        query_result_t *result = malloc(sizeof(query_result_t));
+        if (NULL == result)
+        {
+            fatal_error(ERROR_MSG);
+        }
+        *result = *(query_result_t *)list_next(list_iter);
+        list_addlast(retval, result);
+    }
+    list_destroyiter(list_iter);
+    return retval;
+}
+
+/*
+ * Returns the key under which the results of the given query are
+ * cached.  Queries with the same normalized form share their results.
+ */
+static char *results_key(qnode_t *root, int k)
+{
+    char *form = qnode_form(root), prefix[16], *retval;
+
+    snprintf(prefix, sizeof(prefix), "%d:", k);
+    retval = concatenate_strings(2, prefix, form);
+    free(form);
+    return retval;
+}
+
+/*
+ * Returns a copy of the cached results under the given key, or NULL if
+ * the results are not cached.
+ */
+static list_t *cached_results(index_t *index, char *key)
+{
+    list_t *retval = NULL, *cached;
+
+    pthread_mutex_lock(&index->results_lock);
+    cached = map_tryget(index->results, key);
+    if (NULL != cached)
+    {
+        retval = copy_results(cached);
+        index->result_hits++;
+    }
+    else
+    {
+        index->result_misses++;
+    }
+    pthread_mutex_unlock(&index->results_lock);
+    return retval;
+}
+
+/*
+ * Caches a copy of the given results under the given key, which is
+ * owned by the cache afterwards.
+ */
+static void cache_results(index_t *index, char *key, list_t *results)
+{
+    pthread_mutex_lock(&index->results_lock);
+    if (NULL != map_tryget(index->results, key))
+    {
+        // Another query cached the same results meanwhile.
+        free(key);
+    }
+    else
+    {
+        // Start over with an empty cache when it is full.
+        if (map_size(index->results) >= index->maxresults)
+            clear_results(index);
+        map_put(index->results, key, copy_results(results));
+    }
+    pthread_mutex_unlock(&index->results_lock);
+}
+
+/*
+ * Parses and evaluates the given query, returning at most 'k' results,
+ * or all results if 'k' is 0.  This is the common execution path of
+ * all query functions; if 'explain' is not NULL, the profiled query
+ * tree of each evaluation is written to it.  Within a batch, queries
+ * that repeat an earlier query of the chunk copy its results; other
+ * queries copy the results cached by an earlier query, if the index
+ * caches results.
+ */
+static list_t *execute(index_t *index, list_t *query, int k, char **errmsg, FILE *explain,
+                       qshared_t *shared, const index_budget_t *budget)
+{
+    qctx_t ctx = {.index = index, .errmsg = errmsg, .explain = NULL != explain, .shared = shared,
+                  .budget = budget};
+    list_t *retval = NULL;
+    list_iter_t *list_iter;
+    qnode_t *root;
+    char *key;
+
+    ctx.tokens = list_create(compare_strings);
+    ctx.qterms = list_create(compare_pointers);
+    ctx.temps = list_create(compare_pointers);
+    ctx.pins = list_create(compare_pointers);
+    pthread_mutex_init(&ctx.lock, NULL);
+    if (NULL != budget)
+        ctx.deadline = perf_now() + budget->seconds;
+
+    // The parser consumes its input, so parse a copy of 'query'.
+    list_iter = list_createiter(query);
+    while (list_hasnext(list_iter))
+        list_addlast(ctx.tokens, list_next(list_iter));
+    list_destroyiter(list_iter);
+
+    next_token(&ctx);
+    root = parse_query(&ctx);
+    if (0 != strlen(ctx.current))
+        parse_error(&ctx, "Unexpected '%s'", ctx.current);
+    if (!ctx.failed)
+        root = balance(root);
+
+    if (ctx.failed)
+    {
+        // Explain the query tree as far as it was parsed.
+        if (NULL != explain)
+            explain_qnode(explain, root, 0);
+    }
+    else if (NULL != shared)
+    {
+        key = results_key(root, k);
+        retval = map_tryget(shared->results, key);
+        if (NULL != retval)
+        {
+            retval = copy_results(retval);
+            free(key);
+        }
+        else
+        {
+            retval = run_query(&ctx, root, k, explain);
+            if (NULL != retval)
+            {
+                map_put(shared->results, key, copy_results(retval));
+                list_addlast(shared->keys, key);
+            }
+            else
+            {
+                free(key);
+            }
+        }
+    }
+    else if (NULL == explain && index->maxresults > 0)
+    {
+        key = results_key(root, k);
+        retval = cached_results(index, key);
+        if (NULL == retval)
+        {
+            retval = run_query(&ctx, root, k, explain);
+            if (NULL != retval && NULL == ctx.exceeded)
+                cache_results(index, key, retval);
+            else
+                free(key);
+        }
+        else
+        {
+            free(key);
+        }
+    }
+    else
+    {
+        retval = run_query(&ctx, root, k, explain);
+    }
+
+    if (NULL != ctx.exceeded)
+    {
+        if (NULL != retval)
+            destroy_results(retval);
+        retval = NULL;
+        *errmsg = malloc(sizeof(char) * 100);
+        snprintf(*errmsg, 100, "The query exceeded its %s budget.", ctx.exceeded);
+    }
+    else if (NULL == retval && !ctx.failed)
+    {
+        set_noresults(errmsg);
+    }
+
+    pthread_mutex_destroy(&ctx.lock);
+    destroy_qnode(root);
+    list_destroy(ctx.tokens);
+    list_destroy(ctx.qterms);
+    list_destroy(ctx.temps);
+    list_destroy(ctx.pins);
+    return retval;
+}
+
+/*
+ * Performs the given query on the given index.  If the query
+ * succeeds, the return value will be a list of paths.  If there
+ * is an error (e.g. a syntax error in the query), an error message
+ * is assigned to the given errmsg pointer and the return value
+ * will be NULL.
+ */
+list_t *index_query(index_t *index, list_t *query, char **errmsg)
+{
+    return execute(index, query, 0, errmsg, NULL, NULL, NULL);
+}
+
+/*
+ * Performs the given query on the given index, and returns at most the
+ * 'k' best results.  If tiers have been built with index_buildtiers(),
+ * the query is first evaluated against the pruned first tier, and only
+ * evaluated against the full index if the first tier cannot guarantee
+ * the top 'k' results.
+ */
+list_t *index_query_topk(index_t *index, list_t *query, int k, char **errmsg)
+{
+    return execute(index, query, k, errmsg, NULL, NULL, NULL);
+}
+
+/*
+ * Evaluates the operands of large queries in parallel on 'threads'
+ * threads, if 'threads' is greater than 1.  Operands are evaluated in
+ * parallel if the terms of the operator have at least 'threshold'
+ * postings in total; below that, the overhead outweighs the gain.
+ */
+void index_setparallel(index_t *index, int threads, long threshold)
+{
+    if (NULL != index->pool)
+        workpool_destroy(index->pool);
+    index->pool = threads > 1 ? workpool_create(threads) : NULL;
+    index->parallel_threshold = threshold;
+}
+
+/*
+ * Caches the results of up to 'size' distinct queries, so that
+ * repeated queries are answered without evaluating them.  Queries are
+ * cached by their normalized form and number of results; explain
+ * queries and batches bypass the cache.  Adding documents empties the
+ * cache.  A size of 0 disables caching.
+ */
+void index_setresultcache(index_t *index, int size)
+{
+    pthread_mutex_lock(&index->results_lock);
+    clear_results(index);
+    index->maxresults = size;
+    pthread_mutex_unlock(&index->results_lock);
+}
+
+/*
+ * Decodes the postings of the given word into the posting cache of a
+ * compressed index, ahead of the queries that will use them.  Returns
+ * nonzero if the word is indexed.
+ */
+int index_prefetch(index_t *index, char *word)
+{
+    term_t *term = map_tryget(index->map, word);
+
+    if (NULL == term)
+        return 0;
+    acquire_postings(index, term);
+    release_postings(index, term);
+    return 1;
+}
+
+/*
+ * Performs the given query like index_query_topk(), or like index_query()
+ * if 'k' is 0, within the given budget.  Set operations check the budget
+ * as they go, so that a query is cancelled soon after it exceeds any
+ * limit.  A cancelled query returns NULL, and an error message naming
+ * the exceeded limit is assigned to the given errmsg pointer.
+ */
+list_t *index_query_budget(index_t *index, list_t *query, int k, const index_budget_t *budget,
+                           char **errmsg)
+{
+    return execute(index, query, k, errmsg, NULL, NULL, budget);
+}
+
+/*
+ * Performs the given query like index_query_topk(), or like index_query()
+ * if 'k' is 0, and assigns a description of the evaluated operator tree
+ * to the given explain pointer.  For each operator the description
+ * lists its input and output sizes, its time and the set nodes it
+ * allocated.  The caller must free the description.  The query is
+ * limited by the given budget like index_query_budget(), unless the
+ * budget is NULL.
+ */
+list_t *index_query_explain(index_t *index, list_t *query, int k, const index_budget_t *budget,
+                            char **errmsg, char **explain)
+{
+    size_t size;
+    FILE *f = open_memstream(explain, &size);
+    double start = perf_now();
+    list_t *retval;
+
+    if (NULL == f)
+    {
+        fatal_error(ERROR_MSG);
+    }
+    retval = execute(index, query, k, errmsg, f, NULL, budget);
+    fprintf(f, "total time=%.3fms results=%d\n", (perf_now() - start) * 1000,
+            NULL != retval ? list_size(retval) : 0);
+    fclose(f);
+    return retval;
+}
+
+/*
+ * A batch of queries, evaluated chunk by chunk by one or more threads.
+ */
+typedef struct batch
 {
-    map_t *map;
-    char *current;
-    double doc_count;
-};
+    index_t *index;
+    list_t **queries;
+    list_t **results;
+    char **errmsgs;
+    int *order;             /* Queries ordered by their text */
+    int n;
+    int k;
+    int next;               /* First query of the next chunk to evaluate */
+    pthread_mutex_t lock;
+} batch_t;
 
-set_t *parse_query(index_t *index, list_t *query, char **errmsg);
-set_t *parse_andterm(index_t *index, list_t *query, char **errmsg);
-set_t *parse_orterm(index_t *index, list_t *query, char **errmsg);
-set_t *parse_term(index_t *index, list_t *query, char **errmsg);
-set_t *parse_andnot(index_t *index, list_t *query, char **errmsg);
+typedef struct batch_order
+{
+    int query;
+    char *text;
+} batch_order_t;
 
-int compare_query_path(void *a, void *b)
+static int compare_batch_order(const void *a, const void *b)
 {
-    char *d1 = ((query_result_t *)a)->path;
-    char *d2 = ((query_result_t *)b)->path;
-    return compare_strings(d1, d2);
+    return strcmp(((batch_order_t *)a)->text, ((batch_order_t *)b)->text);
 }
 
-int compare_query(void *a, void *b)
+static void *batch_worker(void *arg)
 {
-    double d1 = ((query_result_t *)a)->score;
-    double d2 = ((query_result_t *)b)->score;
+    batch_t *batch = arg;
+    qshared_t shared;
+    int first, last, i;
+
+    while (1)
+    {
+        pthread_mutex_lock(&batch->lock);
+        first = batch->next;
+        batch->next += BATCH_CHUNK;
+        pthread_mutex_unlock(&batch->lock);
+        if (first >= batch->n)
+            break;
+        last = first + BATCH_CHUNK < batch->n ? first + BATCH_CHUNK : batch->n;
+
+        shared.terms = map_create(compare_strings, hash_string);
+        shared.sets = map_create(compare_strings, hash_string);
+        shared.results = map_create(compare_strings, hash_string);
+        shared.keys = list_create(compare_pointers);
+        shared.temps = list_create(compare_pointers);
+        shared.pins = list_create(compare_pointers);
+        shared.tier1_queries = 0;
+        shared.tier2_queries = 0;
+
+        for (i = first; i < last; i++)
+        {
+            int q = batch->order[i];
+            batch->errmsgs[q] = NULL;
+            batch->results[q] = execute(batch->index, batch->queries[q], batch->k,
+                                        &batch->errmsgs[q], NULL, &shared, NULL);
+        }
+
+        while (0 != list_size(shared.temps))
+            set_destroy(list_popfirst(shared.temps));
+        while (0 != list_size(shared.pins))
+            release_postings(batch->index, list_popfirst(shared.pins));
+        map_destroy(shared.terms, NULL, NULL);
+        map_destroy(shared.sets, NULL, NULL);
+        map_destroy(shared.results, NULL, (void (*)(void *))destroy_results);
+        while (0 != list_size(shared.keys))
+            free(list_popfirst(shared.keys));
+        list_destroy(shared.keys);
+        list_destroy(shared.temps);
+        list_destroy(shared.pins);
+
+        pthread_mutex_lock(&batch->lock);
+        batch->index->tier1_queries += shared.tier1_queries;
+        batch->index->tier2_queries += shared.tier2_queries;
+        pthread_mutex_unlock(&batch->lock);
+    }
+    return NULL;
+}
+
+/*
+ * Performs the 'n' given queries on the given index, like
+ * index_query_topk(), or like index_query() if 'k' is 0.  Returns an
+ * array of 'n' result lists; a failed query has a NULL result and an
+ * error message in the corresponding entry of 'errmsgs'.  Queries are
+ * evaluated in chunks that share term lookups and the results of
+ * common subexpressions, using up to 'threads' threads.
+ */
+list_t **index_query_batch(index_t *index, list_t **queries, int n, int k, int threads,
+                           char **errmsgs)
+{
+    batch_t batch = {.index = index, .queries = queries, .errmsgs = errmsgs, .n = n, .k = k};
+    pthread_t *workers;
+    batch_order_t *order;
+    list_iter_t *list_iter;
+    char *text;
+    int i;
+
+    batch.results = calloc(n > 0 ? n : 1, sizeof(list_t *));
+    batch.order = malloc((n > 0 ? n : 1) * sizeof(int));
+    order = malloc((n > 0 ? n : 1) * sizeof(batch_order_t));
+    if (NULL == batch.results || NULL == batch.order || NULL == order)
+    {
+        fatal_error(ERROR_MSG);
+    }
+    pthread_mutex_init(&batch.lock, NULL);
+
+    // Sort the queries by their text, so that repeated queries and queries
+    // with a common prefix fall in the same chunk.
+    for (i = 0; i < n; i++)
+    {
+        order[i].query = i;
+        order[i].text = strdup("");
+        list_iter = list_createiter(queries[i]);
+        while (list_hasnext(list_iter))
+        {
+            text = concatenate_strings(3, order[i].text, " ", list_next(list_iter));
+            free(order[i].text);
+            order[i].text = text;
+        }
+        list_destroyiter(list_iter);
+    }
+    qsort(order, n, sizeof(batch_order_t), compare_batch_order);
+    for (i = 0; i < n; i++)
+    {
+        batch.order[i] = order[i].query;
+        free(order[i].text);
+    }
+    free(order);
+
+    // There is no point in more threads than chunks.
+    if (threads > (n + BATCH_CHUNK - 1) / BATCH_CHUNK)
+        threads = (n + BATCH_CHUNK - 1) / BATCH_CHUNK;
+
+    if (threads <= 1)
+    {
+        batch_worker(&batch);
+    }
+    else
+    {
+        workers = malloc(threads * sizeof(pthread_t));
+        if (NULL == workers)
+        {
+            fatal_error(ERROR_MSG);
+        }
+        for (i = 0; i < threads; i++)
+        {
+            if (0 != pthread_create(&workers[i], NULL, batch_worker, &batch))
+                fatal_error("Unable to create batch thread");
+        }
+        for (i = 0; i < threads; i++)
+            pthread_join(workers[i], NULL);
+        free(workers);
+    }
+
+    pthread_mutex_destroy(&batch.lock);
+    free(batch.order);
+    return batch.results;
+}
+
+static int compare_posting_tf(const void *a, const void *b)
+{
+    double d1 = (*(posting_t **)a)->tf;
+    double d2 = (*(posting_t **)b)->tf;
     if (d1 > d2)
         return -1;
     if (d1 < d2)
@@ -34,157 +1938,589 @@ int compare_query(void *a, void *b)
 }
 
 /*
- * Creates a new, empty index.
+ * Compresses the postings of every term, and decodes them on demand
+ * when a query first uses them.  Decoded postings are cached, and the
+ * least recently used are freed once more than 'capacity' postings are
+ * decoded, so that memory tracks the working set of queried terms
+ * rather than the whole vocabulary.  Adding documents expands the
+ * postings of their terms again.
  */
-index_t *index_create()
+void index_compress(index_t *index, long capacity)
 {
-    index_t *index = calloc(1, sizeof(index_t));
-    if (index == NULL)
+    PERF_START(start);
+
+    pthread_mutex_lock(&index->cache_lock);
+    for (int i = 0; i < index->numterms; i++)
     {
-        fatal_error(ERROR_MSG);
+        term_t *term = index->terms[i];
+        if (NULL == term->block)
+            encode_postings(index, term);
     }
-    index->map = map_create(compare_strings, hash_string);
-    return index;
+    index->cache_capacity = capacity;
+    cache_evict(index);
+    pthread_mutex_unlock(&index->cache_lock);
+    PERF_STOP(PERF_COMPRESS, start);
 }
 
 /*
- * Destroys the given index.  Subsequently accessing the index will
- * lead to undefined behavior.
+ * Builds a pruned first tier of the index, keeping the 'tiersize'
+ * highest impact postings of each term.  A 'tiersize' of 0 drops the tiers.
  */
-void index_destroy(index_t *index)
+void index_buildtiers(index_t *index, int tiersize)
 {
-    //TODO: Potential bug here (may need specialized free functions)
-    map_destroy(index->map, free, (void *)set_destroy);
-    free(index);
+    posting_t **postings = NULL;
+    int maxpostings = 0;
+    PERF_START(start);
+
+    droptiers(index);
+    if (tiersize <= 0)
+        return;
+
+    for (int i = 0; i < index->numterms; i++)
+    {
+        term_t *term = index->terms[i];
+        int n = 0, size = term->df;
+        set_t *set = NULL != term->postings ? term->postings : decode_postings(index, term);
+        set_iter_t *iter;
+
+        if (size > maxpostings)
+        {
+            maxpostings = size;
+            postings = realloc(postings, maxpostings * sizeof(posting_t *));
+            if (postings == NULL)
+            {
+                fatal_error(ERROR_MSG);
+            }
+        }
+        iter = set_createiter(set);
+        while (set_hasnext(iter))
+            postings[n++] = set_next(iter);
+        set_destroyiter(iter);
+
+        // The idf of a term is the same for all its postings, so impact is ordered by tf.
+        qsort(postings, n, sizeof(posting_t *), compare_posting_tf);
+        term->maxtf = postings[0]->tf;
+        if (n > tiersize)
+        {
+            // The tier keeps copies, as the full postings may be evicted from the cache.
+            term->threshold = postings[tiersize]->tf;
+            term->tier1 = set_create(compare_posting);
+            for (int j = 0; j < tiersize; j++)
+            {
+                posting_t *copy = malloc(sizeof(posting_t));
+                if (copy == NULL)
+                {
+                    fatal_error(ERROR_MSG);
+                }
+                *copy = *postings[j];
+                set_add(term->tier1, copy);
+            }
+        }
+        if (set != term->postings)
+            free_postings(set);
+    }
+    free(postings);
+    index->tiersize = tiersize;
+    PERF_STOP(PERF_TIERS, start);
 }
 
 /*
- * Adds the given path to the given index, and index the given
- * list of words under that path.
- * NOTE: It is the responsibility of index_addpath() to deallocate (free)
- *       'path' and the contents of the 'words' list.
+ * Min-heap of query results, used to keep the 'k' best results seen so far.
  */
-void index_addpath(index_t *index, char *path, list_t *words)
+static void heap_siftdown(query_result_t **heap, int size, int i)
 {
-    // Save the size of the 'words' list before popping content of it.
-    double document_word_count = list_size(words);
-    char *current_word;
+    for (;;)
+    {
+        int min = i, l = 2 * i + 1, r = 2 * i + 2;
+        if (l < size && heap[l]->score < heap[min]->score)
+            min = l;
+        if (r < size && heap[r]->score < heap[min]->score)
+            min = r;
+        if (min == i)
+            return;
+        query_result_t *tmp = heap[i];
+        heap[i] = heap[min];
+        heap[min] = tmp;
+        i = min;
+    }
+}
 
-#pragma region word_frequency
-    map_t *word_frequency = map_create(compare_strings, hash_string);
-    list_iter_t *list_iter = list_createiter(words);
-    while (list_hasnext(list_iter))
+static void heap_siftup(query_result_t **heap, int i)
+{
+    while (i > 0 && heap[(i - 1) / 2]->score > heap[i]->score)
+    {
+        query_result_t *tmp = heap[i];
+        heap[i] = heap[(i - 1) / 2];
+        heap[(i - 1) / 2] = tmp;
+        i = (i - 1) / 2;
+    }
+}
+
+/*
+ * Finds the documents most similar to the document with the given path.
+ * The 'MLT_TERMS' terms with the highest tf-idf weight in the document
+ * (among those shared with at least one other document) are run as a disjunction, and the 'k' best matches (excluding the
+ * document itself) are returned, ordered by descending score.
+ */
+list_t *index_morelikethis(index_t *index, char *path, int k, char **errmsg)
+{
+    document_t *doc;
+    fwdentry_t top[MLT_TERMS];
+    double *scores, weight[MLT_TERMS];
+    query_result_t **heap;
+    int i, j, numtop = 0, size = 0;
+    list_t *retval;
+
+    doc = map_tryget(index->paths, path);
+    if (NULL == doc)
+    {
+        char *ptr = malloc(sizeof(char) * 100);
+        snprintf(ptr, 100, "No such document: '%s'", path);
+        *errmsg = ptr;
+        return NULL;
+    }
+
+    // Select the highest weighted terms of 'doc' by insertion into the sorted 'top' array.
+    for (i = 0; i < doc->numterms; i++)
     {
-        char *current_word = list_next(list_iter);
-        if (1 == map_haskey(word_frequency, current_word))
+        term_t *term = index->terms[doc->terms[i].termid];
+        if (term->df < MLT_MINDF)
+            continue;
+        double w = doc->terms[i].tf * term_idf(index, term);
+        if (numtop == MLT_TERMS && w <= weight[numtop - 1])
+            continue;
+        j = (numtop < MLT_TERMS) ? numtop++ : numtop - 1;
+        for (; j > 0 && weight[j - 1] < w; j--)
         {
-            double *wf = map_get(word_frequency, current_word);
-            (*wf)++;
-            map_put(word_frequency, current_word, wf);
+            top[j] = top[j - 1];
+            weight[j] = weight[j - 1];
         }
-        else
+        top[j] = doc->terms[i];
+        weight[j] = w;
+    }
+
+    // Accumulate scores over the postings of the selected terms.
+    scores = calloc(index->numdocs, sizeof(double));
+    if (scores == NULL)
+    {
+        fatal_error(ERROR_MSG);
+    }
+    for (i = 0; i < numtop; i++)
+    {
+        term_t *term = index->terms[top[i].termid];
+        double idf = term_idf(index, term);
+        set_iter_t *iter = set_createiter(acquire_postings(index, term));
+        while (set_hasnext(iter))
         {
-            double *wf = malloc(sizeof(int));
-            *wf = 1;
-            map_put(word_frequency, current_word, wf);
+            posting_t *posting = set_next(iter);
+            scores[posting->doc->id] += weight[i] * posting->tf * idf;
         }
+        set_destroyiter(iter);
+        release_postings(index, term);
     }
-#pragma endregion word_frequency
 
-    while (0 != list_size(words))
+    // Keep the 'k' best scoring documents.
+    heap = malloc((k + 1) * sizeof(query_result_t *));
+    if (heap == NULL)
     {
-        // Popping content of the 'word' list such that the function comply with given instructions of deallocating content of it.
-        current_word = list_popfirst(words);
-
-        // 'Current_word' found in map.
-        if (1 == map_haskey(index->map, current_word))
+        fatal_error(ERROR_MSG);
+    }
+    for (i = 0; i < index->numdocs; i++)
+    {
+        if (i == doc->id || scores[i] <= 0)
+            continue;
+        if (size < k)
         {
-            // Find 'set'(s) containing 'current_word'.
-            set_t *set = map_get(index->map, current_word);
-
-            // 'set' does not contain 'path'.
-            //TODO: Use oldpath?
-            if (1 != set_contains(set, &(query_result_t){.path = path}))
-            {
-                // Add 'path' to 'set' and calculate term frequency.
-                query_result_t *query = malloc(sizeof(query_result_t));
-                *query = (query_result_t){.path = strdup(path), .score = *(double *)map_get(word_frequency, current_word) / document_word_count};
-                set_add(set, query);
-            }
+            heap[size] = newresult(index->docs[i], scores[i]);
+            heap_siftup(heap, size++);
         }
-        else
+        else if (k > 0 && scores[i] > heap[0]->score)
         {
-            // Add 'current_word' to 'map' and calculate term frequency.
-            query_result_t *query = malloc(sizeof(query_result_t));
-            set_t *set = set_create(compare_query_path);
-            *query = (query_result_t){.path = strdup(path), .score = *(double *)map_get(word_frequency, current_word) / document_word_count};
-            set_add(set, query);
-            map_put(index->map, current_word, set);
+            heap[0]->path = index->docs[i]->path;
+            heap[0]->score = scores[i];
+            heap_siftdown(heap, size, 0);
         }
     }
-    free(path);
-    index->doc_count++;
+
+    retval = list_create(compare_query);
+    for (i = 0; i < size; i++)
+        list_addlast(retval, heap[i]);
+    list_sort(retval);
+
+    free(heap);
+    free(scores);
+    return retval;
+}
+
+static int compare_ints(const void *a, const void *b)
+{
+    return *(int *)a - *(int *)b;
 }
 
 /*
- * Performs the given query on the given index.  If the query
- * succeeds, the return value will be a list of paths.  If there
- * is an error (e.g. a syntax error in the query), an error message
- * is assigned to the given errmsg pointer and the return value
- * will be NULL.
+ * Builds the snippet of 'doc' for the given sorted query term ids.
  */
-list_t *index_query(index_t *index, list_t *query, char **errmsg)
+static char *build_snippet(index_t *index, document_t *doc, int *qids, int numqids,
+                           const char *hl_open, const char *hl_close)
 {
-    // Parse 'query' and store result in 'set'
-    set_t *set = parse_query(index, query, errmsg);
-    list_t *retval = NULL;
+    int tokens[SNIPPET_SCAN];
+    int n, i, hits = 0, best = 0, start = 0, end;
+    size_t len = 0, size = 0;
+    char *snippet = NULL;
 
-    // Iterate through 'set' and structure the results in 'query_result_t' container which is added to the 'retval' list after calculating the tfidf score.
-    // query_result->score already contains term frequency from index_addpath.
-    if (NULL != set)
+    n = docstore_read(index->store, doc->id, tokens, SNIPPET_SCAN);
+
+    // Slide a window over the tokens, counting query term occurrences.
+    for (i = 0; i < n; i++)
     {
-        set_iter_t *set_iter = set_createiter(set);
-        retval = list_create(compare_query);
-        while (1 == set_hasnext(set_iter))
+        if (bsearch(&tokens[i], qids, numqids, sizeof(int), compare_ints))
+            hits++;
+        if (i >= SNIPPET_WORDS && bsearch(&tokens[i - SNIPPET_WORDS], qids, numqids, sizeof(int), compare_ints))
+            hits--;
+        if (hits > best)
         {
-            query_result_t *query_result = set_next(set_iter);
-            query_result->score *= (log(index->doc_count / ((double)set_size(set))));
-            list_addfirst(retval, query_result);
+            best = hits;
+            start = i < SNIPPET_WORDS ? 0 : i - SNIPPET_WORDS + 1;
         }
-        set_destroyiter(set_iter);
-        list_sort(retval);
+    }
+    end = start + SNIPPET_WORDS < n ? start + SNIPPET_WORDS : n;
+
+    // Measure, then render the window.
+    for (i = start; i < end; i++)
+        size += strlen(index->terms[tokens[i]]->word) + strlen(hl_open) + strlen(hl_close) + 1;
+    snippet = malloc(size + 8);
+    if (snippet == NULL)
+    {
+        fatal_error(ERROR_MSG);
+    }
+    snippet[0] = 0;
+    if (start > 0)
+        len += sprintf(snippet + len, "... ");
+    for (i = start; i < end; i++)
+    {
+        char *word = index->terms[tokens[i]]->word;
+        if (bsearch(&tokens[i], qids, numqids, sizeof(int), compare_ints))
+            len += sprintf(snippet + len, "%s%s%s", hl_open, word, hl_close);
+        else
+            len += sprintf(snippet + len, "%s", word);
+        if (i < end - 1)
+            snippet[len++] = ' ';
+    }
+    if (end < docstore_length(index->store, doc->id))
+        len += sprintf(snippet + len, " ...");
+    snippet[len] = 0;
+    return snippet;
+}
+
+/*
+ * Returns a short excerpt of the document with the given path, chosen to
+ * contain as many of the words in 'query' as possible, with each of them
+ * enclosed in 'hl_open' and 'hl_close'.  The excerpt is reconstructed from
+ * the document store, so the original file is not read.  Returns NULL if
+ * the path is not indexed.  The returned string must be freed by the caller.
+ */
+char *index_snippet(index_t *index, char *path, list_t *query,
+                    const char *hl_open, const char *hl_close)
+{
+    document_t *doc;
+    int *qids, numqids = 0;
+    char *key, *snippet;
+    size_t keylen;
+    list_iter_t *list_iter;
+
+    doc = map_tryget(index->paths, path);
+    if (NULL == doc)
+        return NULL;
+
+    qids = malloc((list_size(query) + 1) * sizeof(int));
+    if (qids == NULL)
+    {
+        fatal_error(ERROR_MSG);
+    }
+    list_iter = list_createiter(query);
+    while (list_hasnext(list_iter))
+    {
+        term_t *term = map_tryget(index->map, list_next(list_iter));
+        if (NULL != term)
+            qids[numqids++] = term->id;
+    }
+    list_destroyiter(list_iter);
+    qsort(qids, numqids, sizeof(int), compare_ints);
+
+    // Snippets are cached by document, query terms and highlighting.
+    keylen = 32 + 12 * numqids + strlen(hl_open) + strlen(hl_close);
+    key = malloc(keylen);
+    if (key == NULL)
+    {
+        fatal_error(ERROR_MSG);
+    }
+    size_t len = snprintf(key, keylen, "%d|%s|%s|", doc->id, hl_open, hl_close);
+    for (int i = 0; i < numqids; i++)
+        len += snprintf(key + len, keylen - len, "%d,", qids[i]);
+
+    snippet = map_tryget(index->snippets, key);
+    if (NULL != snippet)
+    {
+        free(key);
     }
     else
     {
-        char *ptr = malloc(sizeof(char) * 100);
-        sprintf(ptr, "The query yielded zero results.");
-        *errmsg = ptr;
+        if (index->numsnippets == SNIPPET_CACHE_SIZE)
+        {
+            // Start over with an empty cache when it is full.
+            map_destroy(index->snippets, free, free);
+            index->snippets = map_create(compare_strings, hash_string);
+            index->numsnippets = 0;
+        }
+        snippet = build_snippet(index, doc, qids, numqids, hl_open, hl_close);
+        map_put(index->snippets, key, snippet);
+        index->numsnippets++;
     }
-    return retval;
+    free(qids);
+    return strdup(snippet);
+}
+
+static int compare_ints_desc(const void *a, const void *b)
+{
+    return *(int *)b - *(int *)a;
+}
+
+static void usage_add(index_usage_t *usage, long count, size_t bytes)
+{
+    usage->count += count;
+    usage->bytes += bytes;
 }
 
 /*
-    query ::= andterm | andterm "ANDNOT" queryx1|
-*/
-set_t *parse_query(index_t *index, list_t *query, char **errmsg)
+ * Walks the given index and fills in 'stats' with the memory used by
+ * each of its structures, and the distribution of posting lengths.
+ */
+void index_stats(index_t *index, index_stats_t *stats)
 {
+    int i, *dfs;
+    long total_df = 0;
 
-    set_t *retval = NULL, *term1 = NULL, *term2 = NULL;
-    if (0 != list_size(query))
-        index->current = list_popfirst(query);
+    memset(stats, 0, sizeof(index_stats_t));
 
-    term1 = parse_andterm(index, query, errmsg);
+    dfs = malloc((index->numterms ? index->numterms : 1) * sizeof(int));
+    if (dfs == NULL)
+    {
+        fatal_error(ERROR_MSG);
+    }
 
-    if (0 == compare_strings(index->current, "ANDNOT") && list_size(query))
+    usage_add(&stats->terms, 0, index->maxterms * sizeof(term_t *));
+    // Decoded postings come and go with the queries.
+    pthread_mutex_lock(&index->cache_lock);
+    for (i = 0; i < index->numterms; i++)
     {
-        if (0 != list_size(query))
-            index->current = list_popfirst(query);
-        term2 = parse_query(index, query, errmsg);
+        term_t *term = index->terms[i];
+        int df = term->df, bucket = 0;
 
-        if (NULL != term1 && NULL != term2)
+        usage_add(&stats->terms, 1, sizeof(term_t));
+        usage_add(&stats->term_strings, 1, strlen(term->word) + 1);
+        if (NULL != term->postings)
         {
-            retval = set_difference(term1, term2);
+            usage_add(&stats->postings, df, df * sizeof(posting_t));
+            usage_add(&stats->posting_sets, df, set_bytes(term->postings));
         }
+        if (NULL != term->block)
+            usage_add(&stats->posting_blocks, df, term->blocksize);
+        if (NULL != term->tier1)
+            usage_add(&stats->tier_sets, set_size(term->tier1), set_bytes(term->tier1));
+
+        while (bucket < INDEX_STATS_BUCKETS - 1 && (2 << bucket) <= df)
+            bucket++;
+        stats->posting_histogram[bucket]++;
+        dfs[i] = df;
+        total_df += df;
+    }
+    stats->cache_capacity = index->cache_capacity;
+    stats->cache_postings = index->cache_postings;
+    stats->cache_hits = index->cache_hits;
+    stats->cache_misses = index->cache_misses;
+    stats->cache_evictions = index->cache_evictions;
+    pthread_mutex_unlock(&index->cache_lock);
+
+    pthread_mutex_lock(&index->results_lock);
+    usage_add(&stats->results, map_size(index->results), map_bytes(index->results));
+    stats->result_hits = index->result_hits;
+    stats->result_misses = index->result_misses;
+    pthread_mutex_unlock(&index->results_lock);
+    usage_add(&stats->term_map, map_size(index->map), map_bytes(index->map));
+    map_stats(index->map, &stats->term_map_layout);
+
+    usage_add(&stats->documents, 0, index->maxdocs * sizeof(document_t *));
+    for (i = 0; i < index->numdocs; i++)
+    {
+        document_t *doc = index->docs[i];
+
+        usage_add(&stats->documents, 1, sizeof(document_t) + doc->numaliases * sizeof(char *));
+        usage_add(&stats->paths, 1, strlen(doc->path) + 1);
+        for (int j = 0; j < doc->numaliases; j++)
+            usage_add(&stats->paths, 1, strlen(doc->aliases[j]) + 1);
+        usage_add(&stats->forward, doc->numterms, doc->numterms * sizeof(fwdentry_t));
+    }
+    usage_add(&stats->path_map, map_size(index->paths), map_bytes(index->paths));
+    usage_add(&stats->docstore, index->numdocs, docstore_bytes(index->store));
+    usage_add(&stats->snippets, map_size(index->snippets), map_bytes(index->snippets));
+
+    stats->total_bytes = stats->terms.bytes + stats->term_strings.bytes + stats->term_map.bytes +
+                         stats->postings.bytes + stats->posting_sets.bytes + stats->posting_blocks.bytes +
+                         stats->tier_sets.bytes +
+                         stats->documents.bytes + stats->paths.bytes + stats->path_map.bytes +
+                         stats->forward.bytes + stats->docstore.bytes + stats->snippets.bytes +
+                         stats->results.bytes;
+
+    if (index->numterms > 0)
+    {
+        qsort(dfs, index->numterms, sizeof(int), compare_ints_desc);
+        stats->df_mean = (double)total_df / index->numterms;
+        stats->df_max = dfs[0];
+        stats->df_p99 = dfs[index->numterms / 100];
+        stats->df_p90 = dfs[index->numterms / 10];
+        stats->df_median = dfs[index->numterms / 2];
+    }
+    free(dfs);
+}
+
+/*
+ * Writes the given index statistics to the given file, as a human
+ * readable table or, if 'json' is nonzero, as a JSON object.
+ */
+void index_printstats(FILE *f, index_stats_t *stats, int json)
+{
+    const char *names[] = {"terms", "term_strings", "term_map", "postings", "posting_sets", "posting_blocks",
+                           "tier_sets", "documents", "paths", "path_map", "forward", "docstore", "snippets",
+                           "results"};
+    index_usage_t *usages[] = {&stats->terms, &stats->term_strings, &stats->term_map, &stats->postings,
+                               &stats->posting_sets, &stats->posting_blocks, &stats->tier_sets,
+                               &stats->documents, &stats->paths, &stats->path_map, &stats->forward,
+                               &stats->docstore, &stats->snippets, &stats->results};
+    map_stats_t *layout = &stats->term_map_layout;
+    int i, n = sizeof(names) / sizeof(names[0]), last = 0;
+
+    for (i = 0; i < INDEX_STATS_BUCKETS; i++)
+        if (stats->posting_histogram[i])
+            last = i;
+
+    if (json)
+    {
+        fprintf(f, "{\"structures\": {");
+        for (i = 0; i < n; i++)
+            fprintf(f, "%s\"%s\": {\"count\": %ld, \"bytes\": %zu}", i ? ", " : "",
+                    names[i], usages[i]->count, usages[i]->bytes);
+        fprintf(f, "}, \"total_bytes\": %zu, \"posting_histogram\": [", stats->total_bytes);
+        for (i = 0; i <= last; i++)
+            fprintf(f, "%s%ld", i ? ", " : "", stats->posting_histogram[i]);
+        fprintf(f, "], \"df\": {\"mean\": %.2f, \"median\": %d, \"p90\": %d, \"p99\": %d, \"max\": %d}",
+                stats->df_mean, stats->df_median, stats->df_p90, stats->df_p99, stats->df_max);
+        fprintf(f, ", \"posting_cache\": {\"capacity\": %ld, \"postings\": %ld, \"hits\": %ld, "
+                   "\"misses\": %ld, \"evictions\": %ld}",
+                stats->cache_capacity, stats->cache_postings, stats->cache_hits, stats->cache_misses,
+                stats->cache_evictions);
+        fprintf(f, ", \"result_cache\": {\"hits\": %ld, \"misses\": %ld}",
+                stats->result_hits, stats->result_misses);
+        fprintf(f, ", \"term_map\": {\"capacity\": %d, \"load\": %.3f, \"mean_probe\": %.3f, \"max_probe\": %d}}\n",
+                layout->capacity, layout->load, layout->mean_probe, layout->max_probe);
+        return;
+    }
+
+    fprintf(f, "Index memory:\n");
+    fprintf(f, "  %-14s %12s %14s\n", "structure", "count", "bytes");
+    for (i = 0; i < n; i++)
+        fprintf(f, "  %-14s %12ld %14zu\n", names[i], usages[i]->count, usages[i]->bytes);
+    fprintf(f, "  %-14s %12s %14zu\n", "total", "", stats->total_bytes);
+    fprintf(f, "Posting lengths:\n");
+    for (i = 0; i <= last; i++)
+    {
+        char range[48];
+        snprintf(range, sizeof(range), "[%ld, %ld)", 1L << i, 2L << i);
+        fprintf(f, "  %-14s %12ld\n", range, stats->posting_histogram[i]);
+    }
+    fprintf(f, "Document frequency: mean %.2f, median %d, p90 %d, p99 %d, max %d\n",
+            stats->df_mean, stats->df_median, stats->df_p90, stats->df_p99, stats->df_max);
+    fprintf(f, "Term map: %d buckets, load %.2f, mean probe %.2f, max probe %d\n",
+            layout->capacity, layout->load, layout->mean_probe, layout->max_probe);
+    if (stats->cache_capacity > 0)
+        fprintf(f, "Posting cache: %ld of %ld postings, %ld hits, %ld misses, %ld evictions\n",
+                stats->cache_postings, stats->cache_capacity, stats->cache_hits, stats->cache_misses,
+                stats->cache_evictions);
+    if (stats->result_hits + stats->result_misses > 0)
+        fprintf(f, "Result cache: %ld queries, %ld hits, %ld misses\n",
+                stats->results.count, stats->result_hits, stats->result_misses);
+}
+
+/*
+ * Moves to the next token of the query, or to the empty string at its end.
+ */
+static void next_token(qctx_t *ctx)
+{
+    if (0 != list_size(ctx->tokens))
+        ctx->current = list_popfirst(ctx->tokens);
+    else
+        ctx->current = "";
+}
+
+/*
+ * Assigns an error message to the query, keeping the first if there
+ * are several.
+ */
+static void parse_error(qctx_t *ctx, const char *fmt, const char *token)
+{
+    char *ptr;
+
+    if (ctx->failed)
+        return;
+    ptr = malloc(sizeof(char) * 256);
+    snprintf(ptr, 256, fmt, token);
+    *ctx->errmsg = ptr;
+    ctx->failed = 1;
+}
+
+/*
+ * Returns the term of the given word, or NULL if it is not indexed.
+ * Within a batch, each distinct word is looked up once.
+ */
+static term_t *lookup_term(qctx_t *ctx, char *word)
+{
+    term_t *term = NULL;
+
+    if (NULL != ctx->shared)
+    {
+        term = map_tryget(ctx->shared->terms, word);
+        if (NULL != term)
+            return &unknown_term == term ? NULL : term;
+    }
+
+    term = map_tryget(ctx->index->map, word);
+
+    if (NULL != ctx->shared)
+    {
+        word = strdup(word);
+        map_put(ctx->shared->terms, word, NULL != term ? term : &unknown_term);
+        list_addlast(ctx->shared->keys, word);
+    }
+    return term;
+}
+
+/*
+    query ::= andterm | andterm "ANDNOT" query
+*/
+static qnode_t *parse_query(qctx_t *ctx)
+{
+    qnode_t *retval = NULL, *term1 = NULL, *term2 = NULL;
+
+    term1 = parse_andterm(ctx);
+
+    if (0 == compare_strings(ctx->current, "ANDNOT"))
+    {
+        next_token(ctx);
+        // Terms on the right hand side of ANDNOT do not contribute to the score.
+        ctx->negated++;
+        term2 = parse_query(ctx);
+        ctx->negated--;
+
+        retval = newqnode(QOP_ANDNOT, term1, term2);
     }
     else
     {
@@ -196,21 +2532,19 @@ set_t *parse_query(index_t *index, list_t *query, char **errmsg)
 /*
     andterm ::= orterm | orterm "AND" andterm
 */
-set_t *parse_andterm(index_t *index, list_t *query, char **errmsg)
+static qnode_t *parse_andterm(qctx_t *ctx)
 {
-    set_t *retval = NULL, *term1 = NULL, *term2 = NULL;
-    term1 = parse_orterm(index, query, errmsg);
+    qnode_t *retval = NULL, *term1 = NULL, *term2 = NULL;
+    term1 = parse_orterm(ctx);
 
-    if (0 == compare_strings(index->current, "AND") && list_size(query))
+    if (0 == compare_strings(ctx->current, "AND"))
     {
-        if (0 != list_size(query))
-            index->current = list_popfirst(query);
-        term2 = parse_andterm(index, query, errmsg);
+        next_token(ctx);
+        if (0 == ctx->negated)
+            ctx->conjunctive = 1;
+        term2 = parse_andterm(ctx);
 
-        if (NULL != term1 && NULL != term2)
-        {
-            retval = set_intersection(term1, term2);
-        }
+        retval = newqnode(QOP_AND, term1, term2);
     }
     else
     {
@@ -222,21 +2556,17 @@ set_t *parse_andterm(index_t *index, list_t *query, char **errmsg)
 /*
     orterm ::= term | term "OR" orterm
 */
-set_t *parse_orterm(index_t *index, list_t *query, char **errmsg)
+static qnode_t *parse_orterm(qctx_t *ctx)
 {
-    set_t *retval = NULL, *term1 = NULL, *term2 = NULL;
-    term1 = parse_term(index, query, errmsg);
+    qnode_t *retval = NULL, *term1 = NULL, *term2 = NULL;
+    term1 = parse_term(ctx);
 
-    if (0 == compare_strings(index->current, "OR") && list_size(query))
+    if (0 == compare_strings(ctx->current, "OR"))
     {
-        if (0 != list_size(query))
-            index->current = list_popfirst(query);
-        term2 = parse_orterm(index, query, errmsg);
+        next_token(ctx);
+        term2 = parse_orterm(ctx);
 
-        if (NULL != term1 && NULL != term2)
-        {
-            retval = set_union(term1, term2);
-        }
+        retval = newqnode(QOP_OR, term1, term2);
     }
     else
     {
@@ -248,43 +2578,32 @@ set_t *parse_orterm(index_t *index, list_t *query, char **errmsg)
 /*
     term ::= "("query")"| <word>
 */
-set_t *parse_term(index_t *index, list_t *query, char **errmsg)
+static qnode_t *parse_term(qctx_t *ctx)
 {
-    set_t *retval = NULL;
+    qnode_t *retval = NULL;
 
-    if (0 == compare_strings(index->current, "("))
+    if (0 == compare_strings(ctx->current, "("))
     {
-        retval = parse_query(index, query, errmsg);
-        // Pop ')' from 'query' into 'index->current'
-        if (0 != list_size(query))
-            index->current = list_popfirst(query);
-        if (0 != compare_strings(index->current, ")"))
-        {
-            char *ptr = malloc(sizeof(char) * 100);
-            sprintf(ptr, "Internal error: "
-                         "expected ')' found '%s'"
-                         "from function '%s' in file '%s' line number '%d'",
-                    strdup(index->current), __func__, __FILE__, __LINE__);
-            *errmsg = ptr;
-        }
+        next_token(ctx);
+        retval = parse_query(ctx);
+        if (0 != compare_strings(ctx->current, ")"))
+            parse_error(ctx, "Expected ')' but found '%s'", ctx->current);
+        next_token(ctx);
     }
-    //
     else
     {
-        // 'current' found in map, get results from 'map' and store it in 'retval'
-        if (1 == map_haskey(index->map, index->current))
-        {
-            retval = map_get(index->map, index->current);
-        }
+        retval = newqnode(QOP_TERM, NULL, NULL);
+        retval->word = ctx->current;
+        retval->negated = ctx->negated;
+
+        // 'current' found in map, the term is evaluated to its postings
+        if (0 == strlen(ctx->current))
+            parse_error(ctx, "Unexpected end of query%s", "");
+        else if (NULL == (retval->term = lookup_term(ctx, ctx->current)))
+            parse_error(ctx, "Term '%s' not found", ctx->current);
         else
-        {
-            char *ptr = malloc(sizeof(char) * 100);
-            sprintf(ptr, "Internal error: "
-                         "expected ')' found '%s'"
-                         "from function '%s' in file '%s' line number '%d'",
-                    strdup(index->current), __func__, __FILE__, __LINE__);
-            *errmsg = ptr;
-        }
+            retval->cost = retval->term->df;
+        next_token(ctx);
     }
     return retval;
 }
@@ -20,6 +20,67 @@ typedef struct query_result
 	double score; /* Document to query score */
 } query_result_t;
 
+/*
+ * Number of buckets in the posting length histogram of 'index_stats_t'.
+ */
+#define INDEX_STATS_BUCKETS 32
+
+/*
+ * Number of objects of some kind in an index, and the bytes they use.
+ * Bytes are payload sizes, excluding allocator overhead.
+ */
+typedef struct index_usage
+{
+    long count;
+    size_t bytes;
+} index_usage_t;
+
+/*
+ * Memory footprint of an index, broken down by structure.
+ */
+typedef struct index_stats
+{
+    index_usage_t terms;          /* Term records */
+    index_usage_t term_strings;   /* Term strings */
+    index_usage_t term_map;       /* Term dictionary hash map */
+    index_usage_t postings;       /* Posting records */
+    index_usage_t posting_sets;   /* Posting set tree nodes */
+    index_usage_t posting_blocks; /* Compressed postings */
+    index_usage_t tier_sets;      /* First tier posting set tree nodes */
+    index_usage_t documents;      /* Document records */
+    index_usage_t paths;          /* Document path strings */
+    index_usage_t path_map;       /* Path to document hash map */
+    index_usage_t forward;        /* Forward index entries */
+    index_usage_t docstore;       /* Compressed document store */
+    index_usage_t snippets;       /* Snippet cache hash map */
+    index_usage_t results;        /* Result cache hash map */
+    size_t total_bytes;
+
+    /* Number of terms whose posting length lies in [2^i, 2^(i+1)) */
+    long posting_histogram[INDEX_STATS_BUCKETS];
+
+    /* Document frequency distribution over all terms */
+    double df_mean;
+    int df_median;
+    int df_p90;
+    int df_p99;
+    int df_max;
+
+    /* Decoded postings cache of a compressed index */
+    long cache_capacity;          /* Decoded postings kept, or 0 if not compressed */
+    long cache_postings;          /* Decoded postings currently cached */
+    long cache_hits;
+    long cache_misses;
+    long cache_evictions;
+
+    /* Result cache lookups */
+    long result_hits;
+    long result_misses;
+
+    /* Layout of the term dictionary hash map */
+    map_stats_t term_map_layout;
+} index_stats_t;
+
 /*
  * Creates a new, empty index.
  */
@@ -31,6 +92,14 @@ index_t *index_create();
  */
 void index_destroy(index_t *index);
 
+/*
+ * Prepares the given index to hold about 'docs' documents with about
+ * 'terms' distinct words in all, so that its dictionary and document
+ * tables do not need to grow while they are added.  The numbers are
+ * only hints; the index grows as usual past them.
+ */
+void index_reserve(index_t *index, int docs, int terms);
+
 /*
  * Adds the given path to the given index, and index the given
  * list of words under that path.
@@ -39,6 +108,16 @@ void index_destroy(index_t *index);
  */
 void index_addpath(index_t *index, char *path, list_t *words);
 
+/*
+ * Records 'path' as a document identical to the indexed document at
+ * 'canonical', without indexing its words again.  Queries matching the
+ * canonical document also return 'path', with the same score, and
+ * snippets of 'path' are those of the canonical document.  Returns 0,
+ * and frees 'path', if 'canonical' is not indexed or 'path' already is.
+ * NOTE: Like index_addpath(), index_addalias() takes ownership of 'path'.
+ */
+int index_addalias(index_t *index, char *path, char *canonical);
+
 /*
  * Performs the given query on the given index.  If the query
  * succeeds, the return value will be a list of paths.  If there
@@ -48,4 +127,136 @@ void index_addpath(index_t *index, char *path, list_t *words);
  */
 list_t *index_query(index_t *index, list_t *query, char **errmsg);
 
+/*
+ * Performs the given query on the given index like index_query(), but
+ * returns at most the 'k' best results.  If tiers have been built with
+ * index_buildtiers(), the query is answered from the pruned first tier
+ * whenever that tier is guaranteed to contain the top 'k' results.
+ */
+list_t *index_query_topk(index_t *index, list_t *query, int k, char **errmsg);
+
+/*
+ * Evaluates the operands of large queries in parallel on 'threads'
+ * threads, if 'threads' is greater than 1.  Operands are evaluated in
+ * parallel if the terms of the operator have at least 'threshold'
+ * postings in total; below that, the overhead outweighs the gain.
+ * Likewise, a merge of operands with at least 'threshold' documents in
+ * total, such as "a OR b" over two large posting lists, is split into
+ * ranges of documents merged in parallel.
+ */
+void index_setparallel(index_t *index, int threads, long threshold);
+
+/*
+ * Caches the results of up to 'size' distinct queries, so that
+ * repeated queries are answered without evaluating them.  Queries are
+ * cached by their normalized form and number of results; explain
+ * queries and batches bypass the cache.  Adding documents empties the
+ * cache.  A size of 0 disables caching.
+ */
+void index_setresultcache(index_t *index, int size);
+
+/*
+ * Limits on the work of a single query.  A limit of 0 means no limit.
+ */
+typedef struct index_budget
+{
+    long postings;  /* Postings visited by set operations and scoring */
+    long nodes;     /* Set nodes allocated for intermediate results */
+    double seconds; /* Wall time */
+} index_budget_t;
+
+/*
+ * Performs the given query like index_query_topk(), or like index_query()
+ * if 'k' is 0, within the given budget.  Set operations check the budget
+ * as they go, so that a query is cancelled soon after it exceeds any
+ * limit.  A cancelled query returns NULL, and an error message naming
+ * the exceeded limit is assigned to the given errmsg pointer.
+ */
+list_t *index_query_budget(index_t *index, list_t *query, int k, const index_budget_t *budget,
+                           char **errmsg);
+
+/*
+ * Performs the given query like index_query_topk(), or like index_query()
+ * if 'k' is 0, and assigns a description of the evaluated operator tree
+ * to the given explain pointer.  For each operator the description
+ * lists its input and output sizes, its time and the set nodes it
+ * allocated.  The caller must free the description.  The query is
+ * limited by the given budget like index_query_budget(), unless the
+ * budget is NULL.
+ */
+list_t *index_query_explain(index_t *index, list_t *query, int k, const index_budget_t *budget,
+                            char **errmsg, char **explain);
+
+/*
+ * Performs the 'n' given queries on the given index, like
+ * index_query_topk(), or like index_query() if 'k' is 0.  Returns an
+ * array of 'n' result lists; a failed query has a NULL result and an
+ * error message in the corresponding entry of 'errmsgs'.  Queries are
+ * evaluated in chunks that share term lookups and the results of
+ * common subexpressions, using up to 'threads' threads.  The caller
+ * must free the array, the results and the error messages.
+ */
+list_t **index_query_batch(index_t *index, list_t **queries, int n, int k, int threads,
+                           char **errmsgs);
+
+/*
+ * Compresses the postings of every term, and decodes them on demand
+ * when a query first uses them.  Decoded postings are cached, and the
+ * least recently used are freed once more than 'capacity' postings are
+ * decoded, so that memory tracks the working set of queried terms
+ * rather than the whole vocabulary.  Adding documents expands the
+ * postings of their terms again.
+ */
+void index_compress(index_t *index, long capacity);
+
+/*
+ * Decodes the postings of the given word into the posting cache of a
+ * compressed index, ahead of the queries that will use them.  Returns
+ * nonzero if the word is indexed.
+ */
+int index_prefetch(index_t *index, char *word);
+
+/*
+ * Builds a pruned first tier of the given index, keeping only the
+ * 'tiersize' highest impact postings of each term, while the full
+ * postings remain as the second tier.  Must be called after all
+ * documents have been added; adding documents discards the tiers.
+ * A tier size of 0 discards the tiers.
+ */
+void index_buildtiers(index_t *index, int tiersize);
+
+/*
+ * Walks the given index and fills in 'stats' with the memory used by
+ * each of its structures, and the distribution of posting lengths.
+ */
+void index_stats(index_t *index, index_stats_t *stats);
+
+/*
+ * Writes the given index statistics to the given file, as a human
+ * readable table or, if 'json' is nonzero, as a JSON object.
+ */
+void index_printstats(FILE *f, index_stats_t *stats, int json);
+
+/*
+ * Finds the documents that are most similar to the document with the
+ * given path, by running the highest weighted terms of that document
+ * as a disjunction.  Returns a list of at most 'k' results, excluding
+ * the document itself, ordered by descending score.  If the path is
+ * not indexed, an error message is assigned to the given errmsg pointer
+ * and the return value will be NULL.
+ */
+list_t *index_morelikethis(index_t *index, char *path, int k, char **errmsg);
+
+/*
+ * Returns a short excerpt of the document with the given path, chosen to
+ * contain as many of the words in the given query as possible.  Each
+ * query word in the excerpt is enclosed in 'hl_open' and 'hl_close'.
+ * The excerpt is reconstructed from the compressed document store built
+ * by index_addpath(), so the original file is not read.  Returns NULL
+ * if the path is not indexed.  The returned string must be freed by
+ * the caller.
+ */
+char *index_snippet(index_t *index, char *path, list_t *query,
+                    const char *hl_open, const char *hl_close);
+
 #endif
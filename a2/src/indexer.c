@@ -7,19 +7,74 @@
 
 #include "index.h"
 #include "httpd.h"
+#include "perf.h"
+#include "querylog.h"
 
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <pthread.h>
 #include <ctype.h>
+#include <unistd.h>
+#include <math.h>
+#include <sys/stat.h>
 
 #define PORT_NUM 8080
 
+/* Default number of results shown for a query */
+#define NUM_RESULTS 100
+
+/* Number of results returned by a "more like this" query */
+#define NUM_SIMILAR 10
+
+/* Query prefix requesting documents similar to the given path */
+#define LIKE_PREFIX "like:"
+
+/* Queries slower than this many milliseconds are logged (-L) */
+#define SLOW_QUERY_MS 100
+
+/* Default budget of a query; queries exceeding it are cancelled (-P, -N, -T) */
+#define BUDGET_POSTINGS 20000000
+#define BUDGET_NODES 5000000
+#define BUDGET_MS 1000
+
+/* Operands of queries with more postings than this are evaluated in parallel */
+#define PARALLEL_MIN_POSTINGS 65536
+
+/* Distinct queries whose results are cached (-R) */
+#define RESULT_CACHE_SIZE 4096
+
+/* Most frequent queries of a warm-up log that are run before serving (-w) */
+#define WARMUP_QUERIES 1024
+
+/*
+ * Estimate of the vocabulary of a corpus, used to presize the index:
+ * about HEAPS_K * sqrt(tokens) distinct words (Heaps' law), with a token
+ * per BYTES_PER_TOKEN bytes of text
+ */
+#define HEAPS_K 40
+#define BYTES_PER_TOKEN 6
+
+/* Size at which the query log is rotated, and rotated logs kept */
+#define QUERYLOG_MAX_BYTES (4 * 1024 * 1024)
+#define QUERYLOG_MAX_FILES 4
+
 static pthread_mutex_t query_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static char *root_dir;
 static index_t *idx;
+static int num_results = NUM_RESULTS;
+static index_budget_t budget = {BUDGET_POSTINGS, BUDGET_NODES, BUDGET_MS / 1000.0};
+static int result_cache_size = RESULT_CACHE_SIZE;
+
+/* Nonzero if the current query asked for an explanation (?explain=1) */
+static int explain_query;
+
+/* Slow query log, and the sampling of the remaining queries */
+static querylog_t *query_log;
+static double slow_query_ms = SLOW_QUERY_MS;
+static int sample_rate;
+static long num_queries;
 
 static void print_title(FILE *, char *);
 static void print_querystring(FILE *, char *);
@@ -200,15 +255,24 @@ static list_t *preprocess_query(char *query)
     return processed;
 }
 
-static void send_results(FILE *f, char *query, list_t *results)
+/*
+ * Sends the results of a query limited to 'limit' results, or unlimited
+ * if 'limit' is 0.  Fewer results than the limit are all the matches of
+ * the query; a full list is only the best of them.
+ */
+static void send_results(FILE *f, char *query, list_t *tokens, list_t *results, int limit)
 {
-    char *tmp;
+    char *tmp, *url, *snippet;
     list_iter_t *it;
 
     tmp = html_escape(query);
 
-    fprintf(f, "<hr/><h3>Your query for \"%s\" returned %d result(s)</h3>\n",
-            tmp, list_size(results));
+    if (limit > 0 && list_size(results) >= limit)
+        fprintf(f, "<hr/><h3>Your query for \"%s\" returned the top %d results</h3>\n",
+                tmp, list_size(results));
+    else
+        fprintf(f, "<hr/><h3>Your query for \"%s\" returned %d result(s)</h3>\n",
+                tmp, list_size(results));
     free(tmp);
 
     fprintf(f, "<ol id=\"results\">\n");
@@ -216,12 +280,27 @@ static void send_results(FILE *f, char *query, list_t *results)
     while (list_hasnext(it))
     {
         query_result_t *res = list_next(it);
+
+        /* Paths are percent-encoded in links, so that the server decodes them back intact */
+        tmp = urlencode(res->path + 1);
+        url = html_escape(tmp);
+        free(tmp);
         tmp = html_escape(res->path + 1);
-        fprintf(f, "<li><span class=\"score\">[%.2lf]</span> <a href=\"/indexed_files/%s\">%s</a></li>\n",
-                res->score, tmp, tmp);
+        fprintf(f, "<li><span class=\"score\">[%.2lf]</span> <a href=\"/indexed_files/%s\">%s</a>"
+                   " <a class=\"similar\" href=\"/?query=" LIKE_PREFIX "/%s\">similar</a>\n",
+                res->score, url, tmp, url);
+
+        /* Show an excerpt of the document with the query terms highlighted */
+        if (tokens && (snippet = index_snippet(idx, res->path, tokens, "<b>", "</b>")))
+        {
+            fprintf(f, "<div class=\"snippet\">%s</div>\n", snippet);
+            free(snippet);
+        }
+        fprintf(f, "</li>\n");
 
         /* Free memory */
         free(tmp);
+        free(url);
         free(res);
     }
     list_destroyiter(it);
@@ -229,22 +308,257 @@ static void send_results(FILE *f, char *query, list_t *results)
     fprintf(f, "</ol>\n");
 }
 
+/* Joins the given tokens into a single, space separated string */
+static char *join_tokens(list_t *tokens)
+{
+    char *line, *tmp;
+    list_iter_t *iter;
+
+    line = strdup("");
+    iter = list_createiter(tokens);
+    while (list_hasnext(iter))
+    {
+        tmp = concatenate_strings(3, line, *line ? " " : "", list_next(iter));
+        free(line);
+        line = tmp;
+    }
+    list_destroyiter(iter);
+
+    return line;
+}
+
+/*
+ * Logs the given query if it was slower than the threshold, or if it
+ * is picked by sampling.  Queries are logged as their preprocessed
+ * tokens, so that they can be replayed without the indexer.
+ */
+static void log_query(char *query, list_t *tokens, double seconds, list_t *result)
+{
+    char *line;
+
+    num_queries++;
+    if (seconds * 1000 < slow_query_ms && (sample_rate <= 0 || num_queries % sample_rate != 0))
+        return;
+
+    if (tokens == NULL)
+    {
+        querylog_append(query_log, query, seconds, result ? list_size(result) : 0);
+        return;
+    }
+
+    line = join_tokens(tokens);
+    querylog_append(query_log, line, seconds, result ? list_size(result) : 0);
+    free(line);
+}
+
+/* A distinct query of a warm-up log, and the number of times it occurs */
+typedef struct warmup_query
+{
+    char *text;
+    long count;
+} warmup_query_t;
+
+static int compare_warmup_count(const void *a, const void *b)
+{
+    long c1 = (*(warmup_query_t **)a)->count;
+    long c2 = (*(warmup_query_t **)b)->count;
+    return (c2 > c1) - (c2 < c1);
+}
+
+static void free_tokens(list_t *tokens)
+{
+    while (list_size(tokens) > 0)
+        free(list_popfirst(tokens));
+    list_destroy(tokens);
+}
+
+/*
+ * Reads a query log written with -l, or a list of words each followed
+ * by its frequency, and counts the distinct queries.  Returns an array
+ * of the queries ordered by descending count, and sets 'n' to its size.
+ */
+static warmup_query_t **read_warmup(char *path, int *n)
+{
+    FILE *f;
+    char *line = NULL, *text, *word, *saveptr, *c;
+    size_t len = 0;
+    long count;
+    list_t *tokens;
+    map_t *counts;
+    warmup_query_t **queries = NULL, *wq, **slot;
+    int max = 0;
+
+    f = fopen(path, "r");
+    if (f == NULL)
+        fatal_error("Unable to open '%s'", path);
+
+    counts = map_create(compare_strings, hash_string);
+    *n = 0;
+    while (getline(&line, &len, f) != -1)
+    {
+        tokens = querylog_parse(line);
+        if (tokens != NULL)
+        {
+            text = join_tokens(tokens);
+            free_tokens(tokens);
+            count = 1;
+        }
+        else
+        {
+            word = strtok_r(line, " \t\r\n", &saveptr);
+            if (word == NULL)
+                continue;
+            c = strtok_r(NULL, " \t\r\n", &saveptr);
+            count = c ? atol(c) : 1;
+            for (c = word; *c; c++)
+                *c = tolower(*c);
+            text = strdup(word);
+        }
+
+        if (*text == 0 || count <= 0)
+        {
+            free(text);
+            continue;
+        }
+        slot = (warmup_query_t **)map_get_or_insert(counts, text);
+        if (*slot != NULL)
+        {
+            (*slot)->count += count;
+            free(text);
+            continue;
+        }
+
+        if (*n == max)
+        {
+            max = max ? max * 2 : 1024;
+            queries = realloc(queries, max * sizeof(warmup_query_t *));
+            if (queries == NULL)
+                fatal_error("out of memory");
+        }
+        wq = malloc(sizeof(warmup_query_t));
+        if (wq == NULL)
+            fatal_error("out of memory");
+        wq->text = text;
+        wq->count = count;
+        *slot = wq;
+        queries[(*n)++] = wq;
+    }
+    free(line);
+    fclose(f);
+    map_destroy(counts, NULL, NULL);
+
+    if (*n > 0)
+        qsort(queries, *n, sizeof(warmup_query_t *), compare_warmup_count);
+    return queries;
+}
+
+/*
+ * Warms up the index with the queries of the given log or word list,
+ * so that the first queries after a restart are not slow.  The words of
+ * all queries are prefetched, least frequent first so that the most
+ * frequent stay cached, and the most frequent queries are run so that
+ * their results are cached.
+ */
+static void warm_up(char *path)
+{
+    warmup_query_t **queries;
+    list_t *tokens, *result;
+    list_iter_t *iter;
+    char *errmsg, *token;
+    int i, n, num_run = 0, num_words = 0;
+    double start = perf_now();
+
+    queries = read_warmup(path, &n);
+
+    for (i = n - 1; i >= 0; i--)
+    {
+        if (strncmp(queries[i]->text, LIKE_PREFIX, strlen(LIKE_PREFIX)) == 0)
+            continue;
+        tokens = tokenize_query(queries[i]->text);
+        iter = list_createiter(tokens);
+        while (list_hasnext(iter))
+        {
+            token = list_next(iter);
+            if (!is_reserved_word(token) && index_prefetch(idx, token))
+                num_words++;
+        }
+        list_destroyiter(iter);
+        free_tokens(tokens);
+    }
+
+    for (i = 0; i < n && num_run < WARMUP_QUERIES && num_run < result_cache_size; i++)
+    {
+        if (strncmp(queries[i]->text, LIKE_PREFIX, strlen(LIKE_PREFIX)) == 0)
+            continue;
+        tokens = tokenize_query(queries[i]->text);
+        result = index_query_budget(idx, tokens, num_results, &budget, &errmsg);
+        if (result != NULL)
+        {
+            while (list_size(result) > 0)
+                free(list_popfirst(result));
+            list_destroy(result);
+        }
+        else
+        {
+            free(errmsg);
+        }
+        free_tokens(tokens);
+        num_run++;
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        free(queries[i]->text);
+        free(queries[i]);
+    }
+    free(queries);
+
+    printf("Warmed up %d queries and %d words in %.1f ms\n", num_run, num_words,
+           (perf_now() - start) * 1000);
+}
+
 static void run_query(FILE *f, char *query)
 {
-    char *errmsg;
+    char *errmsg, *explain, *tmp;
     list_t *result;
     list_t *tokens = NULL;
     list_iter_t *iter;
+    double start = perf_now();
+    int limit = num_results;
+
+    /* "More like this" queries name a document rather than terms */
+    if (strncmp(query, LIKE_PREFIX, strlen(LIKE_PREFIX)) == 0)
+    {
+        limit = NUM_SIMILAR;
+        result = index_morelikethis(idx, query + strlen(LIKE_PREFIX), NUM_SIMILAR, &errmsg);
+        goto send;
+    }
 
     tokens = preprocess_query(query);
 
     /* Don't run query if query is empty */
     if (!list_size(tokens))
         goto end;
-    result = index_query(idx, tokens, &errmsg);
+    if (explain_query)
+    {
+        result = index_query_explain(idx, tokens, num_results, &budget, &errmsg, &explain);
+        tmp = html_escape(explain);
+        fprintf(f, "<hr/><h3>Query plan</h3>\n<pre class=\"explain\">%s</pre>\n", tmp);
+        free(tmp);
+        free(explain);
+    }
+    else
+    {
+        result = index_query_budget(idx, tokens, num_results, &budget, &errmsg);
+    }
+
+send:
+    if (query_log)
+        log_query(query, tokens, perf_now() - start, result);
+
     if (result != NULL)
     {
-        send_results(f, query, result);
+        send_results(f, query, tokens, result, limit);
         list_destroy(result);
     }
     else
@@ -255,6 +569,9 @@ static void run_query(FILE *f, char *query)
     }
 
     /* Cleanup */
+    if (tokens == NULL)
+        goto end;
+
     iter = list_createiter(tokens);
     while (list_hasnext(iter))
         free(list_next(iter));
@@ -430,22 +747,37 @@ static void handle_page(FILE *f, char *path, char *query)
     free(fullpath);
 }
 
+static void handle_stats(FILE *f)
+{
+    index_stats_t stats;
+
+    index_stats(idx, &stats);
+    http_ok(f, "application/json");
+    index_printstats(f, &stats, 1);
+}
+
 static int http_handler(char *path, map_t *header, map_t *args, FILE *f)
 {
-    char *query = "";
+    char *query = map_tryget(args, "query"), *explain;
 
-    if (map_haskey(args, "query"))
-    {
-        query = map_get(args, "query");
-    }
+    if (query == NULL)
+        query = "";
 
     if (strcmp(path, "/") == 0)
     {
         /* Serialize query processing */
         pthread_mutex_lock(&query_lock);
+        explain = map_tryget(args, "explain");
+        explain_query = explain != NULL && strcmp(explain, "1") == 0;
         handle_query(f, query);
         pthread_mutex_unlock(&query_lock);
     }
+    else if (strcmp(path, "/stats") == 0)
+    {
+        pthread_mutex_lock(&query_lock);
+        handle_stats(f);
+        pthread_mutex_unlock(&query_lock);
+    }
     else if (path[0] == '/')
     {
         handle_page(f, path + 1, query);
@@ -454,20 +786,189 @@ static int http_handler(char *path, map_t *header, map_t *args, FILE *f)
     return 0;
 }
 
+/* Returns nonzero if the given files have the same contents */
+static int files_equal(char *path1, char *path2)
+{
+    FILE *f1 = fopen(path1, "rb"), *f2 = fopen(path2, "rb");
+    char buf1[4096], buf2[4096];
+    size_t n1, n2;
+    int equal = f1 != NULL && f2 != NULL;
+
+    while (equal)
+    {
+        n1 = fread(buf1, 1, sizeof(buf1), f1);
+        n2 = fread(buf2, 1, sizeof(buf2), f2);
+        equal = n1 == n2 && memcmp(buf1, buf2, n1) == 0;
+        if (n1 == 0)
+            break;
+    }
+
+    if (f1)
+        fclose(f1);
+    if (f2)
+        fclose(f2);
+    return equal;
+}
+
+/*
+ * Sizes the tables of the index for the given files, from their number
+ * and total size, so that they do not grow repeatedly while indexing.
+ */
+static void presize_index(index_t *idx, list_t *files)
+{
+    list_iter_t *iter;
+    char *fullpath;
+    struct stat st;
+    double bytes = 0, tokens;
+
+    iter = list_createiter(files);
+    while (list_hasnext(iter))
+    {
+        fullpath = concatenate_strings(2, root_dir, (char *)list_next(iter));
+        if (stat(fullpath, &st) == 0)
+            bytes += st.st_size;
+        free(fullpath);
+    }
+    list_destroyiter(iter);
+
+    tokens = bytes / BYTES_PER_TOKEN;
+    index_reserve(idx, list_size(files), (int)fmin(tokens, HEAPS_K * sqrt(tokens)));
+}
+
+/*
+ * Looks up the file at 'fullpath' among the files indexed so far, by the
+ * hash and size of its contents.  Returns the path of an indexed file
+ * with the same contents, or NULL after recording the file as the first
+ * of its contents.  Files whose hashes collide are compared byte by
+ * byte, and only the first of them is recorded.
+ */
+static char *find_duplicate(map_t *duplicates, char *fullpath, char *relpath)
+{
+    uint64_t hash;
+    long size;
+    char key[48], *canonical, *canonical_path;
+    int equal;
+
+    if (!hash_file(fullpath, &hash, &size))
+        return NULL;
+
+    snprintf(key, sizeof(key), "%016llx:%ld", (unsigned long long)hash, size);
+    canonical = map_tryget(duplicates, key);
+    if (canonical == NULL)
+    {
+        /* The index keeps 'relpath', so the map may refer to it */
+        map_put(duplicates, strdup(key), relpath);
+        return NULL;
+    }
+
+    canonical_path = concatenate_strings(2, root_dir, canonical);
+    equal = files_equal(fullpath, canonical_path);
+    free(canonical_path);
+
+    return equal ? canonical : NULL;
+}
+
+static void usage(char *prog)
+{
+    fprintf(stderr, "Usage: %s [-s] [-m] [-j] [-D] [-k results] [-t tier-size] [-p threads] [-c postings] [-R queries] [-w log] [-P postings] [-N nodes] [-T ms] [-l log [-L ms] [-S n]] <root-dir>\n", prog);
+    fprintf(stderr, "  -s            print a summary of indexing time and counters\n");
+    fprintf(stderr, "  -m            print the memory used by the index\n");
+    fprintf(stderr, "  -j            print reports as JSON (implies -s unless -m is given)\n");
+    fprintf(stderr, "  -D            index identical files separately rather than as aliases\n");
+    fprintf(stderr, "  -k results    number of results shown per query (default %d)\n", NUM_RESULTS);
+    fprintf(stderr, "  -t tier-size  build a pruned first tier keeping tier-size postings per term\n");
+    fprintf(stderr, "  -p threads    threads evaluating a single query (default: number of cores)\n");
+    fprintf(stderr, "  -c postings   compress the postings, keeping at most this many decoded\n");
+    fprintf(stderr, "  -R queries    cache the results of this many queries (default %d, 0 to disable)\n", RESULT_CACHE_SIZE);
+    fprintf(stderr, "  -w log        warm up with a query log, or a list of words and frequencies\n");
+    fprintf(stderr, "  -P postings   cancel queries visiting more postings (default %d, 0 for no limit)\n", BUDGET_POSTINGS);
+    fprintf(stderr, "  -N nodes      cancel queries allocating more set nodes (default %d, 0 for no limit)\n", BUDGET_NODES);
+    fprintf(stderr, "  -T ms         cancel queries running longer (default %d, 0 for no limit)\n", BUDGET_MS);
+    fprintf(stderr, "  -l log        log slow queries to the given file, for replay_index\n");
+    fprintf(stderr, "  -L ms         log queries slower than ms milliseconds (default %d)\n", SLOW_QUERY_MS);
+    fprintf(stderr, "  -S n          also log every n'th query regardless of its time\n");
+}
+
 int main(int argc, char **argv)
 {
-    int status;
-    char *relpath, *fullpath;
+    int status, opt, tier_size = 0, summary = 0, memory = 0, json = 0;
+    long cache_size = 0;
+    int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    index_stats_t stats;
+    char *relpath, *fullpath, *canonical, *log_path = NULL, *warmup_path = NULL;
+    int dedup = 1;
+    map_t *duplicates = NULL;
     list_t *files, *words;
     list_iter_t *iter;
 
-    if (argc != 2)
+    while ((opt = getopt(argc, argv, "smjDk:t:p:c:R:w:P:N:T:l:L:S:")) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            summary = 1;
+            break;
+        case 'm':
+            memory = 1;
+            break;
+        case 'j':
+            json = 1;
+            break;
+        case 'D':
+            dedup = 0;
+            break;
+        case 'k':
+            num_results = atoi(optarg);
+            break;
+        case 't':
+            tier_size = atoi(optarg);
+            break;
+        case 'p':
+            threads = atoi(optarg);
+            break;
+        case 'c':
+            cache_size = atol(optarg);
+            break;
+        case 'R':
+            result_cache_size = atoi(optarg);
+            break;
+        case 'w':
+            warmup_path = optarg;
+            break;
+        case 'P':
+            budget.postings = atol(optarg);
+            break;
+        case 'N':
+            budget.nodes = atol(optarg);
+            break;
+        case 'T':
+            budget.seconds = atof(optarg) / 1000;
+            break;
+        case 'l':
+            log_path = optarg;
+            break;
+        case 'L':
+            slow_query_ms = atof(optarg);
+            break;
+        case 'S':
+            sample_rate = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind != argc - 1)
     {
-        fprintf(stderr, "Usage: %s <root-dir>\n", argv[0]);
+        usage(argv[0]);
         return 1;
     }
 
-    root_dir = argv[1];
+    root_dir = argv[optind];
+    if (json && !memory)
+        summary = 1;
+    perf_enable(summary);
 
     /* Check that root_dir exists and is directory */
     if (!is_valid_directory(root_dir))
@@ -475,6 +976,9 @@ int main(int argc, char **argv)
 
     files = find_files(root_dir);
     idx = index_create();
+    presize_index(idx, files);
+    if (dedup)
+        duplicates = map_create_with_capacity(compare_strings, hash_string, list_size(files));
 
     iter = list_createiter(files);
     int counter = 0;
@@ -485,6 +989,15 @@ int main(int argc, char **argv)
         fullpath = concatenate_strings(2, root_dir, relpath);
         //printf("Indexing %s\n", fullpath);
 
+        /* Identical files are recorded as aliases of the first copy */
+        if (duplicates && (canonical = find_duplicate(duplicates, fullpath, relpath)) != NULL)
+        {
+            index_addalias(idx, relpath, canonical);
+            PERF_COUNT(PERF_DUPLICATES, 1);
+            free(fullpath);
+            continue;
+        }
+
         words = list_create((cmpfunc_t)strcmp);
         tokenize_file(fullpath, words);
         index_addpath(idx, relpath, words);
@@ -499,11 +1012,40 @@ int main(int argc, char **argv)
 
     list_destroyiter(iter);
     list_destroy(files);
+    if (duplicates)
+        map_destroy(duplicates, free, NULL);
+
+    if (tier_size > 0)
+        index_buildtiers(idx, tier_size);
+    if (cache_size > 0)
+        index_compress(idx, cache_size);
+    index_setparallel(idx, threads, PARALLEL_MIN_POSTINGS);
+    index_setresultcache(idx, result_cache_size);
+    if (warmup_path)
+        warm_up(warmup_path);
+
+    if (summary)
+        perf_report(stdout, json);
+
+    if (memory)
+    {
+        index_stats(idx, &stats);
+        index_printstats(stdout, &stats, json);
+    }
+
+    if (log_path)
+    {
+        query_log = querylog_create(log_path, QUERYLOG_MAX_BYTES, QUERYLOG_MAX_FILES);
+        if (query_log == NULL)
+            fatal_error("Unable to open '%s'", log_path);
+    }
 
     printf("Serving queries on port %d\n", (int)PORT_NUM);
 
     status = http_server((int)PORT_NUM, http_handler);
 
+    if (query_log)
+        querylog_destroy(query_log);
     index_destroy(idx);
 
     return status;
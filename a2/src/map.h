@@ -16,6 +16,17 @@ typedef struct map map_t;
  */
 map_t *map_create(cmpfunc_t cmpfunc, hashfunc_t hashfunc);
 
+/*
+ * Like map_create(), but sized to hold 'capacity' keys without growing.
+ */
+map_t *map_create_with_capacity(cmpfunc_t cmpfunc, hashfunc_t hashfunc, int capacity);
+
+/*
+ * Grows the given map, if needed, to hold 'capacity' keys without
+ * growing again.  Never shrinks the map.
+ */
+void map_reserve(map_t *map, int capacity);
+
 /*
  * Destroys the given map.  Subsequently accessing the map will lead
  * to undefined behavior.
@@ -33,6 +44,22 @@ void map_destroy(map_t *map, void (*destroy_key)(void *), void (*destroy_val)(vo
  */
 void map_put(map_t *map, void *key, void *value);
 
+/*
+ * Returns a pointer to the value that the given key maps to, first
+ * mapping the key to NULL if it is not in the map.  A NULL value thus
+ * tells a new key from an existing one, as long as keys are never
+ * mapped to NULL otherwise.  The pointer is valid until the map is next
+ * modified, and the key is stored in the map if it was not there.
+ */
+void **map_get_or_insert(map_t *map, void *key);
+
+/*
+ * Removes the given key from the given map.  Returns 1 if the key was
+ * in the map, 0 otherwise.  The key and value stored in the map are
+ * destroyed using 'destroy_key' and 'destroy_val', if they are not NULL.
+ */
+int map_remove(map_t *map, void *key, void (*destroy_key)(void *), void (*destroy_val)(void *));
+
 /*
  * Returns 1 if the given map contains the given key, 0 otherwise.
  */
@@ -43,4 +70,71 @@ int map_haskey(map_t *map, void *key);
  */
 void *map_get(map_t *map, void *key);
 
+/*
+ * Returns the value that the given key maps to, or NULL if the key is
+ * not in the map.
+ */
+void *map_tryget(map_t *map, void *key);
+
+/*
+ * Returns the number of keys in the given map.
+ */
+int map_size(map_t *map);
+
+/*
+ * Returns the number of bytes allocated by the given map for its own
+ * structure, not counting the keys and values.
+ */
+size_t map_bytes(map_t *map);
+
+/*
+ * Layout of a map, for diagnostics.  A probe is a key examined by a
+ * lookup of a key in the map, whether in a chain or in a run of slots.
+ */
+typedef struct map_stats
+{
+    int size;          /* Number of keys */
+    int capacity;      /* Number of buckets or slots */
+    double load;       /* Keys per bucket or slot */
+    double mean_probe; /* Mean probes of a lookup, over all keys */
+    int max_probe;     /* Most probes of a lookup of any key */
+    size_t bytes;      /* As returned by map_bytes() */
+} map_stats_t;
+
+/*
+ * Assigns the layout of the given map to 'stats'.  Takes time linear
+ * in the capacity of the map.
+ */
+void map_stats(map_t *map, map_stats_t *stats);
+
+/*
+ * The type of map iterators.  An iterator visits every key of a map
+ * once, in no particular order, and allocates nothing but itself.  The
+ * map must not be modified while it is iterated.
+ */
+struct map_iter;
+typedef struct map_iter map_iter_t;
+
+/*
+ * Creates a new map iterator for iterating over the given map.
+ */
+map_iter_t *map_createiter(map_t *map);
+
+/*
+ * Destroys the given map iterator.
+ */
+void map_destroyiter(map_iter_t *iter);
+
+/*
+ * Returns 0 if the given map iterator has reached the end of the map,
+ * or 1 otherwise.
+ */
+int map_hasnext(map_iter_t *iter);
+
+/*
+ * Returns the next key of the given map iterator, and assigns the value
+ * it maps to to 'value' if 'value' is not NULL.
+ */
+void *map_next(map_iter_t *iter, void **value);
+
 #endif
@@ -0,0 +1,379 @@
+/*
+ * Open addressing implementation of the map interface.
+ *
+ * Entries are stored inline in a single array of slots, so that a lookup
+ * probes a few adjacent slots instead of following a chain of separately
+ * allocated entries, and inserting a key allocates nothing unless the
+ * table grows.  Collisions are resolved by Robin Hood linear probing: a
+ * parallel array of control bytes records how far each entry lies from
+ * its home slot, with 0 marking an empty slot.  An insert displaces any
+ * entry that lies closer to its home than the entry being inserted,
+ * which keeps probe sequences short and lets a lookup stop as soon as
+ * it meets an entry closer to home than the key would be.
+ */
+
+#include "map.h"
+
+#include <stdlib.h>
+
+/* The table grows when more than 7/8 of its slots are used */
+#define MAX_LOAD_NUM 7
+#define MAX_LOAD_DEN 8
+
+/* Probe distances are stored in a byte, counting from 1 */
+#define MAX_DIST 255
+
+#define INITIAL_CAPACITY 8
+
+typedef struct slot
+{
+    unsigned long hash;
+    void *key;
+    void *value;
+} slot_t;
+
+struct map
+{
+    cmpfunc_t cmpfunc;
+    hashfunc_t hashfunc;
+    int size;
+    int capacity;        /* Number of slots, a power of two */
+    int shift;           /* Bits to drop from a mixed hash to get a slot */
+    unsigned char *dist; /* Probe distance of each slot plus one, or 0 if empty */
+    slot_t *slots;
+};
+
+/*
+ * Returns the home slot of the given hash.  Not every hash function
+ * mixes its bits as well as hash_string(), so the hash is mixed by a
+ * multiplication and the slot is taken from the high bits.
+ */
+static int home(map_t *map, unsigned long hash)
+{
+    return (int)(((uint64_t)hash * 0x9e3779b97f4a7c15ULL) >> map->shift);
+}
+
+static void allocslots(map_t *map, int capacity)
+{
+    int bits = 0;
+
+    while ((1 << bits) < capacity)
+        bits++;
+
+    map->capacity = capacity;
+    map->shift = 64 - bits;
+    map->dist = calloc(capacity, sizeof(unsigned char));
+    map->slots = malloc(capacity * sizeof(slot_t));
+    if (map->dist == NULL || map->slots == NULL)
+        fatal_error("out of memory");
+}
+
+/*
+ * Returns the number of slots needed to hold 'capacity' keys without
+ * exceeding the maximum load.
+ */
+static int slotsfor(int capacity)
+{
+    int slots = INITIAL_CAPACITY;
+
+    while ((long)capacity * MAX_LOAD_DEN > (long)slots * MAX_LOAD_NUM)
+        slots *= 2;
+    return slots;
+}
+
+map_t *map_create(cmpfunc_t cmpfunc, hashfunc_t hashfunc)
+{
+    return map_create_with_capacity(cmpfunc, hashfunc, 0);
+}
+
+map_t *map_create_with_capacity(cmpfunc_t cmpfunc, hashfunc_t hashfunc, int capacity)
+{
+    map_t *map;
+
+    map = malloc(sizeof(map_t));
+    if (map == NULL)
+        fatal_error("out of memory");
+
+    map->cmpfunc = cmpfunc;
+    map->hashfunc = hashfunc;
+    map->size = 0;
+    allocslots(map, slotsfor(capacity));
+
+    return map;
+}
+
+void map_destroy(map_t *map, void (*destroy_key)(void *), void (*destroy_val)(void *))
+{
+    int i;
+
+    for (i = 0; i < map->capacity; i++)
+    {
+        if (map->dist[i] == 0)
+            continue;
+        if (destroy_key && map->slots[i].key)
+            destroy_key(map->slots[i].key);
+        if (destroy_val && map->slots[i].value)
+            destroy_val(map->slots[i].value);
+    }
+    free(map->dist);
+    free(map->slots);
+    free(map);
+}
+
+/*
+ * Returns the slot holding the given key, or -1 if the key is not in
+ * the map.
+ */
+static int findslot(map_t *map, void *key, unsigned long hash)
+{
+    int mask = map->capacity - 1;
+    int i = home(map, hash);
+    int d;
+
+    for (d = 1; map->dist[i] >= d; d++)
+    {
+        if (map->slots[i].hash == hash && map->cmpfunc(key, map->slots[i].key) == 0)
+            return i;
+        i = (i + 1) & mask;
+    }
+    return -1;
+}
+
+static void growmap(map_t *map);
+
+/*
+ * Inserts an entry for a key that is not in the map, displacing
+ * entries that lie closer to their home slot.  Returns the slot where
+ * the entry ends up.
+ */
+static int insertslot(map_t *map, slot_t entry)
+{
+    int mask = map->capacity - 1;
+    int i = home(map, entry.hash);
+    int d = 1, placed = -1;
+    slot_t inserted = entry, tmp;
+    unsigned char tmpdist;
+
+    while (map->dist[i] != 0)
+    {
+        if (map->dist[i] < d)
+        {
+            /* Take the slot, and carry on inserting the displaced entry */
+            tmp = map->slots[i];
+            tmpdist = map->dist[i];
+            map->slots[i] = entry;
+            map->dist[i] = d;
+            entry = tmp;
+            d = tmpdist;
+            if (placed < 0)
+                placed = i;
+        }
+        i = (i + 1) & mask;
+        d++;
+
+        if (d == MAX_DIST)
+        {
+            /* Too long a probe sequence; spread the entries out */
+            growmap(map);
+            i = insertslot(map, entry);
+            return placed < 0 ? i : findslot(map, inserted.key, inserted.hash);
+        }
+    }
+    map->slots[i] = entry;
+    map->dist[i] = d;
+    return placed < 0 ? i : placed;
+}
+
+/*
+ * Moves all entries to a table of the given number of slots.
+ */
+static void resizemap(map_t *map, int capacity)
+{
+    int i;
+    int oldcapacity = map->capacity;
+    unsigned char *olddist = map->dist;
+    slot_t *oldslots = map->slots;
+
+    allocslots(map, capacity);
+    for (i = 0; i < oldcapacity; i++)
+    {
+        if (olddist[i] != 0)
+            insertslot(map, oldslots[i]);
+    }
+    free(olddist);
+    free(oldslots);
+}
+
+static void growmap(map_t *map)
+{
+    resizemap(map, map->capacity * 2);
+}
+
+void map_reserve(map_t *map, int capacity)
+{
+    int slots = slotsfor(capacity);
+
+    if (slots > map->capacity)
+        resizemap(map, slots);
+}
+
+void **map_get_or_insert(map_t *map, void *key)
+{
+    unsigned long hash = map->hashfunc(key);
+    int i = findslot(map, key, hash);
+
+    if (i < 0)
+    {
+        if ((long)(map->size + 1) * MAX_LOAD_DEN > (long)map->capacity * MAX_LOAD_NUM)
+            growmap(map);
+        i = insertslot(map, (slot_t){.hash = hash, .key = key, .value = NULL});
+        map->size++;
+    }
+    return &map->slots[i].value;
+}
+
+void map_put(map_t *map, void *key, void *value)
+{
+    *map_get_or_insert(map, key) = value;
+}
+
+/*
+ * Removes the entry of the given slot by shifting the entries that
+ * follow it one slot back towards their home, up to the first entry
+ * that is already home, so that no lookup meets an empty slot early.
+ */
+static void removeslot(map_t *map, int i)
+{
+    int mask = map->capacity - 1;
+    int next = (i + 1) & mask;
+
+    while (map->dist[next] > 1)
+    {
+        map->slots[i] = map->slots[next];
+        map->dist[i] = map->dist[next] - 1;
+        i = next;
+        next = (next + 1) & mask;
+    }
+    map->dist[i] = 0;
+}
+
+int map_remove(map_t *map, void *key, void (*destroy_key)(void *), void (*destroy_val)(void *))
+{
+    int i = findslot(map, key, map->hashfunc(key));
+
+    if (i < 0)
+        return 0;
+
+    if (destroy_key && map->slots[i].key)
+        destroy_key(map->slots[i].key);
+    if (destroy_val && map->slots[i].value)
+        destroy_val(map->slots[i].value);
+    removeslot(map, i);
+    map->size--;
+    return 1;
+}
+
+int map_haskey(map_t *map, void *key)
+{
+    return findslot(map, key, map->hashfunc(key)) >= 0;
+}
+
+void *map_get(map_t *map, void *key)
+{
+    int i = findslot(map, key, map->hashfunc(key));
+
+    if (i < 0)
+    {
+        fatal_error("key not found in map");
+        return NULL;
+    }
+    return map->slots[i].value;
+}
+
+void *map_tryget(map_t *map, void *key)
+{
+    int i = findslot(map, key, map->hashfunc(key));
+
+    return i >= 0 ? map->slots[i].value : NULL;
+}
+
+int map_size(map_t *map)
+{
+    return map->size;
+}
+
+size_t map_bytes(map_t *map)
+{
+    return sizeof(map_t) + map->capacity * (sizeof(slot_t) + sizeof(unsigned char));
+}
+
+void map_stats(map_t *map, map_stats_t *stats)
+{
+    int i;
+    double total = 0;
+
+    stats->size = map->size;
+    stats->capacity = map->capacity;
+    stats->load = (double)map->size / map->capacity;
+    stats->max_probe = 0;
+    for (i = 0; i < map->capacity; i++)
+    {
+        /* A key is found after as many probes as its distance from home, counting from 1 */
+        total += map->dist[i];
+        if (map->dist[i] > stats->max_probe)
+            stats->max_probe = map->dist[i];
+    }
+    stats->mean_probe = map->size > 0 ? total / map->size : 0;
+    stats->bytes = map_bytes(map);
+}
+
+struct map_iter
+{
+    map_t *map;
+    int slot; /* Next used slot, or the capacity at the end */
+};
+
+/* Moves the iterator to the first used slot from its current one */
+static void advance(map_iter_t *iter)
+{
+    while (iter->slot < iter->map->capacity && iter->map->dist[iter->slot] == 0)
+        iter->slot++;
+}
+
+map_iter_t *map_createiter(map_t *map)
+{
+    map_iter_t *iter = malloc(sizeof(map_iter_t));
+
+    if (iter == NULL)
+        fatal_error("out of memory");
+    iter->map = map;
+    iter->slot = 0;
+    advance(iter);
+    return iter;
+}
+
+void map_destroyiter(map_iter_t *iter)
+{
+    free(iter);
+}
+
+int map_hasnext(map_iter_t *iter)
+{
+    return iter->slot < iter->map->capacity;
+}
+
+void *map_next(map_iter_t *iter, void **value)
+{
+    slot_t *slot;
+
+    if (iter->slot >= iter->map->capacity)
+    {
+        fatal_error("map iterator exhausted");
+        return NULL;
+    }
+    slot = &iter->map->slots[iter->slot++];
+    if (value != NULL)
+        *value = slot->value;
+    advance(iter);
+    return slot->key;
+}
@@ -0,0 +1,62 @@
+#include "perf.h"
+
+#include <string.h>
+#include <time.h>
+
+int perf_enabled = 0;
+double perf_times[PERF_NUM_PHASES];
+long perf_counters[PERF_NUM_COUNTERS];
+
+static const char *phase_names[PERF_NUM_PHASES] = {
+    "find_files", "hash", "tokenize", "aggregate", "dictionary", "postings", "docstore", "tiers", "compress"};
+
+static const char *counter_names[PERF_NUM_COUNTERS] = {
+    "files", "bytes", "tokens", "terms", "postings", "allocations", "duplicates"};
+
+double perf_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void perf_enable(int enabled)
+{
+    perf_enabled = enabled;
+}
+
+void perf_reset(void)
+{
+    memset(perf_times, 0, sizeof(perf_times));
+    memset(perf_counters, 0, sizeof(perf_counters));
+}
+
+void perf_report(FILE *f, int json)
+{
+    int i;
+    double total = 0;
+
+    for (i = 0; i < PERF_NUM_PHASES; i++)
+        total += perf_times[i];
+
+    if (json)
+    {
+        fprintf(f, "{\"phases\": {");
+        for (i = 0; i < PERF_NUM_PHASES; i++)
+            fprintf(f, "%s\"%s\": %.6f", i ? ", " : "", phase_names[i], perf_times[i]);
+        fprintf(f, "}, \"total\": %.6f, \"counters\": {", total);
+        for (i = 0; i < PERF_NUM_COUNTERS; i++)
+            fprintf(f, "%s\"%s\": %ld", i ? ", " : "", counter_names[i], perf_counters[i]);
+        fprintf(f, "}}\n");
+        return;
+    }
+
+    fprintf(f, "Indexing summary:\n");
+    for (i = 0; i < PERF_NUM_PHASES; i++)
+        fprintf(f, "  %-12s %10.3f s  %5.1f%%\n", phase_names[i], perf_times[i],
+                total > 0 ? 100 * perf_times[i] / total : 0);
+    fprintf(f, "  %-12s %10.3f s\n", "total", total);
+    for (i = 0; i < PERF_NUM_COUNTERS; i++)
+        fprintf(f, "  %-12s %12ld\n", counter_names[i], perf_counters[i]);
+}
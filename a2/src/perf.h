@@ -0,0 +1,87 @@
+#ifndef PERF_H
+#define PERF_H
+
+#include <stdio.h>
+
+/*
+ * Phases of index construction that are timed.
+ */
+typedef enum perf_phase
+{
+    PERF_FIND_FILES, /* Scanning the root directory */
+    PERF_HASH,       /* Hashing file contents to find duplicates */
+    PERF_TOKENIZE,   /* Reading and tokenizing files */
+    PERF_AGGREGATE,  /* Aggregating the words of a document into terms */
+    PERF_DICTIONARY, /* Looking up and creating terms */
+    PERF_POSTINGS,   /* Inserting postings into posting sets */
+    PERF_DOCSTORE,   /* Building forward indexes and the document store */
+    PERF_TIERS,      /* Building the pruned first tier */
+    PERF_COMPRESS,   /* Compressing the postings */
+    PERF_NUM_PHASES
+} perf_phase_t;
+
+/*
+ * Quantities that are counted during index construction.
+ */
+typedef enum perf_counter
+{
+    PERF_FILES,
+    PERF_BYTES,
+    PERF_TOKENS,
+    PERF_TERMS,       /* Distinct terms added to the dictionary */
+    PERF_NUM_POSTINGS,
+    PERF_ALLOCATIONS, /* Heap allocations made by the tokenizer and the index itself,
+                         counted where they are made; those inside the list, set,
+                         map and document store modules are not included */
+    PERF_DUPLICATES,  /* Files recorded as duplicates of another file */
+    PERF_NUM_COUNTERS
+} perf_counter_t;
+
+/*
+ * Nonzero if instrumentation is enabled.  Use the macros below rather
+ * than calling the perf_* functions directly, so that instrumentation
+ * costs a single branch when it is disabled.
+ *
+ * The timers and counters are not synchronized, and must only be
+ * updated by one thread at a time.
+ */
+extern int perf_enabled;
+extern double perf_times[PERF_NUM_PHASES];
+extern long perf_counters[PERF_NUM_COUNTERS];
+
+/*
+ * Returns the current time in seconds, from a monotonic clock.
+ */
+double perf_now(void);
+
+#define PERF_START(t) double t = perf_enabled ? perf_now() : 0
+#define PERF_STOP(phase, t)                          \
+    do                                               \
+    {                                                \
+        if (perf_enabled)                            \
+            perf_times[phase] += perf_now() - (t);   \
+    } while (0)
+#define PERF_COUNT(counter, n)                       \
+    do                                               \
+    {                                                \
+        if (perf_enabled)                            \
+            perf_counters[counter] += (n);           \
+    } while (0)
+
+/*
+ * Enables or disables instrumentation.
+ */
+void perf_enable(int enabled);
+
+/*
+ * Resets all timers and counters to zero.
+ */
+void perf_reset(void);
+
+/*
+ * Writes a summary of the timers and counters to the given file, as
+ * a human readable table or, if 'json' is nonzero, as a JSON object.
+ */
+void perf_report(FILE *f, int json);
+
+#endif
@@ -0,0 +1,225 @@
+#include "querylog.h"
+#include "list.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+/* Lines queued beyond this are dropped */
+#define QUERYLOG_QUEUE_MAX 1024
+
+typedef struct logline logline_t;
+
+struct logline
+{
+    char *text;
+    logline_t *next;
+};
+
+struct querylog
+{
+    char *path;
+    long maxbytes;
+    int maxfiles;
+    FILE *file;
+    long size;          /* Bytes written to the current file */
+
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t nonempty;
+    logline_t *head;    /* Queued lines, oldest first */
+    logline_t *tail;
+    int queued;
+    int done;           /* Nonzero when the writer should exit */
+    long dropped;
+};
+
+/*
+ * Renames "path.i" to "path.i+1" for each rotated file, and starts a
+ * new, empty "path".
+ */
+static void rotate(querylog_t *log)
+{
+    int i;
+    size_t len = strlen(log->path) + 16;
+    char *from = malloc(len), *to = malloc(len);
+
+    if (from == NULL || to == NULL)
+        fatal_error("out of memory");
+
+    fclose(log->file);
+    for (i = log->maxfiles - 1; i > 0; i--)
+    {
+        snprintf(from, len, "%s.%d", log->path, i);
+        snprintf(to, len, "%s.%d", log->path, i + 1);
+        rename(from, to);
+    }
+    if (log->maxfiles > 0)
+    {
+        snprintf(to, len, "%s.1", log->path);
+        rename(log->path, to);
+    }
+
+    log->file = fopen(log->path, "w");
+    if (log->file == NULL)
+        fatal_error("Unable to open '%s'", log->path);
+    log->size = 0;
+
+    free(from);
+    free(to);
+}
+
+static void *writer_main(void *arg)
+{
+    querylog_t *log = arg;
+    logline_t *lines, *line;
+
+    pthread_mutex_lock(&log->lock);
+    while (1)
+    {
+        while (log->head == NULL && !log->done)
+            pthread_cond_wait(&log->nonempty, &log->lock);
+        if (log->head == NULL)
+            break;
+
+        /* Take the whole queue, and write it without holding the lock */
+        lines = log->head;
+        log->head = log->tail = NULL;
+        log->queued = 0;
+        pthread_mutex_unlock(&log->lock);
+
+        while (lines != NULL)
+        {
+            line = lines;
+            lines = line->next;
+
+            if (log->size > 0 && log->size + (long)strlen(line->text) > log->maxbytes)
+                rotate(log);
+            log->size += fprintf(log->file, "%s", line->text);
+
+            free(line->text);
+            free(line);
+        }
+        fflush(log->file);
+
+        pthread_mutex_lock(&log->lock);
+    }
+    pthread_mutex_unlock(&log->lock);
+
+    return NULL;
+}
+
+querylog_t *querylog_create(const char *path, long maxbytes, int maxfiles)
+{
+    querylog_t *log = calloc(1, sizeof(querylog_t));
+
+    if (log == NULL)
+        fatal_error("out of memory");
+
+    log->file = fopen(path, "a");
+    if (log->file == NULL)
+    {
+        free(log);
+        return NULL;
+    }
+    log->path = strdup(path);
+    log->maxbytes = maxbytes;
+    log->maxfiles = maxfiles;
+    fseek(log->file, 0, SEEK_END);
+    log->size = ftell(log->file);
+
+    pthread_mutex_init(&log->lock, NULL);
+    pthread_cond_init(&log->nonempty, NULL);
+    if (pthread_create(&log->writer, NULL, writer_main, log) != 0)
+        fatal_error("Unable to start query log writer");
+
+    return log;
+}
+
+void querylog_destroy(querylog_t *log)
+{
+    pthread_mutex_lock(&log->lock);
+    log->done = 1;
+    pthread_cond_signal(&log->nonempty);
+    pthread_mutex_unlock(&log->lock);
+    pthread_join(log->writer, NULL);
+
+    pthread_mutex_destroy(&log->lock);
+    pthread_cond_destroy(&log->nonempty);
+    fclose(log->file);
+    free(log->path);
+    free(log);
+}
+
+void querylog_append(querylog_t *log, const char *query, double seconds, int results)
+{
+    logline_t *line;
+    char *c;
+    size_t len = strlen(query) + 64;
+
+    line = malloc(sizeof(logline_t));
+    if (line == NULL || (line->text = malloc(len)) == NULL)
+        fatal_error("out of memory");
+    line->next = NULL;
+
+    snprintf(line->text, len, "%ld\t%.3f\t%d\t", (long)time(NULL), seconds * 1000, results);
+    for (c = line->text + strlen(line->text); *query; query++)
+        *c++ = (*query == '\t' || *query == '\n' || *query == '\r') ? ' ' : *query;
+    *c++ = '\n';
+    *c = 0;
+
+    pthread_mutex_lock(&log->lock);
+    if (log->queued >= QUERYLOG_QUEUE_MAX)
+    {
+        log->dropped++;
+        pthread_mutex_unlock(&log->lock);
+        free(line->text);
+        free(line);
+        return;
+    }
+    if (log->tail == NULL)
+        log->head = line;
+    else
+        log->tail->next = line;
+    log->tail = line;
+    log->queued++;
+    pthread_cond_signal(&log->nonempty);
+    pthread_mutex_unlock(&log->lock);
+}
+
+long querylog_dropped(querylog_t *log)
+{
+    long dropped;
+
+    pthread_mutex_lock(&log->lock);
+    dropped = log->dropped;
+    pthread_mutex_unlock(&log->lock);
+    return dropped;
+}
+
+list_t *querylog_parse(const char *line)
+{
+    const char *query = line;
+    char *copy, *token, *saveptr;
+    list_t *tokens;
+    int i;
+
+    /* Skip the time, latency and result count fields */
+    for (i = 0; i < 3; i++)
+    {
+        query = strchr(query, '\t');
+        if (query == NULL)
+            return NULL;
+        query++;
+    }
+
+    tokens = list_create(compare_strings);
+    copy = strdup(query);
+    for (token = strtok_r(copy, " \r\n", &saveptr); token != NULL;
+         token = strtok_r(NULL, " \r\n", &saveptr))
+        list_addlast(tokens, strdup(token));
+    free(copy);
+
+    return tokens;
+}
@@ -0,0 +1,50 @@
+#ifndef QUERYLOG_H
+#define QUERYLOG_H
+
+#include "common.h"
+
+/*
+ * The type of query logs.  A query log appends one line per query to a
+ * file, from a background thread, so that logging never waits for the
+ * disk.  When the file grows beyond its size limit it is rotated:
+ * "path" is renamed to "path.1", "path.1" to "path.2" and so on.
+ *
+ * Each line holds four tab separated fields: the wall clock time in
+ * seconds, the query time in milliseconds, the number of results, and
+ * the query as a space separated list of tokens.
+ */
+struct querylog;
+typedef struct querylog querylog_t;
+
+/*
+ * Creates a query log appending to the file at the given path, rotating
+ * it when it exceeds 'maxbytes', and keeping at most 'maxfiles' rotated
+ * files.  Returns NULL if the file cannot be opened.
+ */
+querylog_t *querylog_create(const char *path, long maxbytes, int maxfiles);
+
+/*
+ * Writes all queued lines to the log and destroys it.
+ */
+void querylog_destroy(querylog_t *log);
+
+/*
+ * Queues a line for the given query.  Tabs and newlines in the query
+ * are replaced by spaces.  If the writer has fallen too far behind, the
+ * line is dropped rather than queued.
+ */
+void querylog_append(querylog_t *log, const char *query, double seconds, int results);
+
+/*
+ * Returns the number of lines dropped because the queue was full.
+ */
+long querylog_dropped(querylog_t *log);
+
+/*
+ * Splits a query logged by querylog_append() into a list of tokens.
+ * Returns NULL if the line is not a query log line.  The caller must
+ * free the tokens and the list.
+ */
+struct list *querylog_parse(const char *line);
+
+#endif
@@ -0,0 +1,342 @@
+/*
+ * Query log replay.
+ *
+ * Indexes a directory like the indexer does, and replays the queries
+ * of a query log written by the indexer (-l) against the index, in
+ * process and without HTTP.  Queries are issued at a target rate, or
+ * back to back if no rate is given.  Latency percentiles and throughput
+ * are written as JSON.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "index.h"
+#include "list.h"
+#include "perf.h"
+#include "querylog.h"
+#include "set.h"
+
+#define DEFAULT_RESULTS (100)
+#define DEFAULT_PASSES (1)
+
+/* Number of results returned by a "more like this" query, as in the indexer */
+#define NUM_SIMILAR (10)
+#define LIKE_PREFIX "like:"
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double d1 = *(double *)a;
+    double d2 = *(double *)b;
+    return (d1 > d2) - (d1 < d2);
+}
+
+/* Returns the given percentile of 'n' sorted samples */
+static double percentile(double *sorted, int n, double p)
+{
+    int i = (int)(p / 100.0 * (n - 1) + 0.5);
+    return sorted[i];
+}
+
+/* Indexes all files under the given directory */
+static index_t *build_index(char *root_dir)
+{
+    char *relpath, *fullpath;
+    list_t *files, *words;
+    list_iter_t *iter;
+    index_t *ind;
+
+    files = find_files(root_dir);
+    ind = index_create();
+
+    iter = list_createiter(files);
+    while (list_hasnext(iter))
+    {
+        relpath = list_next(iter);
+        fullpath = concatenate_strings(2, root_dir, relpath);
+
+        words = list_create(compare_strings);
+        tokenize_file(fullpath, words);
+        index_addpath(ind, relpath, words);
+
+        free(fullpath);
+        list_destroy(words);
+    }
+    list_destroyiter(iter);
+    list_destroy(files);
+
+    return ind;
+}
+
+/* Reads the queries of the given log, as lists of tokens */
+static list_t *read_log(char *path)
+{
+    FILE *f;
+    char *line = NULL;
+    size_t len = 0;
+    list_t *queries, *tokens;
+
+    f = fopen(path, "r");
+    if (f == NULL)
+        fatal_error("Unable to open '%s'", path);
+
+    queries = list_create(compare_pointers);
+    while (getline(&line, &len, f) != -1)
+    {
+        tokens = querylog_parse(line);
+        if (tokens == NULL)
+            continue;
+        if (list_size(tokens) == 0)
+        {
+            list_destroy(tokens);
+            continue;
+        }
+        list_addlast(queries, tokens);
+    }
+    free(line);
+    fclose(f);
+
+    return queries;
+}
+
+/* Returns the tokens of a query joined by spaces */
+static char *join_tokens(list_t *tokens)
+{
+    char *query, *token;
+    size_t len = 1;
+    list_iter_t *iter;
+
+    iter = list_createiter(tokens);
+    while (list_hasnext(iter))
+        len += strlen(list_next(iter)) + 1;
+    list_destroyiter(iter);
+
+    query = calloc(len, sizeof(char));
+    if (query == NULL)
+        fatal_error("out of memory");
+    iter = list_createiter(tokens);
+    while (list_hasnext(iter))
+    {
+        token = list_next(iter);
+        if (query[0] != '\0')
+            strcat(query, " ");
+        strcat(query, token);
+    }
+    list_destroyiter(iter);
+    return query;
+}
+
+/*
+ * Returns the number of distinct queries in the given list.  Queries are
+ * compared token by token, so lines that differ only in spacing count once.
+ */
+static int count_distinct(list_t *queries)
+{
+    set_t *seen = set_create(compare_strings);
+    list_iter_t *iter;
+    set_iter_t *siter;
+    char *query;
+    int n;
+
+    iter = list_createiter(queries);
+    while (list_hasnext(iter))
+    {
+        query = join_tokens(list_next(iter));
+        if (set_contains(seen, query))
+            free(query);
+        else
+            set_add(seen, query);
+    }
+    list_destroyiter(iter);
+
+    n = set_size(seen);
+    siter = set_createiter(seen);
+    while (set_hasnext(siter))
+        free(set_next(siter));
+    set_destroyiter(siter);
+    set_destroy(seen);
+    return n;
+}
+
+/* Sleeps until the given time of the monotonic clock */
+static void wait_until(double deadline)
+{
+    double delay = deadline - perf_now();
+    struct timespec ts;
+
+    if (delay <= 0)
+        return;
+    ts.tv_sec = (time_t)delay;
+    ts.tv_nsec = (long)((delay - ts.tv_sec) * 1e9);
+    nanosleep(&ts, NULL);
+}
+
+/* Runs a single query, returning its number of results or -1 on error */
+static int run_query(index_t *ind, list_t *tokens, int k)
+{
+    char *errmsg, *first = list_popfirst(tokens);
+    list_t *result;
+    int n;
+
+    list_addfirst(tokens, first);
+    if (strncmp(first, LIKE_PREFIX, strlen(LIKE_PREFIX)) == 0)
+        result = index_morelikethis(ind, first + strlen(LIKE_PREFIX), NUM_SIMILAR, &errmsg);
+    else
+        result = index_query_topk(ind, tokens, k, &errmsg);
+
+    if (result == NULL)
+    {
+        free(errmsg);
+        return -1;
+    }
+    n = list_size(result);
+    while (list_size(result) > 0)
+        free(list_popfirst(result));
+    list_destroy(result);
+    return n;
+}
+
+static void usage(char *prog)
+{
+    fprintf(stderr, "Usage: %s [-r rate] [-n passes] [-k results] [-t tier-size] [-o file] <root-dir> <log>\n", prog);
+    fprintf(stderr, "  -r rate       target queries per second (default: as fast as possible)\n");
+    fprintf(stderr, "  -n passes     number of times the log is replayed (default %d)\n", DEFAULT_PASSES);
+    fprintf(stderr, "  -k results    number of results per query (default %d)\n", DEFAULT_RESULTS);
+    fprintf(stderr, "  -t tier-size  build a pruned first tier keeping tier-size postings per term\n");
+    fprintf(stderr, "  -o file       write results to file instead of stdout\n");
+}
+
+int main(int argc, char **argv)
+{
+    int i, opt, n, num_queries, num_distinct, errors = 0, late = 0;
+    int passes = DEFAULT_PASSES, k = DEFAULT_RESULTS, tier_size = 0;
+    long results = 0;
+    double rate = 0, start, scheduled, begin, elapsed, index_time, *latencies;
+    FILE *out = stdout;
+    index_t *ind;
+    list_t *queries, *tokens;
+    list_iter_t *iter;
+
+    while ((opt = getopt(argc, argv, "r:n:k:t:o:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'r':
+            rate = atof(optarg);
+            break;
+        case 'n':
+            passes = atoi(optarg);
+            break;
+        case 'k':
+            k = atoi(optarg);
+            break;
+        case 't':
+            tier_size = atoi(optarg);
+            break;
+        case 'o':
+            out = fopen(optarg, "w");
+            if (out == NULL)
+                fatal_error("Unable to open '%s'", optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind != argc - 2 || passes < 1 || k < 1)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    if (!is_valid_directory(argv[optind]))
+        return 1;
+
+    start = perf_now();
+    ind = build_index(argv[optind]);
+    if (tier_size > 0)
+        index_buildtiers(ind, tier_size);
+    index_time = perf_now() - start;
+
+    queries = read_log(argv[optind + 1]);
+    if (list_size(queries) == 0)
+        fatal_error("No queries in '%s'", argv[optind + 1]);
+    num_distinct = count_distinct(queries);
+
+    num_queries = passes * list_size(queries);
+    latencies = malloc(num_queries * sizeof(double));
+    if (!latencies)
+        fatal_error("out of memory");
+
+    /*
+     * Query i is scheduled at begin + i / rate, and its latency is taken
+     * from that time rather than from when it was issued.  Otherwise a
+     * slow query would delay the ones behind it without their latencies
+     * showing it (coordinated omission).
+     */
+    begin = perf_now();
+    for (i = 0; i < num_queries; i++)
+    {
+        if (i % list_size(queries) == 0)
+            iter = list_createiter(queries);
+        tokens = list_next(iter);
+
+        if (rate > 0)
+        {
+            scheduled = begin + i / rate;
+            if (i > 0 && perf_now() > scheduled)
+                late++;
+            wait_until(scheduled);
+            start = scheduled;
+        }
+        else
+            start = perf_now();
+
+        n = run_query(ind, tokens, k);
+        latencies[i] = perf_now() - start;
+
+        if (n < 0)
+            errors++;
+        else
+            results += n;
+
+        if (!list_hasnext(iter))
+            list_destroyiter(iter);
+    }
+    elapsed = perf_now() - begin;
+
+    qsort(latencies, num_queries, sizeof(double), compare_doubles);
+    fprintf(out, "{\n");
+    fprintf(out, "  \"index\": {\"seconds\": %.4f, \"tier_size\": %d},\n", index_time, tier_size);
+    fprintf(out, "  \"replay\": {\"queries\": %d, \"distinct\": %d, \"errors\": %d, \"late\": %d, "
+                 "\"mean_results\": %.1f, \"target_qps\": %.1f, \"qps\": %.1f, \"seconds\": %.4f},\n",
+            num_queries, num_distinct, errors, late, (double)results / num_queries,
+            rate, num_queries / elapsed, elapsed);
+    fprintf(out, "  \"latency_us\": {\"p50\": %.2f, \"p90\": %.2f, \"p99\": %.2f, \"p999\": %.2f, \"max\": %.2f}\n",
+            percentile(latencies, num_queries, 50) * 1e6,
+            percentile(latencies, num_queries, 90) * 1e6,
+            percentile(latencies, num_queries, 99) * 1e6,
+            percentile(latencies, num_queries, 99.9) * 1e6,
+            latencies[num_queries - 1] * 1e6);
+    fprintf(out, "}\n");
+
+    if (out != stdout)
+        fclose(out);
+
+    while (list_size(queries) > 0)
+    {
+        tokens = list_popfirst(queries);
+        while (list_size(tokens) > 0)
+            free(list_popfirst(tokens));
+        list_destroy(tokens);
+    }
+    list_destroy(queries);
+    free(latencies);
+    index_destroy(ind);
+
+    return 0;
+}
@@ -27,6 +27,12 @@ void set_destroy(set_t *set);
  */
 int set_size(set_t *set);
 
+/*
+ * Returns the number of bytes allocated by the given set for its own
+ * structure, not counting the elements.
+ */
+size_t set_bytes(set_t *set);
+
 /*
  * Adds the given element to the given set.
  */
@@ -59,6 +65,54 @@ set_t *set_intersection(set_t *a, set_t *b);
  */
 set_t *set_difference(set_t *a, set_t *b);
 
+/*
+ * The type of cancellation functions of set operations.  While merging,
+ * a set operation calls the function with the number of elements it
+ * has visited since the previous call, every 'SET_CANCEL_INTERVAL'
+ * elements and when done.  If the function returns nonzero, the
+ * operation gives up and returns NULL.
+ */
+typedef int (*set_cancelfunc_t)(void *arg, long visited);
+
+#define SET_CANCEL_INTERVAL 1024
+
+/*
+ * Like set_union(), set_intersection() and set_difference(), but
+ * cooperatively cancellable through the given cancellation function.
+ * Returns NULL if the operation was cancelled.
+ */
+set_t *set_union_cancel(set_t *a, set_t *b, set_cancelfunc_t cancel, void *arg);
+set_t *set_intersection_cancel(set_t *a, set_t *b, set_cancelfunc_t cancel, void *arg);
+set_t *set_difference_cancel(set_t *a, set_t *b, set_cancelfunc_t cancel, void *arg);
+
+/*
+ * Like set_union_cancel(), set_intersection_cancel() and
+ * set_difference_cancel(), but only merging the elements that are at
+ * least 'lo' and less than 'hi'.  A NULL bound leaves that end of the
+ * range open.  Disjoint ranges of a large merge may thus be merged on
+ * different threads, and joined with set_concat().
+ */
+set_t *set_union_range(set_t *a, set_t *b, void *lo, void *hi,
+                       set_cancelfunc_t cancel, void *arg);
+set_t *set_intersection_range(set_t *a, set_t *b, void *lo, void *hi,
+                              set_cancelfunc_t cancel, void *arg);
+set_t *set_difference_range(set_t *a, set_t *b, void *lo, void *hi,
+                            set_cancelfunc_t cancel, void *arg);
+
+/*
+ * Stores at most 'n' elements of the given set in 'pivots', in sorted
+ * order, dividing the set into ranges of roughly equal size.  Returns
+ * the number of elements stored.
+ */
+int set_pivots(set_t *set, void **pivots, int n);
+
+/*
+ * Joins the 'n' given sets into one, and destroys them.  The elements
+ * of each set must be less than those of the sets following it.  The
+ * nodes of the given sets are reused, so no elements are copied.
+ */
+set_t *set_concat(set_t **sets, int n);
+
 /*
  * Returns a copy of the given set.
  */
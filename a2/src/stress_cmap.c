@@ -0,0 +1,275 @@
+/*
+ * Concurrent map stress test.
+ *
+ * Runs threads that insert, look up and remove keys of the same
+ * concurrent map at once, while its segments grow, and checks the
+ * contents of the map afterwards.  Every thread inserts a range of keys
+ * of its own, looks up the keys of the other threads, and races the
+ * other threads to insert a set of shared keys, of which exactly one
+ * insert must win.  The throughput of inserts and lookups is compared
+ * with that of the hashmap behind a single mutex.  Exits with an error
+ * on any mismatch.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "common.h"
+#include "cmap.h"
+#include "map.h"
+#include "perf.h"
+
+#define DEFAULT_KEYS (100000)
+#define DEFAULT_THREADS (8)
+
+/* Keys inserted by every thread */
+#define NUM_SHARED (1000)
+
+typedef struct worker
+{
+    pthread_t thread;
+    int id;
+    int numthreads;
+    int numkeys;           /* Keys per thread */
+    char **keys;           /* The keys of all threads, thread i owning keys [i * numkeys, (i + 1) * numkeys) */
+    char **shared;
+    void **winners;        /* The value each shared key mapped to, as seen by this thread */
+    cmap_t *cmap;
+    map_t *map;            /* Used instead of 'cmap' by the single mutex baseline */
+    pthread_mutex_t *lock;
+    int errors;
+} worker_t;
+
+static char **generate_keys(char *prefix, int n)
+{
+    char **keys = malloc(n * sizeof(char *));
+    char buf[64];
+    int i;
+
+    if (keys == NULL)
+        fatal_error("out of memory");
+    for (i = 0; i < n; i++)
+    {
+        snprintf(buf, sizeof(buf), "%s%d", prefix, i);
+        keys[i] = strdup(buf);
+    }
+    return keys;
+}
+
+/* Inserts the worker's own keys and the shared keys, looking up other keys meanwhile */
+static void *insert_main(void *arg)
+{
+    worker_t *w = arg;
+    char **own = w->keys + w->id * w->numkeys;
+    char *other;
+    void *value;
+    int i, s;
+
+    for (i = 0; i < w->numkeys; i++)
+    {
+        cmap_put(w->cmap, own[i], own[i]);
+
+        /* A key of another thread maps to itself once inserted */
+        other = w->keys[(i * 7919L) % ((long)w->numthreads * w->numkeys)];
+        value = cmap_tryget(w->cmap, other);
+        if (value != NULL && value != other)
+            w->errors++;
+
+        if (i % (w->numkeys / NUM_SHARED + 1) == 0)
+        {
+            s = (i / (w->numkeys / NUM_SHARED + 1) + w->id) % NUM_SHARED;
+            w->winners[s] = cmap_get_or_insert(w->cmap, w->shared[s], w);
+        }
+    }
+    for (s = 0; s < NUM_SHARED; s++)
+    {
+        if (w->winners[s] == NULL)
+            w->winners[s] = cmap_get_or_insert(w->cmap, w->shared[s], w);
+    }
+    return NULL;
+}
+
+/* Removes every other key of the worker's own, looking up the rest meanwhile */
+static void *remove_main(void *arg)
+{
+    worker_t *w = arg;
+    char **own = w->keys + w->id * w->numkeys;
+    int i;
+
+    for (i = 0; i < w->numkeys; i++)
+    {
+        if (i % 2 == 0)
+            w->errors += cmap_remove(w->cmap, own[i], NULL, NULL) != 1;
+        else
+            w->errors += cmap_tryget(w->cmap, own[i]) != own[i];
+    }
+    return NULL;
+}
+
+/* Like insert_main(), without the shared keys, on a hashmap guarded by one mutex */
+static void *locked_main(void *arg)
+{
+    worker_t *w = arg;
+    char **own = w->keys + w->id * w->numkeys;
+    char *other;
+    void *value;
+    int i;
+
+    for (i = 0; i < w->numkeys; i++)
+    {
+        pthread_mutex_lock(w->lock);
+        map_put(w->map, own[i], own[i]);
+        pthread_mutex_unlock(w->lock);
+
+        other = w->keys[(i * 7919L) % ((long)w->numthreads * w->numkeys)];
+        pthread_mutex_lock(w->lock);
+        value = map_tryget(w->map, other);
+        pthread_mutex_unlock(w->lock);
+        if (value != NULL && value != other)
+            w->errors++;
+    }
+    return NULL;
+}
+
+/* Runs 'fn' on all workers at once, returning the elapsed time */
+static double run_workers(worker_t *workers, int numthreads, void *(*fn)(void *))
+{
+    double start = perf_now();
+    int i;
+
+    for (i = 0; i < numthreads; i++)
+    {
+        if (pthread_create(&workers[i].thread, NULL, fn, &workers[i]) != 0)
+            fatal_error("Unable to create thread");
+    }
+    for (i = 0; i < numthreads; i++)
+        pthread_join(workers[i].thread, NULL);
+    return perf_now() - start;
+}
+
+/*
+ * Runs the test with the given number of threads, and prints the
+ * throughput of the concurrent map and of the single mutex map.
+ */
+static void stress(char **keys, char **shared, int numthreads, int numkeys)
+{
+    worker_t *workers = calloc(numthreads, sizeof(worker_t));
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    cmap_t *cmap = cmap_create(compare_strings, hash_string);
+    map_t *map = map_create(compare_strings, hash_string);
+    double inserted, locked;
+    void *winner;
+    int i, s, kept, total = numthreads * numkeys;
+
+    if (workers == NULL)
+        fatal_error("out of memory");
+    for (i = 0; i < numthreads; i++)
+    {
+        workers[i] = (worker_t){.id = i, .numthreads = numthreads, .numkeys = numkeys, .keys = keys,
+                                .shared = shared, .cmap = cmap, .map = map, .lock = &lock};
+        workers[i].winners = calloc(NUM_SHARED, sizeof(void *));
+        if (workers[i].winners == NULL)
+            fatal_error("out of memory");
+    }
+
+    inserted = run_workers(workers, numthreads, insert_main);
+    if (cmap_size(cmap) != total + NUM_SHARED)
+        fatal_error("Map has %d keys, expected %d", cmap_size(cmap), total + NUM_SHARED);
+    for (i = 0; i < total; i++)
+    {
+        if (cmap_get(cmap, keys[i]) != keys[i])
+            fatal_error("Key '%s' has the wrong value", keys[i]);
+    }
+    for (s = 0; s < NUM_SHARED; s++)
+    {
+        /* Every thread saw the value of the one thread whose insert won */
+        winner = cmap_get(cmap, shared[s]);
+        for (i = 0; i < numthreads; i++)
+        {
+            if (workers[i].winners[s] != winner)
+                fatal_error("Threads disagree on shared key '%s'", shared[s]);
+        }
+    }
+
+    run_workers(workers, numthreads, remove_main);
+    kept = numthreads * (numkeys / 2);
+    if (cmap_size(cmap) != kept + NUM_SHARED)
+        fatal_error("Map has %d keys after removal, expected %d", cmap_size(cmap), kept + NUM_SHARED);
+    for (i = 0; i < total; i++)
+    {
+        if (cmap_tryget(cmap, keys[i]) != ((i % numkeys) % 2 ? keys[i] : NULL))
+            fatal_error("Key '%s' has the wrong value after removal", keys[i]);
+    }
+
+    locked = run_workers(workers, numthreads, locked_main);
+    if (map_size(map) != total)
+        fatal_error("Locked map has %d keys, expected %d", map_size(map), total);
+
+    for (i = 0; i < numthreads; i++)
+    {
+        if (workers[i].errors != 0)
+            fatal_error("Thread %d saw %d wrong results", i, workers[i].errors);
+        free(workers[i].winners);
+    }
+    /* An insert and a lookup per key */
+    printf("%d threads: %.2f M ops/s, single mutex hashmap %.2f M ops/s\n", numthreads,
+           2 * total / inserted / 1e6, 2 * total / locked / 1e6);
+
+    cmap_destroy(cmap, NULL, NULL);
+    map_destroy(map, NULL, NULL);
+    free(workers);
+}
+
+static void usage(char *prog)
+{
+    fprintf(stderr, "Usage: %s [-n keys] [-t threads]\n", prog);
+    fprintf(stderr, "  -n keys     keys inserted by each thread (default %d)\n", DEFAULT_KEYS);
+    fprintf(stderr, "  -t threads  largest number of threads (default %d)\n", DEFAULT_THREADS);
+}
+
+int main(int argc, char **argv)
+{
+    int i, opt, threads, numkeys = DEFAULT_KEYS, maxthreads = DEFAULT_THREADS;
+    char **keys, **shared;
+
+    while ((opt = getopt(argc, argv, "n:t:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            numkeys = atoi(optarg);
+            break;
+        case 't':
+            maxthreads = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc || numkeys < 1 || maxthreads < 1)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    keys = generate_keys("key", maxthreads * numkeys);
+    shared = generate_keys("shared", NUM_SHARED);
+
+    printf("Running concurrent map stress test\n");
+    for (threads = 1; threads <= maxthreads; threads *= 2)
+        stress(keys, shared, threads, numkeys);
+    printf("Success!\n");
+
+    for (i = 0; i < maxthreads * numkeys; i++)
+        free(keys[i]);
+    for (i = 0; i < NUM_SHARED; i++)
+        free(shared[i]);
+    free(keys);
+    free(shared);
+
+    return 0;
+}
@@ -0,0 +1,254 @@
+#include "workpool.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define DEQUE_INITIAL_SIZE 64
+
+/*
+ * A queue of tasks.  The owning thread pushes and pops tasks at the
+ * tail, while other threads steal tasks from the head.
+ */
+typedef struct deque
+{
+    pthread_mutex_t lock;
+    workpool_task_t **tasks;
+    int head;
+    int tail;
+    int capacity;
+} deque_t;
+
+struct workpool
+{
+    int numthreads;
+    pthread_t *threads;
+    deque_t *deques;        /* One per thread, plus one for other threads */
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t progress; /* Signalled when a task is submitted or finishes */
+    int pending;            /* Tasks queued but not yet taken; briefly
+                               negative while a task is being submitted */
+    int shutdown;
+};
+
+/* The pool and deque of the calling thread, if it is a pool thread */
+static __thread workpool_t *current_pool;
+static __thread int current_deque;
+
+static int own_deque(workpool_t *pool)
+{
+    return current_pool == pool ? current_deque : pool->numthreads;
+}
+
+static void deque_push(deque_t *deque, workpool_task_t *task)
+{
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail == deque->capacity)
+    {
+        if (deque->head > 0)
+        {
+            /* Reclaim the space of stolen tasks */
+            memmove(deque->tasks, deque->tasks + deque->head,
+                    (deque->tail - deque->head) * sizeof(workpool_task_t *));
+            deque->tail -= deque->head;
+            deque->head = 0;
+        }
+        else
+        {
+            deque->capacity *= 2;
+            deque->tasks = realloc(deque->tasks, deque->capacity * sizeof(workpool_task_t *));
+            if (deque->tasks == NULL)
+                fatal_error("out of memory");
+        }
+    }
+    deque->tasks[deque->tail++] = task;
+    pthread_mutex_unlock(&deque->lock);
+}
+
+/* Takes the newest task if 'own' is nonzero, or else the oldest task */
+static workpool_task_t *deque_take(deque_t *deque, int own)
+{
+    workpool_task_t *task = NULL;
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail > deque->head)
+    {
+        task = own ? deque->tasks[--deque->tail] : deque->tasks[deque->head++];
+        if (deque->head == deque->tail)
+            deque->head = deque->tail = 0;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return task;
+}
+
+/* Takes a task from the given deque, or steals one from another deque */
+static workpool_task_t *find_task(workpool_t *pool, int self)
+{
+    workpool_task_t *task;
+    int i, n = pool->numthreads + 1;
+
+    task = deque_take(&pool->deques[self], 1);
+    for (i = 1; task == NULL && i < n; i++)
+        task = deque_take(&pool->deques[(self + i) % n], 0);
+
+    if (task != NULL)
+    {
+        pthread_mutex_lock(&pool->lock);
+        pool->pending--;
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return task;
+}
+
+static void run_task(workpool_t *pool, workpool_task_t *task)
+{
+    task->fn(task->arg);
+
+    pthread_mutex_lock(&pool->lock);
+    __atomic_store_n(&task->done, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&pool->progress);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void *worker_main(void *arg)
+{
+    workpool_t *pool = arg;
+    workpool_task_t *task;
+    int self;
+
+    /* Wait for workpool_create() to record all threads */
+    pthread_mutex_lock(&pool->lock);
+    for (self = 0; !pthread_equal(pool->threads[self], pthread_self()); self++)
+        ;
+    pthread_mutex_unlock(&pool->lock);
+    current_pool = pool;
+    current_deque = self;
+
+    while (1)
+    {
+        task = find_task(pool, self);
+        if (task != NULL)
+        {
+            run_task(pool, task);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        while (pool->pending <= 0 && !pool->shutdown)
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        if (pool->pending <= 0 && pool->shutdown)
+        {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return NULL;
+}
+
+workpool_t *workpool_create(int threads)
+{
+    workpool_t *pool = calloc(1, sizeof(workpool_t));
+    int i;
+
+    if (pool == NULL)
+        fatal_error("out of memory");
+    if (threads < 1)
+        threads = 1;
+
+    pool->numthreads = threads;
+    pool->threads = calloc(threads, sizeof(pthread_t));
+    pool->deques = calloc(threads + 1, sizeof(deque_t));
+    if (pool->threads == NULL || pool->deques == NULL)
+        fatal_error("out of memory");
+
+    for (i = 0; i <= threads; i++)
+    {
+        pthread_mutex_init(&pool->deques[i].lock, NULL);
+        pool->deques[i].capacity = DEQUE_INITIAL_SIZE;
+        pool->deques[i].tasks = malloc(DEQUE_INITIAL_SIZE * sizeof(workpool_task_t *));
+        if (pool->deques[i].tasks == NULL)
+            fatal_error("out of memory");
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->progress, NULL);
+
+    /* Threads find their deque by their position in 'threads' */
+    pthread_mutex_lock(&pool->lock);
+    for (i = 0; i < threads; i++)
+    {
+        if (pthread_create(&pool->threads[i], NULL, worker_main, pool) != 0)
+            fatal_error("Unable to create pool thread");
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return pool;
+}
+
+void workpool_destroy(workpool_t *pool)
+{
+    int i;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < pool->numthreads; i++)
+        pthread_join(pool->threads[i], NULL);
+
+    for (i = 0; i <= pool->numthreads; i++)
+    {
+        pthread_mutex_destroy(&pool->deques[i].lock);
+        free(pool->deques[i].tasks);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->wake);
+    pthread_cond_destroy(&pool->progress);
+    free(pool->deques);
+    free(pool->threads);
+    free(pool);
+}
+
+int workpool_size(workpool_t *pool)
+{
+    return pool->numthreads;
+}
+
+void workpool_submit(workpool_t *pool, workpool_task_t *task, void (*fn)(void *), void *arg)
+{
+    task->fn = fn;
+    task->arg = arg;
+    task->done = 0;
+    deque_push(&pool->deques[own_deque(pool)], task);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->pending++;
+    pthread_cond_signal(&pool->wake);
+    pthread_cond_broadcast(&pool->progress);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void workpool_wait(workpool_t *pool, workpool_task_t *task)
+{
+    workpool_task_t *other;
+    int self = own_deque(pool);
+
+    while (!__atomic_load_n(&task->done, __ATOMIC_ACQUIRE))
+    {
+        other = find_task(pool, self);
+        if (other != NULL)
+        {
+            run_task(pool, other);
+            continue;
+        }
+
+        /* The task is running on another thread; sleep until it or another task is done */
+        pthread_mutex_lock(&pool->lock);
+        while (!__atomic_load_n(&task->done, __ATOMIC_ACQUIRE) && pool->pending <= 0)
+            pthread_cond_wait(&pool->progress, &pool->lock);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
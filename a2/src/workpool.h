@@ -0,0 +1,57 @@
+#ifndef WORKPOOL_H
+#define WORKPOOL_H
+
+#include "common.h"
+
+/*
+ * The type of work pools.  A work pool runs tasks on a fixed set of
+ * threads.  Each thread keeps its own queue of tasks, taking the most
+ * recently submitted task from its own queue and, when that is empty,
+ * stealing the oldest task from the queue of another thread.
+ *
+ * Tasks may submit and wait for further tasks.  A thread waiting for a
+ * task runs other tasks in the meantime, so nested waits never block
+ * the pool, and sleeps while there are no other tasks to run.
+ */
+struct workpool;
+typedef struct workpool workpool_t;
+
+/*
+ * A task submitted to a work pool.  The task is owned by the submitter,
+ * and must stay valid until workpool_wait() returns.
+ */
+typedef struct workpool_task
+{
+    void (*fn)(void *arg);
+    void *arg;
+    int done;
+} workpool_task_t;
+
+/*
+ * Creates a work pool with the given number of threads.
+ */
+workpool_t *workpool_create(int threads);
+
+/*
+ * Destroys the given work pool.  There must be no unfinished tasks.
+ */
+void workpool_destroy(workpool_t *pool);
+
+/*
+ * Returns the number of threads of the given work pool.
+ */
+int workpool_size(workpool_t *pool);
+
+/*
+ * Submits a task running fn(arg) to the given work pool.
+ */
+void workpool_submit(workpool_t *pool, workpool_task_t *task, void (*fn)(void *), void *arg);
+
+/*
+ * Waits for the given task to finish, running other tasks meanwhile.
+ * While the task runs on another thread and no other task is queued,
+ * the caller sleeps.
+ */
+void workpool_wait(workpool_t *pool, workpool_task_t *task);
+
+#endif
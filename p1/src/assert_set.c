@@ -1,5 +1,6 @@
 /* Author: Magnus Stenhaug <magnus.stenhaug@uit.no> */
 #include "set.h"
+#include "template.h"
 #include <stdlib.h>
 
 /* 
@@ -347,6 +348,240 @@ void validate_set_operations(unsigned int seed)
 	delete_generated_set(testset);
 }
 
+SET_DEFINE(intset, int, SCALAR_CMP)
+LIST_DEFINE(intlist, int, SCALAR_CMP)
+MAP_DEFINE(intmap, int, int, SCALAR_CMP, SCALAR_HASH)
+
+/*
+ * Returns 1 if the given intset holds the same ints as the given set,
+ * in the same order, 0 otherwise
+ */
+
+int same_elements(intset_t *a, set_t *b)
+{
+	intset_iter_t iter;
+	set_iter_t *biter;
+	int same;
+	
+	if(intset_size(a) != set_size(b))
+		return 0;
+	
+	same = 1;
+	iter = intset_createiter(a);
+	biter = set_createiter(b);
+	while(intset_hasnext(&iter))
+	{
+		if(intset_next(&iter) != *(int *)set_next(biter))
+			same = 0;
+	}
+	set_destroyiter(biter);
+	
+	return same;
+}
+
+/*
+ * Validates the type-specialized intset against the generic set
+ */
+
+void validate_intset(unsigned int seed)
+{
+	set_t *testset, *a, *b, *res;
+	intset_t *ia, *ib, *ires;
+	set_iter_t *iter;
+	int i, elem;
+	
+	testset = generate_set(seed, TEST_SET_SIZE);
+	a = set_create(compare_ints);
+	b = set_create(compare_ints);
+	split_set(testset, a, b);
+	
+	/* Adding the same random numbers as generate_set(), duplicates included */
+	ires = intset_create();
+	for(i = 0; i < TEST_SET_SIZE; i++)
+		intset_add(ires, rand_r(&seed) % TEST_MODULUS);
+	if(!same_elements(ires, testset))
+		fatal_error("intset differs from set, check intset_add");
+	intset_destroy(ires);
+	
+	ia = intset_create();
+	ib = intset_create();
+	iter = set_createiter(a);
+	while(set_hasnext(iter))
+		intset_add(ia, *(int *)set_next(iter));
+	set_destroyiter(iter);
+	iter = set_createiter(b);
+	while(set_hasnext(iter))
+		intset_add(ib, *(int *)set_next(iter));
+	set_destroyiter(iter);
+	
+	res = set_union(a, b);
+	ires = intset_union(ia, ib);
+	if(!same_elements(ires, res))
+		fatal_error("intset union differs from set union");
+	set_destroy(res);
+	intset_destroy(ires);
+	
+	res = set_intersection(a, b);
+	ires = intset_intersection(ia, ib);
+	if(!same_elements(ires, res))
+		fatal_error("intset intersection differs from set intersection");
+	set_destroy(res);
+	intset_destroy(ires);
+	
+	res = set_difference(a, b);
+	ires = intset_difference(ia, ib);
+	if(!same_elements(ires, res))
+		fatal_error("intset difference differs from set difference");
+	set_destroy(res);
+	intset_destroy(ires);
+	
+	/* Validating contains, and the copy */
+	ires = intset_copy(ia);
+	iter = set_createiter(testset);
+	while(set_hasnext(iter))
+	{
+		elem = *(int *)set_next(iter);
+		if(intset_contains(ires, elem) != set_contains(a, &elem))
+			fatal_error("intset_contains differs from set_contains");
+	}
+	set_destroyiter(iter);
+	intset_destroy(ires);
+	
+	intset_destroy(ia);
+	intset_destroy(ib);
+	set_destroy(a);
+	set_destroy(b);
+	delete_generated_set(testset);
+}
+
+/*
+ * Validates the type-specialized intlist, adding at both ends so that
+ * the ring buffer wraps around while it grows
+ */
+
+void validate_intlist(unsigned int seed)
+{
+	intlist_t *list;
+	intlist_iter_t iter;
+	int i, n, val, prev, *expected;
+	
+	n = 10 * TEST_SET_SIZE;
+	expected = malloc(2 * n * sizeof(int));
+	list = intlist_create();
+	
+	/* Element i of 'expected' is at position i - n, once the list is built */
+	for(i = 0; i < n; i++)
+	{
+		val = rand_r(&seed) % TEST_MODULUS;
+		if(i % 3 == 0)
+		{
+			intlist_addlast(list, val);
+			expected[n + intlist_size(list) - 1] = val;
+		}
+		else
+		{
+			intlist_addfirst(list, val);
+			expected[n - 1] = val;
+			memmove(&expected[n], &expected[n - 1], intlist_size(list) * sizeof(int));
+		}
+	}
+	if(intlist_size(list) != n)
+		fatal_error("intlist has the wrong size, check intlist_addfirst and intlist_addlast");
+	for(i = 0; i < n; i++)
+	{
+		if(intlist_get(list, i) != expected[n + i])
+			fatal_error("intlist has the wrong order, check intlist_addfirst and intlist_addlast");
+	}
+	if(!intlist_contains(list, expected[n + n / 2]) || intlist_contains(list, TEST_MODULUS))
+		fatal_error("intlist_contains is not correct");
+	
+	/* Pop from both ends, which also leaves the elements wrapped around */
+	if(intlist_popfirst(list) != expected[n] || intlist_poplast(list) != expected[2 * n - 1])
+		fatal_error("intlist_popfirst or intlist_poplast is not correct");
+	for(i = 0; i < 7; i++)
+		intlist_addlast(list, intlist_popfirst(list));
+	
+	intlist_sort(list);
+	if(intlist_size(list) != n - 2)
+		fatal_error("intlist_sort changed the size of the list");
+	iter = intlist_createiter(list);
+	prev = -1;
+	while(intlist_hasnext(&iter))
+	{
+		val = intlist_next(&iter);
+		if(val < prev)
+			fatal_error("intlist is not sorted, check intlist_sort");
+		prev = val;
+	}
+	
+	while(intlist_size(list) > 0)
+		intlist_poplast(list);
+	intlist_destroy(list);
+	free(expected);
+}
+
+/*
+ * Validates the type-specialized intmap, with enough keys to resize
+ * it several times
+ */
+
+void validate_intmap(unsigned int seed)
+{
+	intmap_t *map;
+	intmap_iter_t iter;
+	int i, n, key, value, *count;
+	
+	n = 20 * TEST_SET_SIZE;
+	count = calloc(n, sizeof(int));
+	map = intmap_create();
+	
+	/* Keys are counted, so that a repeated key must overwrite its value */
+	for(i = 0; i < 2 * n; i++)
+	{
+		key = rand_r(&seed) % n;
+		count[key]++;
+		intmap_put(map, key, count[key]);
+	}
+	
+	for(i = 0, value = 0; i < n; i++)
+	{
+		if(count[i] == 0)
+		{
+			if(intmap_haskey(map, i) || intmap_lookup(map, i) != NULL)
+				fatal_error("intmap contains a key that was never added");
+			continue;
+		}
+		value++;
+		if(!intmap_haskey(map, i) || intmap_get(map, i) != count[i])
+			fatal_error("intmap has the wrong value, check intmap_put and intmap_get");
+	}
+	if(intmap_size(map) != value)
+		fatal_error("intmap has the wrong size");
+	
+	/* Every key once, through the iterator */
+	iter = intmap_createiter(map);
+	while(intmap_hasnext(&iter))
+	{
+		key = intmap_next(&iter, &value);
+		if(key < 0 || key >= n || count[key] != value)
+			fatal_error("intmap iterator returned a wrong key or value");
+		count[key] = 0;
+	}
+	for(i = 0; i < n; i++)
+	{
+		if(count[i] != 0)
+			fatal_error("intmap iterator missed a key");
+	}
+	
+	/* Values are updated in place through intmap_lookup */
+	*intmap_lookup(map, key) = -1;
+	if(intmap_get(map, key) != -1)
+		fatal_error("intmap_lookup does not point to the value");
+	
+	intmap_destroy(map);
+	free(count);
+}
+
 int main(int argc, char **argv)
 {
 	int i;
@@ -374,6 +609,19 @@ int main(int argc, char **argv)
 	for(i = 0; i < TEST_RUNS; i++)
 		validate_set_operations(i);
 	
+	/* Validating the type-specialized set */
+	printf("Validating intset against set...\n");
+	for(i = 0; i < TEST_RUNS; i++)
+		validate_intset(i);
+	
+	/* Validating the type-specialized list and map */
+	printf("Validating intlist and intmap...\n");
+	for(i = 0; i < TEST_RUNS; i++)
+	{
+		validate_intlist(i);
+		validate_intmap(i);
+	}
+	
 	return 0;
 }
 
@@ -1,86 +1,64 @@
 /* Author: Steffen Viken Valvaag <steffenv@cs.uit.no> */
-#include "set.h"
+#include "template.h"
 #include <stdlib.h>
-/* Author: Steffen Viken Valvaag <steffenv@cs.uit.no> */
-static int compare_ints(void *a, void *b)
-{
-    int *ia = a;
-    int *ib = b;
-
-    return (*ia)-(*ib);
-}
 
-static void *newint(int i)
-{
-    int *p = malloc(sizeof(int));
-    *p = i;
-    return p;
-}
+SET_DEFINE(intset, int, SCALAR_CMP)
 
 /*
  * Print a set of int elements.
  */
-static void printset(char *prefix, set_t *set)
+static void printset(char *prefix, intset_t *set)
 {
-    set_iter_t *it;
+    intset_iter_t it;
 
     printf("%s", prefix);
-    it = set_createiter(set);
-    while (set_hasnext(it)) {
-	    int *p = set_next(it);
-	    printf(" %d", *p);
+    it = intset_createiter(set);
+    while (intset_hasnext(&it)) {
+	    printf(" %d", intset_next(&it));
     }
     printf("\n");
-    set_destroyiter(it);
 }
 
 /*
  * Print a set of int elements, then destroy it.
  */
-static void dumpset(char *prefix, set_t *set)
+static void dumpset(char *prefix, intset_t *set)
 {
     printset(prefix, set);
-    set_destroy(set);
+    intset_destroy(set);
 }
 
 int main(int argc, char **argv)
 {
-    set_t *all, *evens, *odds, *nonprimes, *primes;
+    intset_t *all, *evens, *odds, *nonprimes, *primes;
     int i, j, n = 50;
-    int **numbers;
-
-    /* Allocate numbers from 0 to n */
-    numbers = (int **) malloc(sizeof(int*) * (n+1));
-    for (i = 0; i <= n; i++) {
-	    numbers[i] = newint(i);
-    }
 
     /* Create sets */
-    all = set_create(compare_ints);
-    evens = set_create(compare_ints);
-    odds = set_create(compare_ints);
-    nonprimes = set_create(compare_ints);
-    primes = set_create(compare_ints);
+    all = intset_create();
+    evens = intset_create();
+    odds = intset_create();
+    nonprimes = intset_create();
+    primes = intset_create();
 
     /* Initialize sets */
     for (i = 0; i <= n; i++) {
-		set_add(all, numbers[i]);
+		intset_add(all, i);
 	    if (i % 2 == 0) {
-	        set_add(evens, numbers[i]);
+	        intset_add(evens, i);
 	    }
 	    else {
-	        set_add(odds, numbers[i]);
+	        intset_add(odds, i);
 	    }
         if (i < 2) {
-            set_add(nonprimes, numbers[i]);
+            intset_add(nonprimes, i);
         }
         else {
 	        for (j = i+i; j <= n; j += i) {
-	            set_add(nonprimes, numbers[j]);
+	            intset_add(nonprimes, j);
 	        }
         }
-	    if (!set_contains(nonprimes, numbers[i])) {
-	        set_add(primes, numbers[i]);
+	    if (!intset_contains(nonprimes, i)) {
+	        intset_add(primes, i);
 	    }
     }
 
@@ -92,33 +70,28 @@ int main(int argc, char **argv)
     printset("Prime numbers:", primes);
 
     /* Test unions */
-    dumpset("Even or odd numbers:", set_union(evens, odds));
-    dumpset("Prime or non-prime numbers:", set_union(primes, nonprimes));
-    dumpset("Even or prime numbers:", set_union(evens, primes));
-    dumpset("Odd or prime numbers:", set_union(odds, primes));
+    dumpset("Even or odd numbers:", intset_union(evens, odds));
+    dumpset("Prime or non-prime numbers:", intset_union(primes, nonprimes));
+    dumpset("Even or prime numbers:", intset_union(evens, primes));
+    dumpset("Odd or prime numbers:", intset_union(odds, primes));
 
     /* Test intersections */
-    dumpset("Even and odd numbers:", set_intersection(evens, odds));
-    dumpset("Even non-prime numbers:", set_intersection(evens, nonprimes));
-    dumpset("Odd non-prime numbers:", set_intersection(odds, nonprimes));
-    dumpset("Odd prime numbers:", set_intersection(odds, primes));
-    dumpset("Even prime numbers:", set_intersection(evens, primes));
+    dumpset("Even and odd numbers:", intset_intersection(evens, odds));
+    dumpset("Even non-prime numbers:", intset_intersection(evens, nonprimes));
+    dumpset("Odd non-prime numbers:", intset_intersection(odds, nonprimes));
+    dumpset("Odd prime numbers:", intset_intersection(odds, primes));
+    dumpset("Even prime numbers:", intset_intersection(evens, primes));
 
     /* Test differences */
-    dumpset("Even non-prime numbers:", set_difference(evens, primes));
-    dumpset("Odd non-prime numbers:", set_difference(odds, primes));
-    dumpset("Even prime numbers:", set_difference(evens, nonprimes));
-    dumpset("Odd prime numbers:", set_difference(odds, nonprimes));
+    dumpset("Even non-prime numbers:", intset_difference(evens, primes));
+    dumpset("Odd non-prime numbers:", intset_difference(odds, primes));
+    dumpset("Even prime numbers:", intset_difference(evens, nonprimes));
+    dumpset("Odd prime numbers:", intset_difference(odds, nonprimes));
 
     /* Cleanup */
-    set_destroy(all);
-    set_destroy(evens);
-    set_destroy(odds);
-    set_destroy(nonprimes);
-    set_destroy(primes);
-
-    for (i = 0; i <= n; i++) {
-	    free(numbers[i]);
-    }
-    free(numbers);
+    intset_destroy(all);
+    intset_destroy(evens);
+    intset_destroy(odds);
+    intset_destroy(nonprimes);
+    intset_destroy(primes);
 }
@@ -0,0 +1,597 @@
+#ifndef TEMPLATE_H
+#define TEMPLATE_H
+
+#include "common.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Type-specialized lists, sets and maps.
+ *
+ * The macros below generate a container type and its operations for a
+ * given element type, alongside the generic list_t and set_t.  Elements
+ * are stored by value in arrays, rather than as pointers to separately
+ * allocated elements, and the comparison function is called directly
+ * rather than through a cmpfunc_t.  For example,
+ *
+ *     SET_DEFINE(intset, int, SCALAR_CMP)
+ *
+ * defines the type intset_t, with operations intset_create(),
+ * intset_add(), intset_contains() and so on, which take and return ints.
+ *
+ * The comparison argument 'cmp' is the name of a function or of a
+ * function-like macro taking two elements, and returning a negative
+ * number, 0 or a positive number like cmpfunc_t.  A macro such as
+ * SCALAR_CMP is expanded in place, so comparisons cost no call at all.
+ * Likewise, the hash argument 'hash' of MAP_DEFINE takes a key and
+ * returns an unsigned long.
+ *
+ * All operations are static inline functions, so a container may be
+ * defined in every file that uses it.
+ */
+
+/*
+ * Compares two numbers of any scalar type.
+ */
+#define SCALAR_CMP(a, b) (((a) > (b)) - ((a) < (b)))
+
+/*
+ * Hashes an integer of up to 64 bits, spreading it over the high bits
+ * and folding them back down, so that consecutive keys do not share
+ * their low bits.
+ */
+#define SCALAR_HASH(k) ((unsigned long)(((unsigned long long)(k) * 0x9e3779b97f4a7c15ULL) >> 32))
+
+/* Capacity of a container when the first element is added */
+#define TEMPLATE_MIN_CAPACITY 8
+
+/*
+ * Defines a list of elements of the given type, named 'name'.  The list
+ * is a growable ring buffer, so elements are added and removed at both
+ * ends in constant time.  Defines:
+ *
+ *   name_t           The type of lists
+ *   name_create()    Creates a new, empty list
+ *   name_destroy(l)  Destroys the given list
+ *   name_size(l)     Returns the number of elements in the list
+ *   name_addfirst(l, e), name_addlast(l, e)
+ *                    Adds an element at the start or end of the list
+ *   name_popfirst(l), name_poplast(l)
+ *                    Removes and returns the first or last element
+ *   name_get(l, i)   Returns the i'th element of the list
+ *   name_contains(l, e)
+ *                    Returns 1 if the list contains the element, 0 otherwise
+ *   name_sort(l)     Sorts the list in ascending order
+ *   name_iter_t      The type of list iterators, which need not be destroyed
+ *   name_createiter(l), name_hasnext(&it), name_next(&it)
+ *                    Iterate over the list from start to end
+ */
+#define LIST_DEFINE(name, type, cmp)                                          \
+typedef struct name {                                                         \
+    type *elems;                                                              \
+    int head;                                                                 \
+    int size;                                                                 \
+    int capacity;                                                             \
+} name##_t;                                                                   \
+                                                                              \
+typedef struct name##_iter {                                                  \
+    name##_t *list;                                                           \
+    int pos;                                                                  \
+} name##_iter_t;                                                              \
+                                                                              \
+static inline name##_t *name##_create(void)                                   \
+{                                                                             \
+    name##_t *list = malloc(sizeof(name##_t));                                \
+    if (list == NULL)                                                         \
+        fatal_error("out of memory");                                         \
+    list->elems = NULL;                                                       \
+    list->head = 0;                                                           \
+    list->size = 0;                                                           \
+    list->capacity = 0;                                                       \
+    return list;                                                              \
+}                                                                             \
+                                                                              \
+static inline void name##_destroy(name##_t *list)                             \
+{                                                                             \
+    free(list->elems);                                                        \
+    free(list);                                                               \
+}                                                                             \
+                                                                              \
+static inline int name##_size(name##_t *list)                                 \
+{                                                                             \
+    return list->size;                                                        \
+}                                                                             \
+                                                                              \
+/* Moves the elements to a new array of the given capacity, starting at 0 */  \
+static inline void name##_realloc(name##_t *list, int capacity)               \
+{                                                                             \
+    type *elems = malloc(capacity * sizeof(type));                            \
+    int i, first;                                                             \
+    if (elems == NULL)                                                        \
+        fatal_error("out of memory");                                         \
+    /* The elements wrap around the end of the old array at most once */     \
+    first = list->capacity - list->head;                                      \
+    if (first > list->size)                                                   \
+        first = list->size;                                                   \
+    for (i = 0; i < first; i++)                                               \
+        elems[i] = list->elems[list->head + i];                               \
+    for (; i < list->size; i++)                                               \
+        elems[i] = list->elems[i - first];                                    \
+    free(list->elems);                                                        \
+    list->elems = elems;                                                      \
+    list->head = 0;                                                           \
+    list->capacity = capacity;                                                \
+}                                                                             \
+                                                                              \
+static inline void name##_grow(name##_t *list)                                \
+{                                                                             \
+    if (list->size == list->capacity)                                         \
+        name##_realloc(list, list->capacity ?                                 \
+                       list->capacity * 2 : TEMPLATE_MIN_CAPACITY);           \
+}                                                                             \
+                                                                              \
+static inline type name##_get(name##_t *list, int i)                          \
+{                                                                             \
+    if (i < 0 || i >= list->size)                                             \
+        fatal_error("list index out of range");                               \
+    return list->elems[(list->head + i) % list->capacity];                    \
+}                                                                             \
+                                                                              \
+static inline void name##_addfirst(name##_t *list, type elem)                 \
+{                                                                             \
+    name##_grow(list);                                                        \
+    list->head = (list->head + list->capacity - 1) % list->capacity;          \
+    list->elems[list->head] = elem;                                           \
+    list->size++;                                                             \
+}                                                                             \
+                                                                              \
+static inline void name##_addlast(name##_t *list, type elem)                  \
+{                                                                             \
+    name##_grow(list);                                                        \
+    list->elems[(list->head + list->size) % list->capacity] = elem;           \
+    list->size++;                                                             \
+}                                                                             \
+                                                                              \
+static inline type name##_popfirst(name##_t *list)                            \
+{                                                                             \
+    type elem;                                                                \
+    if (list->size == 0)                                                      \
+        fatal_error("can't pop from an empty list");                          \
+    elem = list->elems[list->head];                                           \
+    list->head = (list->head + 1) % list->capacity;                           \
+    list->size--;                                                             \
+    return elem;                                                              \
+}                                                                             \
+                                                                              \
+static inline type name##_poplast(name##_t *list)                             \
+{                                                                             \
+    if (list->size == 0)                                                      \
+        fatal_error("can't pop from an empty list");                          \
+    list->size--;                                                             \
+    return list->elems[(list->head + list->size) % list->capacity];           \
+}                                                                             \
+                                                                              \
+static inline int name##_contains(name##_t *list, type elem)                  \
+{                                                                             \
+    int i;                                                                    \
+    for (i = 0; i < list->size; i++) {                                        \
+        if (cmp(list->elems[(list->head + i) % list->capacity], elem) == 0)   \
+            return 1;                                                         \
+    }                                                                         \
+    return 0;                                                                 \
+}                                                                             \
+                                                                              \
+/* Merge sort, using a scratch array as large as the list */                 \
+static inline void name##_sort(name##_t *list)                                \
+{                                                                             \
+    type *src, *dst, *tmp;                                                    \
+    int width, lo, mid, hi, i, j, k;                                          \
+    if (list->size < 2)                                                       \
+        return;                                                               \
+    if (list->head + list->size > list->capacity)                             \
+        name##_realloc(list, list->capacity);                                 \
+    src = list->elems + list->head;                                           \
+    dst = malloc(list->size * sizeof(type));                                  \
+    if (dst == NULL)                                                          \
+        fatal_error("out of memory");                                         \
+    for (width = 1; width < list->size; width *= 2) {                         \
+        for (lo = 0; lo < list->size; lo += 2 * width) {                      \
+            mid = lo + width < list->size ? lo + width : list->size;          \
+            hi = lo + 2 * width < list->size ? lo + 2 * width : list->size;   \
+            i = lo, j = mid, k = lo;                                          \
+            while (i < mid && j < hi)                                         \
+                dst[k++] = cmp(src[j], src[i]) < 0 ? src[j++] : src[i++];     \
+            while (i < mid)                                                   \
+                dst[k++] = src[i++];                                          \
+            while (j < hi)                                                    \
+                dst[k++] = src[j++];                                          \
+        }                                                                     \
+        tmp = src;                                                            \
+        src = dst;                                                            \
+        dst = tmp;                                                            \
+    }                                                                         \
+    /* The sorted elements are in 'src', and the scratch array in 'dst' */   \
+    if (src != list->elems + list->head) {                                    \
+        memcpy(dst, src, list->size * sizeof(type));                          \
+        free(src);                                                            \
+    }                                                                         \
+    else {                                                                    \
+        free(dst);                                                            \
+    }                                                                         \
+}                                                                             \
+                                                                              \
+static inline name##_iter_t name##_createiter(name##_t *list)                 \
+{                                                                             \
+    name##_iter_t iter = { list, 0 };                                         \
+    return iter;                                                              \
+}                                                                             \
+                                                                              \
+static inline int name##_hasnext(name##_iter_t *iter)                         \
+{                                                                             \
+    return iter->pos < iter->list->size;                                      \
+}                                                                             \
+                                                                              \
+static inline type name##_next(name##_iter_t *iter)                           \
+{                                                                             \
+    return name##_get(iter->list, iter->pos++);                               \
+}
+
+/*
+ * Defines a set of elements of the given type, named 'name'.  The set
+ * is a sorted array, so lookups are binary searches and the set
+ * operations merge their two sorted arrays in a single pass.  Adding an
+ * element shifts the larger elements up, so name_add() is O(n) per
+ * insert, rather than the O(log n) of a balanced tree; building a large
+ * set from unsorted elements is quadratic.  Defines:
+ *
+ *   name_t           The type of sets
+ *   name_create()    Creates a new, empty set
+ *   name_destroy(s)  Destroys the given set
+ *   name_size(s)     Returns the size (cardinality) of the set
+ *   name_add(s, e)   Adds an element to the set, unless already contained
+ *   name_contains(s, e)
+ *                    Returns 1 if the set contains the element, 0 otherwise
+ *   name_union(a, b), name_intersection(a, b), name_difference(a, b)
+ *                    Return a new set, as set_union() and friends do
+ *   name_copy(s)     Returns a copy of the given set
+ *   name_iter_t      The type of set iterators, which need not be destroyed
+ *   name_createiter(s), name_hasnext(&it), name_next(&it)
+ *                    Iterate over the set in ascending order
+ */
+#define SET_DEFINE(name, type, cmp)                                           \
+typedef struct name {                                                         \
+    type *elems;                                                              \
+    int size;                                                                 \
+    int capacity;                                                             \
+} name##_t;                                                                   \
+                                                                              \
+typedef struct name##_iter {                                                  \
+    name##_t *set;                                                            \
+    int pos;                                                                  \
+} name##_iter_t;                                                              \
+                                                                              \
+/* Creates a set with room for the given number of elements */               \
+static inline name##_t *name##_createsized(int capacity)                      \
+{                                                                             \
+    name##_t *set = malloc(sizeof(name##_t));                                 \
+    if (set == NULL)                                                          \
+        fatal_error("out of memory");                                         \
+    if (capacity < TEMPLATE_MIN_CAPACITY)                                     \
+        capacity = TEMPLATE_MIN_CAPACITY;                                     \
+    set->elems = malloc(capacity * sizeof(type));                             \
+    if (set->elems == NULL)                                                   \
+        fatal_error("out of memory");                                         \
+    set->size = 0;                                                            \
+    set->capacity = capacity;                                                 \
+    return set;                                                               \
+}                                                                             \
+                                                                              \
+static inline name##_t *name##_create(void)                                   \
+{                                                                             \
+    return name##_createsized(0);                                             \
+}                                                                             \
+                                                                              \
+static inline void name##_destroy(name##_t *set)                              \
+{                                                                             \
+    free(set->elems);                                                         \
+    free(set);                                                                \
+}                                                                             \
+                                                                              \
+static inline int name##_size(name##_t *set)                                  \
+{                                                                             \
+    return set->size;                                                         \
+}                                                                             \
+                                                                              \
+/*                                                                            \
+ * Returns the position of the first element not less than the given        \
+ * element, which is the element itself if it is contained in the set.       \
+ */                                                                           \
+static inline int name##_search(name##_t *set, type elem)                     \
+{                                                                             \
+    int lo = 0, hi = set->size, mid;                                          \
+    while (lo < hi) {                                                         \
+        mid = lo + (hi - lo) / 2;                                             \
+        if (cmp(set->elems[mid], elem) < 0)                                   \
+            lo = mid + 1;                                                     \
+        else                                                                  \
+            hi = mid;                                                         \
+    }                                                                         \
+    return lo;                                                                \
+}                                                                             \
+                                                                              \
+static inline int name##_contains(name##_t *set, type elem)                   \
+{                                                                             \
+    int pos = name##_search(set, elem);                                       \
+    return pos < set->size && cmp(set->elems[pos], elem) == 0;                \
+}                                                                             \
+                                                                              \
+/* Appends an element larger than all elements of the set */                \
+static inline void name##_append(name##_t *set, type elem)                    \
+{                                                                             \
+    if (set->size == set->capacity) {                                         \
+        type *elems = realloc(set->elems, 2 * set->capacity * sizeof(type));  \
+        if (elems == NULL)                                                    \
+            fatal_error("out of memory");                                     \
+        set->elems = elems;                                                   \
+        set->capacity *= 2;                                                   \
+    }                                                                         \
+    set->elems[set->size++] = elem;                                           \
+}                                                                             \
+                                                                              \
+static inline void name##_add(name##_t *set, type elem)                       \
+{                                                                             \
+    int pos = name##_search(set, elem);                                       \
+    if (pos < set->size && cmp(set->elems[pos], elem) == 0)                   \
+        return;                                                               \
+    /* Make room at the end, then shift the larger elements up by one */     \
+    name##_append(set, elem);                                                 \
+    memmove(&set->elems[pos + 1], &set->elems[pos],                           \
+            (set->size - 1 - pos) * sizeof(type));                            \
+    set->elems[pos] = elem;                                                   \
+}                                                                             \
+                                                                              \
+static inline name##_t *name##_union(name##_t *a, name##_t *b)                \
+{                                                                             \
+    name##_t *set = name##_createsized(a->size + b->size);                    \
+    int i = 0, j = 0, c;                                                      \
+    while (i < a->size && j < b->size) {                                      \
+        c = cmp(a->elems[i], b->elems[j]);                                    \
+        if (c < 0)                                                            \
+            name##_append(set, a->elems[i++]);                                \
+        else if (c > 0)                                                       \
+            name##_append(set, b->elems[j++]);                                \
+        else {                                                                \
+            name##_append(set, a->elems[i++]);                                \
+            j++;                                                              \
+        }                                                                     \
+    }                                                                         \
+    while (i < a->size)                                                       \
+        name##_append(set, a->elems[i++]);                                    \
+    while (j < b->size)                                                       \
+        name##_append(set, b->elems[j++]);                                    \
+    return set;                                                               \
+}                                                                             \
+                                                                              \
+static inline name##_t *name##_intersection(name##_t *a, name##_t *b)         \
+{                                                                             \
+    name##_t *set = name##_createsized(a->size < b->size ? a->size : b->size);\
+    int i = 0, j = 0, c;                                                      \
+    while (i < a->size && j < b->size) {                                      \
+        c = cmp(a->elems[i], b->elems[j]);                                    \
+        if (c < 0)                                                            \
+            i++;                                                              \
+        else if (c > 0)                                                       \
+            j++;                                                              \
+        else {                                                                \
+            name##_append(set, a->elems[i++]);                                \
+            j++;                                                              \
+        }                                                                     \
+    }                                                                         \
+    return set;                                                               \
+}                                                                             \
+                                                                              \
+static inline name##_t *name##_difference(name##_t *a, name##_t *b)           \
+{                                                                             \
+    name##_t *set = name##_createsized(a->size);                              \
+    int i = 0, j = 0, c;                                                      \
+    while (i < a->size && j < b->size) {                                      \
+        c = cmp(a->elems[i], b->elems[j]);                                    \
+        if (c < 0)                                                            \
+            name##_append(set, a->elems[i++]);                                \
+        else if (c > 0)                                                       \
+            j++;                                                              \
+        else {                                                                \
+            i++;                                                              \
+            j++;                                                              \
+        }                                                                     \
+    }                                                                         \
+    while (i < a->size)                                                       \
+        name##_append(set, a->elems[i++]);                                    \
+    return set;                                                               \
+}                                                                             \
+                                                                              \
+static inline name##_t *name##_copy(name##_t *set)                            \
+{                                                                             \
+    name##_t *copy = name##_createsized(set->size);                           \
+    memcpy(copy->elems, set->elems, set->size * sizeof(type));                \
+    copy->size = set->size;                                                   \
+    return copy;                                                              \
+}                                                                             \
+                                                                              \
+static inline name##_iter_t name##_createiter(name##_t *set)                  \
+{                                                                             \
+    name##_iter_t iter = { set, 0 };                                          \
+    return iter;                                                              \
+}                                                                             \
+                                                                              \
+static inline int name##_hasnext(name##_iter_t *iter)                         \
+{                                                                             \
+    return iter->pos < iter->set->size;                                       \
+}                                                                             \
+                                                                              \
+static inline type name##_next(name##_iter_t *iter)                           \
+{                                                                             \
+    return iter->set->elems[iter->pos++];                                     \
+}
+
+/*
+ * Defines a map from keys of type 'ktype' to values of type 'vtype',
+ * named 'name'.  The map is an open addressing hash table with linear
+ * probing, which grows to keep at most three quarters of its slots in
+ * use; keys and values are stored in the slots themselves.  Defines:
+ *
+ *   name_t           The type of maps
+ *   name_create()    Creates a new, empty map
+ *   name_destroy(m)  Destroys the given map
+ *   name_size(m)     Returns the number of keys in the map
+ *   name_put(m, k, v)
+ *                    Maps the key to the value, overwriting any old value
+ *   name_haskey(m, k)
+ *                    Returns 1 if the map contains the key, 0 otherwise
+ *   name_get(m, k)   Returns the value the key maps to
+ *   name_lookup(m, k)
+ *                    Returns a pointer to the value the key maps to, or
+ *                    NULL if the key is not in the map.  The pointer is
+ *                    valid until the next put.
+ *   name_iter_t      The type of map iterators, which need not be destroyed
+ *   name_createiter(m), name_hasnext(&it), name_next(&it, &v)
+ *                    Iterate over the keys of the map, in no particular
+ *                    order; name_next() returns a key and assigns its
+ *                    value to v
+ */
+#define MAP_DEFINE(name, ktype, vtype, cmp, hash)                             \
+typedef struct name##_slot {                                                  \
+    ktype key;                                                                \
+    vtype value;                                                              \
+} name##_slot_t;                                                              \
+                                                                              \
+typedef struct name {                                                         \
+    name##_slot_t *slots;                                                     \
+    char *used;                                                               \
+    int size;                                                                 \
+    int capacity; /* A power of two */                                        \
+} name##_t;                                                                   \
+                                                                              \
+typedef struct name##_iter {                                                  \
+    name##_t *map;                                                            \
+    int pos;                                                                  \
+} name##_iter_t;                                                              \
+                                                                              \
+static inline void name##_alloc(name##_t *map, int capacity)                  \
+{                                                                             \
+    map->slots = malloc(capacity * sizeof(name##_slot_t));                    \
+    map->used = calloc(capacity, 1);                                          \
+    if (map->slots == NULL || map->used == NULL)                              \
+        fatal_error("out of memory");                                         \
+    map->capacity = capacity;                                                 \
+}                                                                             \
+                                                                              \
+static inline name##_t *name##_create(void)                                   \
+{                                                                             \
+    name##_t *map = malloc(sizeof(name##_t));                                 \
+    if (map == NULL)                                                          \
+        fatal_error("out of memory");                                         \
+    name##_alloc(map, TEMPLATE_MIN_CAPACITY);                                 \
+    map->size = 0;                                                            \
+    return map;                                                               \
+}                                                                             \
+                                                                              \
+static inline void name##_destroy(name##_t *map)                              \
+{                                                                             \
+    free(map->slots);                                                         \
+    free(map->used);                                                          \
+    free(map);                                                                \
+}                                                                             \
+                                                                              \
+static inline int name##_size(name##_t *map)                                  \
+{                                                                             \
+    return map->size;                                                         \
+}                                                                             \
+                                                                              \
+/*                                                                            \
+ * Returns the slot holding the given key, or the empty slot where the       \
+ * key would be inserted if it is not in the map.                            \
+ */                                                                           \
+static inline int name##_probe(name##_t *map, ktype key)                      \
+{                                                                             \
+    int pos = (int)((hash(key)) & (map->capacity - 1));                       \
+    while (map->used[pos] && cmp(map->slots[pos].key, key) != 0)              \
+        pos = (pos + 1) & (map->capacity - 1);                                \
+    return pos;                                                               \
+}                                                                             \
+                                                                              \
+static inline void name##_resize(name##_t *map)                               \
+{                                                                             \
+    name##_slot_t *slots = map->slots;                                        \
+    char *used = map->used;                                                   \
+    int i, pos, capacity = map->capacity;                                     \
+    name##_alloc(map, capacity * 2);                                          \
+    for (i = 0; i < capacity; i++) {                                          \
+        if (used[i]) {                                                        \
+            pos = name##_probe(map, slots[i].key);                            \
+            map->slots[pos] = slots[i];                                       \
+            map->used[pos] = 1;                                               \
+        }                                                                     \
+    }                                                                         \
+    free(slots);                                                              \
+    free(used);                                                               \
+}                                                                             \
+                                                                              \
+static inline void name##_put(name##_t *map, ktype key, vtype value)          \
+{                                                                             \
+    int pos = name##_probe(map, key);                                         \
+    if (!map->used[pos]) {                                                    \
+        if (4 * (map->size + 1) > 3 * map->capacity) {                        \
+            name##_resize(map);                                               \
+            pos = name##_probe(map, key);                                     \
+        }                                                                     \
+        map->slots[pos].key = key;                                            \
+        map->used[pos] = 1;                                                   \
+        map->size++;                                                          \
+    }                                                                         \
+    map->slots[pos].value = value;                                            \
+}                                                                             \
+                                                                              \
+static inline vtype *name##_lookup(name##_t *map, ktype key)                  \
+{                                                                             \
+    int pos = name##_probe(map, key);                                         \
+    return map->used[pos] ? &map->slots[pos].value : NULL;                    \
+}                                                                             \
+                                                                              \
+static inline int name##_haskey(name##_t *map, ktype key)                     \
+{                                                                             \
+    return name##_lookup(map, key) != NULL;                                   \
+}                                                                             \
+                                                                              \
+static inline vtype name##_get(name##_t *map, ktype key)                      \
+{                                                                             \
+    vtype *value = name##_lookup(map, key);                                   \
+    if (value == NULL)                                                        \
+        fatal_error("key not found in map");                                  \
+    return *value;                                                            \
+}                                                                             \
+                                                                              \
+static inline name##_iter_t name##_createiter(name##_t *map)                  \
+{                                                                             \
+    name##_iter_t iter = { map, 0 };                                          \
+    while (iter.pos < map->capacity && !map->used[iter.pos])                  \
+        iter.pos++;                                                           \
+    return iter;                                                              \
+}                                                                             \
+                                                                              \
+static inline int name##_hasnext(name##_iter_t *iter)                         \
+{                                                                             \
+    return iter->pos < iter->map->capacity;                                   \
+}                                                                             \
+                                                                              \
+static inline ktype name##_next(name##_iter_t *iter, vtype *value)            \
+{                                                                             \
+    name##_slot_t *slot = &iter->map->slots[iter->pos++];                     \
+    while (iter->pos < iter->map->capacity && !iter->map->used[iter->pos])    \
+        iter->pos++;                                                          \
+    *value = slot->value;                                                     \
+    return slot->key;                                                         \
+}
+
+#endif
@@ -1,6 +1,7 @@
 #include "list.h"
 #include "set.h"
 #include "common.h"
+#include "template.h"
 #include <sys/time.h>
 #include <stdlib.h>
 
@@ -35,6 +36,79 @@ static void *newint(int i)
     return p;
 }
 
+SET_DEFINE(intset, int, SCALAR_CMP)
+
+/*
+ * Runs the add timings of main() on an intset, which stores the ints
+ * themselves and compares them without a function pointer.
+ */
+static void time_intset(void)
+{
+    intset_t *set, *left, *right, *result;
+    unsigned long long t1;
+    int i, j;
+
+    printf("Random add (intset)\n");
+    set = intset_create();
+    for (j = 0; j < 10; j++)
+    {
+        t1 = gettime();
+        for (i = 0; i <= 50*j ; i++)
+            intset_add(set, rand());
+        t1 = gettime() - t1;
+        printf("%d,%lld\n",i-1, t1);
+    }
+    intset_destroy(set);
+    puts("");
+
+    printf("Reverse stair add (intset)\n");
+    set = intset_create();
+    for (j = 0; j < 10; j++)
+    {
+        t1 = gettime();
+        for (i = 0; i <= 50*j ; i++)
+            intset_add(set, i);
+        t1 = gettime() - t1;
+        printf("%d,%lld\n",i-1, t1);
+    }
+    intset_destroy(set);
+    puts("");
+
+    printf("Constant add (intset)\n");
+    set = intset_create();
+    for (j = 0; j < 10; j++)
+    {
+        t1 = gettime();
+        for (i = 0; i <= 50*j ; i++)
+            intset_add(set, 1337);
+        t1 = gettime() - t1;
+        printf("%d,%lld\n",i-1, t1);
+    }
+    intset_destroy(set);
+    puts("");
+
+    left = intset_create();
+    right = intset_create();
+    for (i = 0; i <= 50 ; i++)
+    {
+        intset_add(left, rand());
+        intset_add(right, rand());
+    }
+    printf("Constant union/intersection/difference (intset)\n");
+    for (j = 0; j < 10; j++)
+    {
+        t1 = gettime();
+        for (i = 0; i <= 50*j ; i++)
+        {
+            result = intset_union(left, right);
+            intset_destroy(result);
+        }
+        t1 = gettime() - t1;
+        printf("%d,%lld\n",i-1, t1);
+    }
+    intset_destroy(left);
+    intset_destroy(right);
+}
 
 int main(int argc, char **argv)
 {
@@ -113,4 +187,7 @@ int main(int argc, char **argv)
         printf("%d,%lld\n",i-1, t1);                   
     }
 
-}
\ No newline at end of file
+    puts("");
+
+    time_intset();
+}